@@ -0,0 +1,58 @@
+#include "AuthFile.hpp"
+#include <cctype>
+#include <fstream>
+#include <stdexcept>
+
+// "значение" с удвоенными кавычками внутри; pos сдвигается за него
+static bool quoted(const std::string &line, size_t &pos, std::string &out) {
+	while (pos < line.size() && isspace(static_cast<unsigned char>(line[pos])))
+		++pos;
+	if (pos >= line.size() || line[pos] != '"')
+		return false;
+	++pos;
+
+	out.clear();
+	while (pos < line.size()) {
+		if (line[pos] == '"') {
+			if (pos + 1 < line.size() && line[pos + 1] == '"') {
+				out.push_back('"');
+				pos += 2;
+				continue;
+			}
+			++pos;
+			return true;
+		}
+		out.push_back(line[pos++]);
+	}
+	return false;
+}
+
+AuthFile::AuthFile(const std::string &path) : path(path) {
+	std::ifstream in(path);
+	if (!in) {
+		throw std::runtime_error("Cannot open auth file " + path);
+	}
+
+	std::string line;
+	int line_no = 0;
+	while (std::getline(in, line)) {
+		++line_no;
+		size_t first = line.find_first_not_of(" \t\r");
+		if (first == std::string::npos || line[first] == ';' ||
+			line[first] == '#')
+			continue;
+
+		size_t pos = first;
+		std::string user, password;
+		if (!quoted(line, pos, user) || !quoted(line, pos, password)) {
+			throw std::runtime_error("Malformed auth file " + path +
+									 " at line " + std::to_string(line_no));
+		}
+		passwords[user] = password;
+	}
+}
+
+const std::string *AuthFile::password(const std::string &user) const {
+	auto it = passwords.find(user);
+	return it == passwords.end() ? nullptr : &it->second;
+}
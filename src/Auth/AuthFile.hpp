@@ -0,0 +1,22 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+
+// Пароли пользователей в формате userlist.txt pgbouncer:
+//   "user" "password"
+// по строке на пользователя, строки с ';' или '#' - комментарии, кавычка
+// внутри значения удваивается. Пароли нужны в открытом виде: ими прокси
+// проверяет клиентов (md5) и сам входит на сервер (cleartext, md5, SCRAM).
+class AuthFile {
+  public:
+	AuthFile() = default;
+	explicit AuthFile(const std::string &path);
+
+	bool loaded() const { return !path.empty(); }
+	// nullptr, если пользователя нет в файле
+	const std::string *password(const std::string &user) const;
+
+  private:
+	std::string path;
+	std::unordered_map<std::string, std::string> passwords;
+};
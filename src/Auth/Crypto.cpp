@@ -0,0 +1,312 @@
+#include "Crypto.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/random.h>
+#include <system_error>
+
+static uint32_t rotl(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+// RFC 1321
+Md5Digest md5(std::string_view data) {
+	static const uint32_t K[64] = {
+		0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+		0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+		0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+		0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+		0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+		0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+		0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+		0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+		0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+		0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+		0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391};
+	static const int S[64] = {7,  12, 17, 22, 7,  12, 17, 22, 7,  12, 17, 22, 7,
+							  12, 17, 22, 5,  9,  14, 20, 5,  9,  14, 20, 5,  9,
+							  14, 20, 5,  9,  14, 20, 4,  11, 16, 23, 4,  11, 16,
+							  23, 4,  11, 16, 23, 4,  11, 16, 23, 6,  10, 15, 21,
+							  6,  10, 15, 21, 6,  10, 15, 21, 6,  10, 15, 21};
+
+	std::string msg(data);
+	uint64_t bit_len = static_cast<uint64_t>(data.size()) * 8;
+	msg.push_back(static_cast<char>(0x80));
+	while (msg.size() % 64 != 56)
+		msg.push_back(0);
+	for (int i = 0; i < 8; ++i)
+		msg.push_back(static_cast<char>(bit_len >> (8 * i)));
+
+	uint32_t h[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	for (size_t off = 0; off < msg.size(); off += 64) {
+		uint32_t m[16];
+		for (int i = 0; i < 16; ++i) {
+			const auto *p =
+				reinterpret_cast<const uint8_t *>(msg.data() + off + i * 4);
+			m[i] = p[0] | (p[1] << 8) | (p[2] << 16) |
+				   (static_cast<uint32_t>(p[3]) << 24);
+		}
+
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+		for (int i = 0; i < 64; ++i) {
+			uint32_t f;
+			int g;
+			if (i < 16) {
+				f = (b & c) | (~b & d);
+				g = i;
+			} else if (i < 32) {
+				f = (d & b) | (~d & c);
+				g = (5 * i + 1) % 16;
+			} else if (i < 48) {
+				f = b ^ c ^ d;
+				g = (3 * i + 5) % 16;
+			} else {
+				f = c ^ (b | ~d);
+				g = (7 * i) % 16;
+			}
+			uint32_t tmp = d;
+			d = c;
+			c = b;
+			b = b + rotl(a + f + K[i] + m[g], S[i]);
+			a = tmp;
+		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+	}
+
+	Md5Digest digest;
+	for (int i = 0; i < 16; ++i)
+		digest[i] = static_cast<uint8_t>(h[i / 4] >> (8 * (i % 4)));
+	return digest;
+}
+
+std::string md5Hex(std::string_view data) {
+	static const char HEX[] = "0123456789abcdef";
+	Md5Digest digest = md5(data);
+	std::string out;
+	out.reserve(32);
+	for (uint8_t byte : digest) {
+		out.push_back(HEX[byte >> 4]);
+		out.push_back(HEX[byte & 0xf]);
+	}
+	return out;
+}
+
+// FIPS 180-4
+static const uint32_t SHA256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+Sha256::Sha256()
+	: state{0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f,
+			0x9b05688c, 0x1f83d9ab, 0x5be0cd19} {}
+
+void Sha256::block(const uint8_t *p) {
+	uint32_t w[64];
+	for (int i = 0; i < 16; ++i)
+		w[i] = (static_cast<uint32_t>(p[i * 4]) << 24) | (p[i * 4 + 1] << 16) |
+			   (p[i * 4 + 2] << 8) | p[i * 4 + 3];
+	for (int i = 16; i < 64; ++i) {
+		uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+	for (int i = 0; i < 64; ++i) {
+		uint32_t s1 = rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25);
+		uint32_t ch = (e & f) ^ (~e & g);
+		uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+		uint32_t s0 = rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22);
+		uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+		uint32_t t2 = s0 + maj;
+		h = g;
+		g = f;
+		f = e;
+		e = d + t1;
+		d = c;
+		c = b;
+		b = a;
+		a = t1 + t2;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+void Sha256::update(const void *data, size_t len) {
+	const auto *p = static_cast<const uint8_t *>(data);
+	total += len;
+	while (len > 0) {
+		size_t take = std::min(len, sizeof(buffer) - buffered);
+		std::memcpy(buffer + buffered, p, take);
+		buffered += take;
+		p += take;
+		len -= take;
+		if (buffered == sizeof(buffer)) {
+			block(buffer);
+			buffered = 0;
+		}
+	}
+}
+
+Sha256Digest Sha256::finish() {
+	uint64_t bit_len = total * 8;
+	uint8_t pad = 0x80;
+	update(&pad, 1);
+	pad = 0;
+	while (buffered != 56)
+		update(&pad, 1);
+	uint8_t len_be[8];
+	for (int i = 0; i < 8; ++i)
+		len_be[i] = static_cast<uint8_t>(bit_len >> (56 - 8 * i));
+	update(len_be, sizeof(len_be));
+
+	Sha256Digest digest;
+	for (int i = 0; i < 32; ++i)
+		digest[i] = static_cast<uint8_t>(state[i / 4] >> (24 - 8 * (i % 4)));
+	return digest;
+}
+
+Sha256Digest sha256(std::string_view data) {
+	Sha256 ctx;
+	ctx.update(data.data(), data.size());
+	return ctx.finish();
+}
+
+// RFC 2104
+Sha256Digest hmacSha256(std::string_view key, std::string_view data) {
+	uint8_t block_key[64] = {};
+	if (key.size() > sizeof(block_key)) {
+		Sha256Digest hashed = sha256(key);
+		std::memcpy(block_key, hashed.data(), hashed.size());
+	} else {
+		std::memcpy(block_key, key.data(), key.size());
+	}
+
+	uint8_t ipad[64], opad[64];
+	for (int i = 0; i < 64; ++i) {
+		ipad[i] = block_key[i] ^ 0x36;
+		opad[i] = block_key[i] ^ 0x5c;
+	}
+
+	Sha256 inner;
+	inner.update(ipad, sizeof(ipad));
+	inner.update(data.data(), data.size());
+	Sha256Digest inner_digest = inner.finish();
+
+	Sha256 outer;
+	outer.update(opad, sizeof(opad));
+	outer.update(inner_digest.data(), inner_digest.size());
+	return outer.finish();
+}
+
+Sha256Digest pbkdf2Sha256(std::string_view password, std::string_view salt,
+						  unsigned iterations) {
+	std::string first(salt);
+	first.append("\0\0\0\1", 4);
+
+	Sha256Digest u = hmacSha256(password, first);
+	Sha256Digest result = u;
+	for (unsigned i = 1; i < iterations; ++i) {
+		u = hmacSha256(password,
+					   std::string_view(reinterpret_cast<const char *>(u.data()),
+										u.size()));
+		for (size_t j = 0; j < result.size(); ++j)
+			result[j] ^= u[j];
+	}
+	return result;
+}
+
+static const char BASE64[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+std::string base64Encode(std::string_view data) {
+	std::string out;
+	out.reserve((data.size() + 2) / 3 * 4);
+	size_t i = 0;
+	for (; i + 2 < data.size(); i += 3) {
+		uint32_t v = (static_cast<uint8_t>(data[i]) << 16) |
+					 (static_cast<uint8_t>(data[i + 1]) << 8) |
+					 static_cast<uint8_t>(data[i + 2]);
+		out.push_back(BASE64[v >> 18]);
+		out.push_back(BASE64[(v >> 12) & 63]);
+		out.push_back(BASE64[(v >> 6) & 63]);
+		out.push_back(BASE64[v & 63]);
+	}
+	if (i + 1 == data.size()) {
+		uint32_t v = static_cast<uint8_t>(data[i]) << 16;
+		out.push_back(BASE64[v >> 18]);
+		out.push_back(BASE64[(v >> 12) & 63]);
+		out.append("==");
+	} else if (i + 2 == data.size()) {
+		uint32_t v = (static_cast<uint8_t>(data[i]) << 16) |
+					 (static_cast<uint8_t>(data[i + 1]) << 8);
+		out.push_back(BASE64[v >> 18]);
+		out.push_back(BASE64[(v >> 12) & 63]);
+		out.push_back(BASE64[(v >> 6) & 63]);
+		out.push_back('=');
+	}
+	return out;
+}
+
+bool base64Decode(std::string_view text, std::string &out) {
+	out.clear();
+	uint32_t acc = 0;
+	int bits = 0;
+	for (char c : text) {
+		if (c == '=')
+			break;
+		const char *pos = std::strchr(BASE64, c);
+		if (c == '\0' || pos == nullptr)
+			return false;
+		acc = (acc << 6) | static_cast<uint32_t>(pos - BASE64);
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out.push_back(static_cast<char>((acc >> bits) & 0xff));
+		}
+	}
+	return true;
+}
+
+bool constantTimeEquals(std::string_view a, std::string_view b) {
+	if (a.size() != b.size())
+		return false;
+	// volatile не дает компилятору выйти из цикла досрочно
+	volatile uint8_t diff = 0;
+	for (size_t i = 0; i < a.size(); ++i)
+		diff = diff | (static_cast<uint8_t>(a[i]) ^ static_cast<uint8_t>(b[i]));
+	return diff == 0;
+}
+
+void randomBytes(void *out, size_t len) {
+	auto *p = static_cast<uint8_t *>(out);
+	while (len > 0) {
+		ssize_t n = getrandom(p, len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::system_category(),
+									"getrandom() failed");
+		}
+		p += n;
+		len -= n;
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Хэши и кодировки, нужные для аутентификации PostgreSQL (md5 и
+// SCRAM-SHA-256). Реализованы здесь, чтобы не тянуть OpenSSL ради пары
+// функций на пути логина.
+
+using Md5Digest = std::array<uint8_t, 16>;
+using Sha256Digest = std::array<uint8_t, 32>;
+
+Md5Digest md5(std::string_view data);
+// 32 строчных шестнадцатеричных символа
+std::string md5Hex(std::string_view data);
+
+class Sha256 {
+  public:
+	Sha256();
+	void update(const void *data, size_t len);
+	Sha256Digest finish();
+
+  private:
+	void block(const uint8_t *p);
+
+	uint32_t state[8];
+	uint8_t buffer[64];
+	size_t buffered = 0;
+	uint64_t total = 0;
+};
+
+Sha256Digest sha256(std::string_view data);
+Sha256Digest hmacSha256(std::string_view key, std::string_view data);
+// PBKDF2-HMAC-SHA-256 с длиной результата в один блок (Hi() из RFC 5802)
+Sha256Digest pbkdf2Sha256(std::string_view password, std::string_view salt,
+						  unsigned iterations);
+
+std::string base64Encode(std::string_view data);
+// false, если во входе есть символы не из алфавита base64
+bool base64Decode(std::string_view text, std::string &out);
+
+// сравнение секретов за время, не зависящее от места первого различия
+bool constantTimeEquals(std::string_view a, std::string_view b);
+
+// криптографически стойкие случайные байты (getrandom)
+void randomBytes(void *out, size_t len);
@@ -0,0 +1,83 @@
+#include "Scram.hpp"
+#include "Crypto.hpp"
+#include <cstdlib>
+#include <utility>
+
+static std::string_view digestView(const Sha256Digest &digest) {
+	return {reinterpret_cast<const char *>(digest.data()), digest.size()};
+}
+
+// значение атрибута name ("r", "s", "i", "v") из списка a=b,c=d
+static bool attribute(std::string_view message, char name,
+					  std::string_view &value) {
+	while (!message.empty()) {
+		size_t comma = message.find(',');
+		std::string_view item = message.substr(0, comma);
+		if (item.size() >= 2 && item[0] == name && item[1] == '=') {
+			value = item.substr(2);
+			return true;
+		}
+		if (comma == std::string_view::npos)
+			break;
+		message.remove_prefix(comma + 1);
+	}
+	return false;
+}
+
+ScramClient::ScramClient(std::string password) : password(std::move(password)) {}
+
+std::string ScramClient::clientFirstMessage() {
+	char raw[18];
+	randomBytes(raw, sizeof(raw));
+	client_nonce = base64Encode(std::string_view(raw, sizeof(raw)));
+	client_first_bare = "n=,r=" + client_nonce;
+	return "n,," + client_first_bare;
+}
+
+bool ScramClient::clientFinalMessage(std::string_view server_first,
+									 std::string &out) {
+	std::string_view nonce, salt_b64, iterations_str;
+	if (!attribute(server_first, 'r', nonce) ||
+		!attribute(server_first, 's', salt_b64) ||
+		!attribute(server_first, 'i', iterations_str))
+		return false;
+	// серверный nonce обязан продолжать наш
+	if (nonce.substr(0, client_nonce.size()) != client_nonce ||
+		nonce.size() == client_nonce.size())
+		return false;
+
+	std::string salt;
+	if (!base64Decode(salt_b64, salt))
+		return false;
+	long iterations = strtol(std::string(iterations_str).c_str(), nullptr, 10);
+	if (iterations <= 0)
+		return false;
+
+	Sha256Digest salted = pbkdf2Sha256(password, salt, iterations);
+	Sha256Digest client_key = hmacSha256(digestView(salted), "Client Key");
+	Sha256Digest stored_key = sha256(digestView(client_key));
+
+	// "biws" = base64("n,,")
+	std::string final_without_proof = "c=biws,r=" + std::string(nonce);
+	std::string auth_message = client_first_bare + "," +
+							   std::string(server_first) + "," +
+							   final_without_proof;
+
+	Sha256Digest signature = hmacSha256(digestView(stored_key), auth_message);
+	Sha256Digest proof;
+	for (size_t i = 0; i < proof.size(); ++i)
+		proof[i] = client_key[i] ^ signature[i];
+
+	Sha256Digest server_key = hmacSha256(digestView(salted), "Server Key");
+	server_signature = base64Encode(
+		digestView(hmacSha256(digestView(server_key), auth_message)));
+
+	out = final_without_proof + ",p=" + base64Encode(digestView(proof));
+	return true;
+}
+
+bool ScramClient::verifyServerFinal(std::string_view server_final) const {
+	std::string_view verifier;
+	return attribute(server_final, 'v', verifier) &&
+		   constantTimeEquals(verifier, server_signature);
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+// Клиентская сторона SCRAM-SHA-256 (RFC 5802, RFC 7677) в варианте
+// PostgreSQL: без channel binding, имя пользователя берется из
+// StartupMessage, поэтому в сообщениях оно пустое.
+class ScramClient {
+  public:
+	explicit ScramClient(std::string password);
+
+	// тело SASLInitialResponse
+	std::string clientFirstMessage();
+	// по AuthenticationSASLContinue возвращает client-final-message;
+	// false, если ответ сервера некорректен
+	bool clientFinalMessage(std::string_view server_first, std::string &out);
+	// проверка подписи сервера из AuthenticationSASLFinal
+	bool verifyServerFinal(std::string_view server_final) const;
+
+  private:
+	std::string password;
+	std::string client_nonce;
+	std::string client_first_bare;
+	std::string server_signature;
+};
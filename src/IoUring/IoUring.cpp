@@ -0,0 +1,180 @@
+#include "IoUring.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <system_error>
+#include <unistd.h>
+
+static int sysSetup(unsigned entries, io_uring_params *params) {
+	return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int sysEnter(int fd, unsigned to_submit, unsigned min_complete,
+					unsigned flags) {
+	return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit,
+									min_complete, flags, nullptr, 0));
+}
+
+static int sysRegister(int fd, unsigned opcode, void *arg,
+					   unsigned nr_args) {
+	return static_cast<int>(
+		syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+// head/tail колец разделяются с ядром
+static unsigned loadAcquire(const unsigned *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+static void storeRelease(unsigned *p, unsigned value) {
+	__atomic_store_n(p, value, __ATOMIC_RELEASE);
+}
+
+IoUring::IoUring(unsigned entries) {
+	io_uring_params params{};
+	ring_fd = sysSetup(entries, &params);
+	if (ring_fd < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"io_uring_setup() failed");
+	}
+	sq_entries = params.sq_entries;
+
+	sq_ptr_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ptr_size =
+		params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap)
+		sq_ptr_size = cq_ptr_size = std::max(sq_ptr_size, cq_ptr_size);
+
+	sq_ptr = mmap(nullptr, sq_ptr_size, PROT_READ | PROT_WRITE,
+				  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED) {
+		throw std::system_error(errno, std::system_category(),
+								"mmap(SQ ring) failed");
+	}
+	if (single_mmap) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(nullptr, cq_ptr_size, PROT_READ | PROT_WRITE,
+					  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED) {
+			throw std::system_error(errno, std::system_category(),
+									"mmap(CQ ring) failed");
+		}
+	}
+
+	sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+	sqes = static_cast<io_uring_sqe *>(
+		mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+			 MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+	if (sqes == MAP_FAILED) {
+		throw std::system_error(errno, std::system_category(),
+								"mmap(SQEs) failed");
+	}
+
+	char *sq = static_cast<char *>(sq_ptr);
+	sq_head = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	sqe_head = sqe_tail = *sq_tail;
+
+	char *cq = static_cast<char *>(cq_ptr);
+	cq_head = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+}
+
+IoUring::~IoUring() {
+	if (buf_ring)
+		munmap(buf_ring, buf_ring_size);
+	if (sqes)
+		munmap(sqes, sqes_size);
+	if (cq_ptr && cq_ptr != sq_ptr)
+		munmap(cq_ptr, cq_ptr_size);
+	if (sq_ptr)
+		munmap(sq_ptr, sq_ptr_size);
+	if (ring_fd >= 0)
+		close(ring_fd);
+}
+
+io_uring_sqe *IoUring::getSqe() {
+	if (sqe_tail - loadAcquire(sq_head) >= sq_entries) {
+		submit();
+		if (sqe_tail - loadAcquire(sq_head) >= sq_entries)
+			return nullptr;
+	}
+	io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+	++sqe_tail;
+	std::memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+void IoUring::reserveSqes(unsigned n) {
+	if (sqe_tail - loadAcquire(sq_head) + n > sq_entries)
+		submit();
+}
+
+int IoUring::submit(unsigned wait_nr) {
+	unsigned to_submit = sqe_tail - sqe_head;
+	if (to_submit > 0) {
+		unsigned tail = *sq_tail;
+		for (; sqe_head != sqe_tail; ++sqe_head, ++tail)
+			sq_array[tail & sq_mask] = sqe_head & sq_mask;
+		storeRelease(sq_tail, tail);
+	}
+
+	if (to_submit == 0 && wait_nr == 0)
+		return 0;
+
+	unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while (true) {
+		int ret = sysEnter(ring_fd, to_submit, wait_nr, flags);
+		if (ret >= 0 || errno != EINTR)
+			return ret;
+	}
+}
+
+io_uring_cqe *IoUring::peekCqe() {
+	unsigned head = *cq_head;
+	if (head == loadAcquire(cq_tail))
+		return nullptr;
+	return &cqes[head & cq_mask];
+}
+
+void IoUring::cqeSeen() { storeRelease(cq_head, *cq_head + 1); }
+
+io_uring_buf_ring *IoUring::registerBufferRing(uint16_t group,
+											   unsigned entries) {
+	// ядро требует память кольца, выровненную по странице
+	buf_ring_size = entries * sizeof(io_uring_buf);
+	buf_ring = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf_ring == MAP_FAILED) {
+		buf_ring = nullptr;
+		throw std::system_error(errno, std::system_category(),
+								"mmap(buffer ring) failed");
+	}
+
+	io_uring_buf_reg reg{};
+	reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring);
+	reg.ring_entries = entries;
+	reg.bgid = group;
+	if (sysRegister(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(buf_ring, buf_ring_size);
+		buf_ring = nullptr;
+		return nullptr;
+	}
+	return static_cast<io_uring_buf_ring *>(buf_ring);
+}
+
+void IoUring::unregisterBufferRing(uint16_t group) {
+	io_uring_buf_reg reg{};
+	reg.bgid = group;
+	sysRegister(ring_fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+	munmap(buf_ring, buf_ring_size);
+	buf_ring = nullptr;
+}
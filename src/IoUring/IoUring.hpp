@@ -0,0 +1,59 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <linux/io_uring.h>
+
+// Минимальная обертка над io_uring на системных вызовах (без liburing):
+// кольца SQ/CQ. Не потокобезопасна, принадлежит одному воркеру.
+class IoUring {
+  public:
+	explicit IoUring(unsigned entries);
+	~IoUring();
+
+	IoUring(const IoUring &) = delete;
+	IoUring &operator=(const IoUring &) = delete;
+
+	// при заполненной SQ сначала отправляет накопленное ядру
+	io_uring_sqe *getSqe();
+	// гарантирует n свободных мест в SQ (цепочки IOSQE_IO_LINK нельзя
+	// разрывать отправкой посередине)
+	void reserveSqes(unsigned n);
+	// отправляет накопленные SQE и ждет не менее wait_nr завершений
+	int submit(unsigned wait_nr = 0);
+
+	io_uring_cqe *peekCqe();
+	void cqeSeen();
+
+	// регистрирует кольцо буферов группы group (IORING_REGISTER_PBUF_RING);
+	// entries - степень двойки, nullptr - ядро кольца не поддерживает.
+	// Память кольца принадлежит IoUring, кольцо одно.
+	io_uring_buf_ring *registerBufferRing(uint16_t group, unsigned entries);
+	void unregisterBufferRing(uint16_t group);
+
+  private:
+	int ring_fd = -1;
+	unsigned sq_entries = 0;
+
+	void *sq_ptr = nullptr;
+	size_t sq_ptr_size = 0;
+	void *cq_ptr = nullptr;
+	size_t cq_ptr_size = 0;
+	io_uring_sqe *sqes = nullptr;
+	size_t sqes_size = 0;
+
+	unsigned *sq_head = nullptr;
+	unsigned *sq_tail = nullptr;
+	unsigned sq_mask = 0;
+	unsigned *sq_array = nullptr;
+	// SQE, выданные getSqe(), но еще не опубликованные в sq_tail
+	unsigned sqe_head = 0;
+	unsigned sqe_tail = 0;
+
+	unsigned *cq_head = nullptr;
+	unsigned *cq_tail = nullptr;
+	unsigned cq_mask = 0;
+	io_uring_cqe *cqes = nullptr;
+
+	void *buf_ring = nullptr;
+	size_t buf_ring_size = 0;
+};
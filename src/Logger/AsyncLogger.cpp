@@ -1,33 +1,58 @@
 #include "AsyncLogger.hpp"
+#include <algorithm>
+#include <cstdio>
 #include <cstring>
+#include <ctime>
+#include <dirent.h>
 #include <fcntl.h>
+#include <stdexcept>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
-// т.к. предполагается что файл логов будет большим, нужно заранее выделить хотя бы 1 гб
-constexpr size_t INITIAL_FILE_SIZE = 1024ULL * 1024 * 1024;
+// длина-маркер: остаток кольца до конца пуст, запись продолжается с начала
+constexpr uint32_t WRAP = UINT32_MAX;
 
-AsyncLogger::AsyncLogger(const std::string &filename, size_t batchSize,
-						 int flushIntervalMs)
-	: filename(filename), batchSize(batchSize),
+static size_t recordSize(size_t len) {
+	return (sizeof(uint32_t) + len + 3) & ~size_t(3);
+}
+
+LogRing::LogRing(size_t capacity, bool shared)
+	: shared(shared), capacity(capacity), data(new char[capacity]) {}
+
+// полей у одной бинарной записи не больше
+constexpr size_t MAX_RECORD_FIELDS = 8;
+
+AsyncLogger::AsyncLogger(const std::string &filename, LogFormat format,
+						 const LogSegmentOptions &segments,
+						 const LogQueueOptions &queue, int flushIntervalMs)
+	: filename(filename), format(format), segments(segments),
+	  overflow(queue.overflow), sampleRate(std::max(queue.sample_rate, 1u)),
 	  flushIntervalMs(flushIntervalMs) {
-	fd = open(filename.c_str(), O_RDWR | O_CREAT, 0666);
-	if (fd < 0) {
-		perror("open");
-		throw std::runtime_error("Failed to open log file");
-	}
+	// позиция в кольце берется маской, поэтому размер - степень двойки
+	ringBytes = 4096;
+	while (ringBytes < queue.ring_bytes)
+		ringBytes <<= 1;
 
-	if (ftruncate(fd, INITIAL_FILE_SIZE) != 0) {
-		perror("ftruncate");
-		throw std::runtime_error("Failed to set file size");
-	}
+	ownedRings.push_back(std::make_unique<LogRing>(ringBytes, true));
+	rings[0] = ownedRings[0].get();
+	ringCount.store(1, std::memory_order_release);
 
-	mappedSize = INITIAL_FILE_SIZE;
-	mapped = static_cast<char *>(
-		mmap(nullptr, mappedSize, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0));
-	if (mapped == MAP_FAILED) {
-		perror("mmap");
-		throw std::runtime_error("Failed to mmap file");
-	}
+	// resources/logs.txt -> resources/logs.<seq>.txt
+	size_t slash = filename.rfind('/');
+	size_t dot = filename.rfind('.');
+	if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		dot = filename.size();
+	stem = filename.substr(0, dot);
+	extension = filename.substr(dot);
+
+	// запись вместе с определением ее текста не должна пересекать границу
+	// сегмента
+	this->segments.segment_bytes =
+		std::max(segments.segment_bytes, LOG_SEGMENT_HEADER_SIZE + ringBytes);
+
+	recoverSegments();
+	if (!openSegment())
+		throw std::runtime_error("Failed to open log segment");
 
 	worker = std::thread(&AsyncLogger::process, this);
 }
@@ -41,116 +66,419 @@ AsyncLogger::~AsyncLogger() {
 	if (worker.joinable())
 		worker.join();
 
-	if (mapped != MAP_FAILED && mapped != nullptr)
-		munmap(mapped, mappedSize);
-	if (fd >= 0)
-		close(fd);
+	closeSegment(true);
 }
 
-void AsyncLogger::log(std::string message) {
-	{
-		std::lock_guard<std::mutex> lock(mutex);
-		frontBuffer.push_back(std::move(message));
+LogRing &AsyncLogger::threadRing() {
+	thread_local const AsyncLogger *owner = nullptr;
+	thread_local LogRing *ring = nullptr;
+	if (owner == this)
+		return *ring;
 
-		if (frontBuffer.size() >= batchSize) {
-			cv.notify_one();
+	// один раз на поток: дальше кольцо берется из thread_local
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t count = ringCount.load(std::memory_order_relaxed);
+	if (count <= MAX_PRODUCERS) {
+		ownedRings.push_back(std::make_unique<LogRing>(ringBytes));
+		rings[count] = ownedRings.back().get();
+		ringCount.store(count + 1, std::memory_order_release);
+		ring = rings[count];
+	} else {
+		ring = rings[0];
+	}
+	owner = this;
+	return *ring;
+}
+
+void AsyncLogger::writeRecord(LogRecordType type, uint64_t connectionId,
+							  uint32_t statementId, std::string_view *fields,
+							  size_t count) {
+	count = std::min(count, MAX_RECORD_FIELDS);
+
+	// write() обрезает слишком длинные записи по хвосту, что сломало бы
+	// разметку полей, поэтому поля укорачиваются здесь
+	size_t budget = ringBytes / 2 - sizeof(uint32_t) - sizeof(LogRecordHeader) -
+					count * sizeof(uint32_t);
+	uint32_t lengths[MAX_RECORD_FIELDS];
+	std::string_view parts[1 + 2 * MAX_RECORD_FIELDS];
+
+	LogRecordHeader header{};
+	header.type = type;
+	header.connection_id = connectionId;
+	header.statement_id = statementId;
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	header.timestamp_ns =
+		static_cast<uint64_t>(now.tv_sec) * 1'000'000'000 + now.tv_nsec;
+
+	for (size_t i = 0; i < count; ++i) {
+		if (fields[i].size() > budget)
+			fields[i] = fields[i].substr(0, budget);
+		budget -= fields[i].size();
+		lengths[i] = static_cast<uint32_t>(fields[i].size());
+		header.length += sizeof(uint32_t) + lengths[i];
+		parts[1 + 2 * i] = std::string_view(
+			reinterpret_cast<const char *>(&lengths[i]), sizeof(uint32_t));
+		parts[2 + 2 * i] = fields[i];
+	}
+	parts[0] = std::string_view(reinterpret_cast<const char *>(&header),
+								sizeof(header));
+	write(parts, 1 + 2 * count, type == LogRecordType::Statement);
+}
+
+void AsyncLogger::write(const std::string_view *parts, size_t count,
+						bool essential) {
+	LogRing &ring = threadRing();
+	const size_t mask = ring.capacity - 1;
+
+	// запись длиннее половины кольца обрезается, иначе она может никогда
+	// не поместиться
+	size_t len = 0;
+	for (size_t i = 0; i < count; ++i)
+		len += parts[i].size();
+	len = std::min(len, ring.capacity / 2 - sizeof(uint32_t));
+	size_t need = recordSize(len);
+
+	if (ring.shared) {
+		while (ring.lock.test_and_set(std::memory_order_acquire))
+			std::this_thread::yield();
+	}
+
+	uint64_t head = ring.head.load(std::memory_order_relaxed);
+	size_t offset = head & mask;
+	size_t contiguous = ring.capacity - offset;
+	size_t total = contiguous < need ? contiguous + need : need;
+
+	auto drop = [&] {
+		ring.dropped.fetch_add(1, std::memory_order_relaxed);
+		if (ring.shared)
+			ring.lock.clear(std::memory_order_release);
+		cv.notify_one();
+	};
+
+	if (overflow == LogOverflow::Sample && !essential &&
+		head + total - ring.cachedTail > ring.capacity / 4 * 3) {
+		ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+		if (head + total - ring.cachedTail > ring.capacity / 4 * 3 &&
+			ring.sampled++ % sampleRate != 0) {
+			drop();
+			return;
+		}
+	}
+
+	bool waited = false;
+	while (head + total - ring.cachedTail > ring.capacity) {
+		ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+		if (head + total - ring.cachedTail <= ring.capacity)
+			break;
+		if (overflow != LogOverflow::Block && !essential) {
+			drop();
+			return;
+		}
+		// кольцо заполнено: будим поток записи и ждем
+		if (!waited) {
+			ring.blocked.fetch_add(1, std::memory_order_relaxed);
+			waited = true;
 		}
+		cv.notify_one();
+		std::this_thread::yield();
 	}
+
+	if (contiguous < need) {
+		uint32_t marker = WRAP;
+		std::memcpy(ring.data.get() + offset, &marker, sizeof(marker));
+		head += contiguous;
+		offset = 0;
+	}
+
+	char *dst = ring.data.get() + offset;
+	uint32_t len32 = static_cast<uint32_t>(len);
+	std::memcpy(dst, &len32, sizeof(len32));
+	dst += sizeof(len32);
+	size_t left = len;
+	for (size_t i = 0; i < count && left > 0; ++i) {
+		size_t n = std::min(parts[i].size(), left);
+		std::memcpy(dst, parts[i].data(), n);
+		dst += n;
+		left -= n;
+	}
+	head += need;
+	ring.head.store(head, std::memory_order_release);
+
+	// поток записи просыпается сам раз в flushIntervalMs; раньше его стоит
+	// будить только если кольцо заполнено больше чем наполовину. cachedTail
+	// общего кольца защищен его блокировкой, поэтому проверка до ее снятия.
+	bool wake = false;
+	if (head - ring.cachedTail > ring.capacity / 2) {
+		ring.cachedTail = ring.tail.load(std::memory_order_acquire);
+		wake = head - ring.cachedTail > ring.capacity / 2;
+	}
+
+	if (ring.shared)
+		ring.lock.clear(std::memory_order_release);
+	if (wake)
+		cv.notify_one();
 }
 
-void AsyncLogger::ensureCapacity(size_t requiredSize) {
-	const size_t reserveThreshold = mappedSize * 7 / 10; // 70% граница
-	const size_t expansionStep = 512 * 1024 * 1024;		 // 512 мб
+std::string AsyncLogger::segmentPath(uint64_t seq) const {
+	char number[32];
+	snprintf(number, sizeof(number), ".%08llu",
+			 static_cast<unsigned long long>(seq));
+	return stem + number + extension;
+}
+
+void AsyncLogger::recoverSegments() {
+	size_t slash = stem.rfind('/');
+	std::string dir = slash == std::string::npos ? "." : stem.substr(0, slash);
+	std::string prefix = stem.substr(slash == std::string::npos ? 0 : slash + 1);
 
-	if (requiredSize < reserveThreshold)
+	DIR *d = opendir(dir.c_str());
+	if (d == nullptr)
 		return;
 
-	size_t newSize = mappedSize;
-	while (newSize <= requiredSize) {
-		newSize += expansionStep;
+	std::vector<uint64_t> found;
+	while (dirent *entry = readdir(d)) {
+		std::string_view name = entry->d_name;
+		if (name.size() <= prefix.size() + 1 + extension.size() ||
+			name.substr(0, prefix.size()) != prefix ||
+			name[prefix.size()] != '.' ||
+			name.substr(name.size() - extension.size()) != extension)
+			continue;
+		std::string_view digits = name.substr(
+			prefix.size() + 1,
+			name.size() - prefix.size() - 1 - extension.size());
+		if (digits.empty() ||
+			digits.find_first_not_of("0123456789") != std::string_view::npos)
+			continue;
+		found.push_back(std::stoull(std::string(digits)));
 	}
+	closedir(d);
+	std::sort(found.begin(), found.end());
 
-	if (ftruncate(fd, newSize) != 0) {
-		perror("ftruncate failed");
-		return;
+	// сегмент, не закрытый из-за падения, имеет полный размер с нулями в
+	// хвосте: обрезаем его по committed из заголовка
+	for (uint64_t seq : found) {
+		std::string path = segmentPath(seq);
+		segmentFiles.push_back(path);
+		sequence = std::max(sequence, seq);
+
+		int seg_fd = open(path.c_str(), O_RDWR);
+		if (seg_fd < 0)
+			continue;
+		char header[LOG_SEGMENT_HEADER_SIZE];
+		LogFormat seg_format;
+		uint64_t seg_seq, committed;
+		struct stat st;
+		if (pread(seg_fd, header, sizeof(header), 0) ==
+				static_cast<ssize_t>(sizeof(header)) &&
+			parseSegmentHeader(header, sizeof(header), seg_format, seg_seq,
+							   committed) &&
+			fstat(seg_fd, &st) == 0 &&
+			static_cast<uint64_t>(st.st_size) >
+				LOG_SEGMENT_HEADER_SIZE + committed)
+			ftruncate(seg_fd, LOG_SEGMENT_HEADER_SIZE + committed);
+		close(seg_fd);
 	}
+}
 
-	if (mapped) {
-		msync(mapped, mappedSize, MS_SYNC);
-		munmap(mapped, mappedSize);
+bool AsyncLogger::openSegment() {
+	std::string path = segmentPath(++sequence);
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		perror("open");
+		return false;
 	}
 
+	if (ftruncate(fd, segments.segment_bytes) != 0) {
+		perror("ftruncate");
+		close(fd);
+		fd = -1;
+		return false;
+	}
+
+	mappedSize = segments.segment_bytes;
 	mapped = static_cast<char *>(
-		mmap(nullptr, newSize, PROT_WRITE, MAP_SHARED, fd, 0));
+		mmap(nullptr, mappedSize, PROT_WRITE | PROT_READ, MAP_SHARED, fd, 0));
 	if (mapped == MAP_FAILED) {
-		perror("mmap failed");
+		perror("mmap");
 		mapped = nullptr;
-		return;
+		close(fd);
+		fd = -1;
+		return false;
 	}
+	madvise(mapped, mappedSize, MADV_SEQUENTIAL);
 
-	mappedSize = newSize;
+	writeOffset = LOG_SEGMENT_HEADER_SIZE;
+	writeSegmentHeader(mapped, format, sequence, 0);
+	segmentStatements.clear();
+	segmentOpened = std::chrono::steady_clock::now();
 
-	madvise(mapped, mappedSize, MADV_SEQUENTIAL);
+	segmentFiles.push_back(path);
+	while (segments.retention > 0 &&
+		   segmentFiles.size() > static_cast<size_t>(segments.retention)) {
+		unlink(segmentFiles.front().c_str());
+		segmentFiles.pop_front();
+	}
+	return true;
 }
 
-void AsyncLogger::process() {
-	size_t syncCounter = 0;
-	const size_t syncEveryN = 20;
-	std::vector<std::string> localBuffer;
+void AsyncLogger::commitSegment() {
+	if (mapped)
+		writeSegmentHeader(mapped, format, sequence,
+						   writeOffset - LOG_SEGMENT_HEADER_SIZE);
+}
 
-	while (true) {
-		{
-			std::unique_lock<std::mutex> lock(mutex);
-			cv.wait_for(lock, std::chrono::milliseconds(flushIntervalMs),
-						[&] { return !frontBuffer.empty() || done; });
+void AsyncLogger::closeSegment(bool sync) {
+	if (!mapped)
+		return;
 
-			if (!frontBuffer.empty()) {
-				frontBuffer.swap(localBuffer);
-			}
+	commitSegment();
+	msync(mapped, writeOffset, sync ? MS_SYNC : MS_ASYNC);
+	munmap(mapped, mappedSize);
+	mapped = nullptr;
+	// закрытый сегмент не держит нулевой хвост
+	ftruncate(fd, writeOffset);
+	close(fd);
+	fd = -1;
+}
+
+bool AsyncLogger::reserveSegment(size_t bytesNeeded) {
+	if (mapped && writeOffset + bytesNeeded <= mappedSize)
+		return true;
+
+	// переотображается только новый сегмент, а не весь лог
+	closeSegment(false);
+	return openSegment() && writeOffset + bytesNeeded <= mappedSize;
+}
+
+size_t AsyncLogger::drain(LogRing &ring) {
+	const size_t mask = ring.capacity - 1;
+	uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+	uint64_t head = ring.head.load(std::memory_order_acquire);
+	size_t records = 0;
+	if (head - tail > ring.highWater.load(std::memory_order_relaxed))
+		ring.highWater.store(head - tail, std::memory_order_relaxed);
+
+	while (tail < head) {
+		size_t offset = tail & mask;
+		uint32_t len;
+		std::memcpy(&len, ring.data.get() + offset, sizeof(len));
+		if (len == WRAP) {
+			tail += ring.capacity - offset;
+			continue;
+		}
 
-			if (done && frontBuffer.empty())
-				break;
+		const char *record = ring.data.get() + offset + sizeof(len);
+		if (format == LogFormat::Binary) {
+			writeBinary(ring, record, len);
+		} else if (reserveSegment(len + 1)) {
+			std::memcpy(mapped + writeOffset, record, len);
+			writeOffset += len;
+			mapped[writeOffset++] = '\n';
 		}
+		tail += recordSize(len);
+		++records;
+	}
 
-		if (!localBuffer.empty()) {
-			size_t batchSizeBytes = 0;
+	ring.tail.store(tail, std::memory_order_release);
+	return records;
+}
 
-			for (const auto &msg : localBuffer) {
-				size_t len = msg.size();
-				ensureCapacity(writeOffset + len + 1); // +1 на '\n'
+void AsyncLogger::writeBinary(LogRing &ring, const char *record,
+							  size_t len) {
+	LogRecordHeader header{};
+	if (len >= sizeof(header))
+		std::memcpy(&header, record, sizeof(header));
 
-				std::memcpy(mapped + writeOffset, msg.c_str(), len);
-				writeOffset += len;
-				mapped[writeOffset++] = '\n';
+	// Определение интернированного текста пишется один раз на поток, а
+	// сегменты ротируются и удаляются по --log-retention. Поэтому ссылка
+	// на текст, которого в сегменте еще нет, идет вместе с его копией.
+	const std::string *definition = nullptr;
+	if (header.type == LogRecordType::Statement) {
+		// тот же сброс, что и у таблицы производителя
+		if (ring.statements.size() >= LOG_MAX_INTERNED_STATEMENTS)
+			ring.statements.clear();
+		ring.statements[header.statement_id].assign(record, len);
+	} else if (header.type == LogRecordType::Prepare ||
+			   header.type == LogRecordType::Execute) {
+		auto it = ring.statements.find(header.statement_id);
+		if (it != ring.statements.end())
+			definition = &it->second;
+	}
 
-				batchSizeBytes += len + 1;
-			}
+	size_t extra = definition && !segmentStatements.count(header.statement_id)
+					   ? definition->size()
+					   : 0;
+	if (!reserveSegment(len + extra))
+		return;
+	// в только что открытом сегменте места хватит и без учета в extra
+	if (definition && segmentStatements.insert(header.statement_id).second) {
+		std::memcpy(mapped + writeOffset, definition->data(),
+					definition->size());
+		writeOffset += definition->size();
+	}
+	if (header.type == LogRecordType::Statement)
+		segmentStatements.insert(header.statement_id);
+	std::memcpy(mapped + writeOffset, record, len);
+	writeOffset += len;
+}
+
+AsyncLogger::Stats AsyncLogger::stats() const {
+	Stats stats;
+	stats.producers = ringCount.load(std::memory_order_acquire);
+	stats.ringBytes = ringBytes;
+	for (size_t i = 0; i < stats.producers; ++i) {
+		const LogRing &ring = *rings[i];
+		stats.highWater = std::max<uint64_t>(
+			stats.highWater, ring.highWater.load(std::memory_order_relaxed));
+		// tail читается первым: head не меньше него
+		uint64_t tail = ring.tail.load(std::memory_order_acquire);
+		stats.queued += ring.head.load(std::memory_order_relaxed) - tail;
+		stats.dropped += ring.dropped.load(std::memory_order_relaxed);
+		stats.blocked += ring.blocked.load(std::memory_order_relaxed);
+	}
+	// rings[0] - общее кольцо, а не отдельный производитель
+	--stats.producers;
+	return stats;
+}
 
-			localBuffer.clear();
+size_t AsyncLogger::drainAll() {
+	size_t count = ringCount.load(std::memory_order_acquire);
+	size_t records = 0;
+	for (size_t i = 0; i < count; ++i)
+		records += drain(*rings[i]);
+	return records;
+}
 
-			if (++syncCounter >= syncEveryN) {
+void AsyncLogger::process() {
+	size_t syncCounter = 0;
+	const size_t syncEveryN = 20;
+
+	while (true) {
+		if (drainAll() > 0) {
+			// заголовок обновляется после данных пачки
+			commitSegment();
+			if (mapped && ++syncCounter >= syncEveryN) {
 				msync(mapped, writeOffset, MS_ASYNC);
 				syncCounter = 0;
 			}
+			continue;
 		}
-	}
-
-	std::vector<std::string> remaining;
-	{
-		std::lock_guard<std::mutex> lock(mutex);
-		frontBuffer.swap(remaining);
-	}
 
-	for (const auto &msg : remaining) {
-		size_t len = msg.size();
-		ensureCapacity(writeOffset + len + 1);
+		if (segments.segment_seconds > 0 &&
+			writeOffset > LOG_SEGMENT_HEADER_SIZE &&
+			std::chrono::steady_clock::now() - segmentOpened >=
+				std::chrono::seconds(segments.segment_seconds)) {
+			closeSegment(false);
+			openSegment();
+		}
 
-		std::memcpy(mapped + writeOffset, msg.c_str(), len);
-		writeOffset += len;
-		mapped[writeOffset++] = '\n';
+		std::unique_lock<std::mutex> lock(mutex);
+		if (done)
+			break;
+		cv.wait_for(lock, std::chrono::milliseconds(flushIntervalMs));
 	}
 
-	if (writeOffset > 0) {
-		msync(mapped, writeOffset, MS_SYNC);
-	}
-}
\ No newline at end of file
+	// производители к этому моменту остановлены, забираем остаток
+	drainAll();
+}
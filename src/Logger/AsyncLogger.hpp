@@ -1,36 +1,150 @@
 #pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "LogRecord.hpp"
+#include "LogSegment.hpp"
+
+// Кольцевой буфер записей одного потока-производителя (SPSC). Запись -
+// uint32 длина и байты строки, выровненные на 4. Если запись не помещается
+// до конца буфера, остаток помечается WRAP и запись кладется с начала.
+// head двигает только производитель, tail - только поток записи.
+struct LogRing {
+	explicit LogRing(size_t capacity, bool shared = false);
+
+	alignas(64) std::atomic<uint64_t> head{0};
+	// последний виденный производителем tail: пока места хватает, чужая
+	// кэш-линия не читается
+	uint64_t cachedTail = 0;
+	// общее кольцо для потоков сверх MAX_PRODUCERS пишется под спинлоком
+	const bool shared;
+	std::atomic_flag lock = ATOMIC_FLAG_INIT;
+	// счетчик для LogOverflow::Sample
+	uint64_t sampled = 0;
+	// отброшенные записи и ожидания места в кольце; пишет производитель
+	std::atomic<uint64_t> dropped{0};
+	std::atomic<uint64_t> blocked{0};
+
+	alignas(64) std::atomic<uint64_t> tail{0};
+	// наибольшее заполнение кольца в байтах
+	std::atomic<uint64_t> highWater{0};
+	// записи Statement, прошедшие через кольцо, по statement_id: поток
+	// записи повторяет их в сегментах, где на них ссылаются впервые
+	std::unordered_map<uint32_t, std::string> statements;
+
+	const size_t capacity;
+	std::unique_ptr<char[]> data;
+};
+
+// Логгер с отдельным потоком записи в mmap-сегменты (см. LogSegment.hpp).
+// Каждый поток-производитель при первой записи получает свое кольцо и дальше
+// сериализует строку прямо в него, без блокировок и выделений памяти. Поток записи пачками забирает
+// записи из всех колец. Порядок строк сохраняется в пределах одного потока.
 class AsyncLogger {
   public:
-	AsyncLogger(const std::string &filename, size_t batchSize = 10'000,
-				int flushIntervalMs = 10);
+	static constexpr size_t MAX_PRODUCERS = 64;
+
+	// сумма по всем кольцам, highWater - по самому заполненному
+	struct Stats {
+		size_t producers = 0;
+		size_t ringBytes = 0;
+		uint64_t highWater = 0;
+		// байт в кольцах, еще не забранных потоком записи
+		uint64_t queued = 0;
+		uint64_t dropped = 0;
+		uint64_t blocked = 0;
+	};
+
+	AsyncLogger(const std::string &filename,
+				LogFormat format = LogFormat::Text,
+				const LogSegmentOptions &segments = {},
+				const LogQueueOptions &queue = {}, int flushIntervalMs = 10);
 	~AsyncLogger();
 
-	void log(std::string essage);
+	LogFormat logFormat() const { return format; }
+	Stats stats() const;
+
+	// строка записи собирается из частей уже в кольце
+	template <typename... Parts> void log(const Parts &...parts) {
+		const std::string_view views[] = {std::string_view(parts)...};
+		write(views, sizeof...(Parts));
+	}
+
+	// бинарная запись: заголовок и поля с префиксом длины собираются сразу
+	// в кольце
+	template <typename... Fields>
+	void logRecord(LogRecordType type, uint64_t connectionId,
+				   uint32_t statementId, const Fields &...fields) {
+		std::string_view views[] = {std::string_view(fields)...};
+		writeRecord(type, connectionId, statementId, views,
+					sizeof...(Fields));
+	}
 
   private:
+	// essential: запись не отбрасывается при переполнении (определения
+	// интернированных текстов, на которые ссылаются следующие записи)
+	void write(const std::string_view *parts, size_t count,
+			   bool essential = false);
+	void writeRecord(LogRecordType type, uint64_t connectionId,
+					 uint32_t statementId, std::string_view *fields,
+					 size_t count);
+	LogRing &threadRing();
+	size_t drain(LogRing &ring);
+	// бинарная запись из кольца, с определением ее текста, если в текущем
+	// сегменте его еще нет
+	void writeBinary(LogRing &ring, const char *record, size_t len);
+	size_t drainAll();
 	void process();
-	void ensureCapacity(size_t bytesNeeded);
+
+	std::string segmentPath(uint64_t seq) const;
+	void recoverSegments();
+	bool openSegment();
+	void commitSegment();
+	void closeSegment(bool sync);
+	// место под запись в текущем сегменте, при нехватке - новый сегмент
+	bool reserveSegment(size_t bytesNeeded);
 
 	std::string filename;
-	size_t batchSize;
+	LogFormat format;
+	LogSegmentOptions segments;
+	std::string stem;
+	std::string extension;
+	uint64_t sequence = 0;
+	std::chrono::steady_clock::time_point segmentOpened;
+	// существующие сегменты, старые в начале
+	std::deque<std::string> segmentFiles;
+	size_t ringBytes;
+	LogOverflow overflow;
+	unsigned sampleRate;
 	int flushIntervalMs;
 
-	std::vector<std::string> frontBuffer;
-	std::vector<std::string> backBuffer;
+	// rings[0] - общее кольцо, остальные по одному на поток
+	std::array<LogRing *, MAX_PRODUCERS + 1> rings{};
+	std::atomic<size_t> ringCount{0};
+	std::vector<std::unique_ptr<LogRing>> ownedRings;
 
 	std::mutex mutex;
 	std::condition_variable cv;
-	bool done = false;
+	std::atomic<bool> done{false};
 	std::thread worker;
 
 	int fd = -1;
 	char *mapped = nullptr;
 	size_t mappedSize = 0;
 	size_t writeOffset = 0;
+	// statement_id, определенные в текущем сегменте: каждый сегмент
+	// читается pg_proxy_logcat сам по себе
+	std::unordered_set<uint32_t> segmentStatements;
 };
@@ -0,0 +1,40 @@
+#include "LogRecord.hpp"
+#include <arpa/inet.h>
+#include <cstring>
+
+void formatBindParameters(std::string &out, const char *data, size_t len) {
+	if (len < 2)
+		return;
+
+	uint16_t num_params;
+	std::memcpy(&num_params, data, sizeof(num_params));
+	num_params = ntohs(num_params);
+
+	const char *ptr = data + 2;
+	const char *end = data + len;
+	for (uint16_t i = 0; i < num_params && ptr < end; ++i) {
+		if (i > 0)
+			out += ", ";
+		char format = *ptr++;
+		if ((format != '\x01' && format != '\x00') ||
+			end - ptr < static_cast<ptrdiff_t>(sizeof(uint32_t)))
+			break;
+
+		uint32_t param_len;
+		std::memcpy(&param_len, ptr, sizeof(param_len));
+		param_len = ntohl(param_len);
+		ptr += sizeof(param_len);
+		if (param_len > static_cast<size_t>(end - ptr))
+			break;
+
+		if (format == '\x01') {
+			out += "TEXT:";
+			out.append(ptr, param_len);
+		} else {
+			out += "BINARY:[binary ";
+			out += std::to_string(param_len);
+			out += " bytes]";
+		}
+		ptr += param_len;
+	}
+}
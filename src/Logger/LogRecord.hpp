@@ -0,0 +1,64 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// Text: строки вида "[QUERY] ...", формируемые парсером.
+// Binary: записи LogRecordHeader + поля, строки собирает pg_proxy_logcat.
+enum class LogFormat { Text, Binary };
+
+// Что делает поток-производитель, когда его кольцо заполнено.
+// Block: ждет поток записи, строки не теряются.
+// Drop: новая запись отбрасывается.
+// Sample: кольцо заполнено больше чем на 3/4 - проходит только каждая
+// sample_rate-я запись, заполнено полностью - ни одной.
+enum class LogOverflow { Block, Drop, Sample };
+
+struct LogQueueOptions {
+	// объем кольца одного потока-производителя
+	size_t ring_bytes = 1 << 20;
+	LogOverflow overflow = LogOverflow::Block;
+	unsigned sample_rate = 10;
+};
+
+// Таблица интернированных текстов потока-производителя очищается, дорастя
+// до этого размера: тексты запросов с литералами иначе копились бы
+// бесконечно. Поток записи держит такую же копию для каждого кольца.
+constexpr size_t LOG_MAX_INTERNED_STATEMENTS = 65536;
+
+// 0 не используется: нулевой заголовок означает конец данных
+enum class LogRecordType : uint8_t {
+	// определение интернированного текста: statement_id, поле - текст
+	Statement = 1,
+	// поля: user, database
+	Startup,
+	// поле: текст запроса
+	Query,
+	// statement_id - текст запроса, поле: имя оператора
+	Prepare,
+	// поля: портал, оператор, сырые байты параметров Bind
+	Bind,
+	// statement_id - текст запроса, поля: портал, оператор
+	Execute,
+	// поля: портал, оператор
+	ExecuteUnknownStatement,
+	// поле: портал
+	ExecuteUnknownPortal,
+};
+
+// Фиксированный заголовок записи. За ним length байт полей, каждое поле -
+// uint32 длина и байты. Порядок байт - родной для машины, лог читается
+// на ней же.
+struct __attribute__((packed)) LogRecordHeader {
+	uint32_t length;
+	LogRecordType type;
+	uint8_t reserved[3];
+	uint64_t timestamp_ns;
+	uint64_t connection_id;
+	uint32_t statement_id;
+};
+
+// Параметры Bind в текстовом виде "TEXT:..., BINARY:[binary N bytes]",
+// дописываются в out
+void formatBindParameters(std::string &out, const char *data, size_t len);
@@ -0,0 +1,38 @@
+#include "LogSegment.hpp"
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+void writeSegmentHeader(char *dst, LogFormat format, uint64_t sequence,
+						uint64_t committed) {
+	char header[LOG_SEGMENT_HEADER_SIZE + 1];
+	int n = snprintf(header, sizeof(header),
+					 "PGPXSEG1 %-6s seq=%010" PRIu64 " committed=%020" PRIu64,
+					 format == LogFormat::Binary ? "binary" : "text", sequence,
+					 committed);
+	std::memset(header + n, ' ', LOG_SEGMENT_HEADER_SIZE - 1 - n);
+	header[LOG_SEGMENT_HEADER_SIZE - 1] = '\n';
+	std::memcpy(dst, header, LOG_SEGMENT_HEADER_SIZE);
+}
+
+bool parseSegmentHeader(const char *src, size_t len, LogFormat &format,
+						uint64_t &sequence, uint64_t &committed) {
+	if (len < LOG_SEGMENT_HEADER_SIZE || std::memcmp(src, "PGPXSEG1 ", 9) != 0)
+		return false;
+
+	char header[LOG_SEGMENT_HEADER_SIZE + 1];
+	std::memcpy(header, src, LOG_SEGMENT_HEADER_SIZE);
+	header[LOG_SEGMENT_HEADER_SIZE] = '\0';
+
+	char kind[8];
+	if (sscanf(header, "PGPXSEG1 %7s seq=%" SCNu64 " committed=%" SCNu64, kind,
+			   &sequence, &committed) != 3)
+		return false;
+	if (std::strcmp(kind, "binary") == 0)
+		format = LogFormat::Binary;
+	else if (std::strcmp(kind, "text") == 0)
+		format = LogFormat::Text;
+	else
+		return false;
+	return true;
+}
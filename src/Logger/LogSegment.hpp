@@ -0,0 +1,28 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+#include "LogRecord.hpp"
+
+// Лог пишется сегментами <stem>.<seq>.<ext> (resources/logs.00000001.txt).
+// Каждый сегмент начинается с текстовой строки-заголовка фиксированной длины
+//   PGPXSEG1 text seq=0000000001 committed=00000000000000001234
+// committed - сколько байт данных после заголовка записано целиком: после
+// падения процесса или перезапуска дальше этой границы данные не читаются.
+constexpr size_t LOG_SEGMENT_HEADER_SIZE = 64;
+
+struct LogSegmentOptions {
+	// размер сегмента; файл создается сразу такого размера и обрезается
+	// до записанного при закрытии
+	size_t segment_bytes = 64 * 1024 * 1024;
+	// закрывать сегмент по времени, 0 - только по размеру
+	int segment_seconds = 0;
+	// сколько последних сегментов хранить, 0 - все
+	int retention = 0;
+};
+
+void writeSegmentHeader(char *dst, LogFormat format, uint64_t sequence,
+						uint64_t committed);
+// false, если это не заголовок сегмента
+bool parseSegmentHeader(const char *src, size_t len, LogFormat &format,
+						uint64_t &sequence, uint64_t &committed);
@@ -0,0 +1,123 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Корзина логарифмической гистограммы: в корзину i попадают значения
+// меньше 2^i, последняя корзина открыта сверху
+inline size_t log2Bucket(uint64_t value, size_t buckets) {
+	size_t idx = 0;
+	while (idx + 1 < buckets && (1ULL << idx) <= value)
+		++idx;
+	return idx;
+}
+
+// Гистограмма с логарифмическими корзинами (степени двойки, в микросекундах).
+// Пишет только поток-владелец, читать можно из любого потока.
+struct LatencyHistogram {
+	static constexpr size_t BUCKETS = 32;
+
+	std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+	std::atomic<uint64_t> total_count{0};
+	std::atomic<uint64_t> total_us{0};
+	std::atomic<uint64_t> max_us{0};
+
+	void record(uint64_t us) {
+		size_t idx = log2Bucket(us, BUCKETS);
+		buckets[idx].fetch_add(1, std::memory_order_relaxed);
+		total_count.fetch_add(1, std::memory_order_relaxed);
+		total_us.fetch_add(us, std::memory_order_relaxed);
+		if (us > max_us.load(std::memory_order_relaxed))
+			max_us.store(us, std::memory_order_relaxed);
+	}
+
+	uint64_t count() const {
+		return total_count.load(std::memory_order_relaxed);
+	}
+
+	// Верхняя граница корзины, в которую попал заданный перцентиль
+	uint64_t percentile(double p) const {
+		uint64_t total = count();
+		if (total == 0)
+			return 0;
+		uint64_t rank = static_cast<uint64_t>(p * total);
+		uint64_t max = max_us.load(std::memory_order_relaxed);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < BUCKETS; ++i) {
+			seen += buckets[i].load(std::memory_order_relaxed);
+			if (seen > rank)
+				return std::min<uint64_t>(1ULL << i, max);
+		}
+		return max;
+	}
+};
+
+// То же для размеров в байтах
+struct SizeHistogram {
+	static constexpr size_t BUCKETS = 32;
+
+	std::array<std::atomic<uint64_t>, BUCKETS> buckets{};
+	std::atomic<uint64_t> total_count{0};
+	std::atomic<uint64_t> total_bytes{0};
+
+	void record(uint64_t bytes) {
+		buckets[log2Bucket(bytes, BUCKETS)].fetch_add(
+			1, std::memory_order_relaxed);
+		total_count.fetch_add(1, std::memory_order_relaxed);
+		total_bytes.fetch_add(bytes, std::memory_order_relaxed);
+	}
+};
+
+// Счетчики одного воркера. Выровнены по кэш-линии, чтобы соседние воркеры
+// не делили одну линию. Пишет их сам воркер (кроме accepts), сумма по
+// воркерам считается только при выводе метрик (SIGUSR1, --metrics-port).
+struct alignas(64) WorkerMetrics {
+	std::atomic<uint64_t> active_connections{0};
+	std::atomic<uint64_t> connect_failures{0};
+	std::atomic<uint64_t> connect_timeouts{0};
+	// клиенты, закрытые по --client-idle-timeout-ms и
+	// --idle-in-transaction-timeout-ms, и запросы, отмененные по
+	// --query-timeout-ms
+	std::atomic<uint64_t> idle_timeouts{0};
+	std::atomic<uint64_t> idle_in_transaction_timeouts{0};
+	std::atomic<uint64_t> query_timeouts{0};
+	std::atomic<uint64_t> spliced_bytes{0};
+	std::atomic<uint64_t> epoll_ctl_calls{0};
+	// успешные recv(), данные которых ушли другой стороне
+	std::atomic<uint64_t> relayed_chunks{0};
+	// сколько раз чтение стороны останавливалось по high water, у скольких
+	// соединений хотя бы раз и сколько сторон остановлено сейчас
+	std::atomic<uint64_t> throttles{0};
+	std::atomic<uint64_t> throttled_connections{0};
+	std::atomic<uint64_t> throttled_now{0};
+	// --pool-mode=transaction: серверные соединения пулов воркера, входы на
+	// сервер, постановки клиента в очередь, таймауты ожидания и
+	// завершенные транзакции (сервер вернулся в пул)
+	std::atomic<uint64_t> pool_servers{0};
+	std::atomic<uint64_t> server_logins{0};
+	std::atomic<uint64_t> pool_waits{0};
+	std::atomic<uint64_t> pool_wait_timeouts{0};
+	std::atomic<uint64_t> pool_transactions{0};
+	// транзакции, отправленные на реплику (--replica)
+	std::atomic<uint64_t> replica_transactions{0};
+	// пересланные байты клиент -> сервер и сервер -> клиент (вместе со
+	// splice())
+	std::atomic<uint64_t> client_bytes{0};
+	std::atomic<uint64_t> server_bytes{0};
+	// пробуждения цикла воркера с событиями
+	std::atomic<uint64_t> wakeups{0};
+	// время цикла вне ожидания событий: по нему поток приема оценивает
+	// загрузку воркера
+	std::atomic<uint64_t> busy_ns{0};
+	// соединения, перенесенные в воркер из перегруженного (--rebalance-ms)
+	std::atomic<uint64_t> migrated_in{0};
+	LatencyHistogram connect_latency;
+	// сколько байт ждет отправки в направлении после каждого приема
+	SizeHistogram buffer_occupancy;
+
+	// без --reuseport счетчик увеличивает поток приема, поэтому он лежит на
+	// своей кэш-линии и не гоняет линию остальных счетчиков между ядрами
+	alignas(64) std::atomic<uint64_t> accepts{0};
+};
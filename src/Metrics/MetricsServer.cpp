@@ -0,0 +1,246 @@
+#include "MetricsServer.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <netinet/in.h>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <unistd.h>
+#include <vector>
+
+MetricsServer::MetricsServer(const std::string &host, int port,
+							 std::function<void(std::ostream &)> render)
+	: render(std::move(render)) {
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) {
+		throw std::invalid_argument("Invalid value for --metrics-bind: " +
+									host);
+	}
+
+	listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"socket() failed");
+	}
+
+	int one = 1;
+	setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	if (bind(listen_fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+		int saved_errno = errno;
+		close(listen_fd);
+		throw std::system_error(saved_errno, std::system_category(),
+								"bind() of --metrics-port failed");
+	}
+	if (listen(listen_fd, SOMAXCONN) < 0) {
+		int saved_errno = errno;
+		close(listen_fd);
+		throw std::system_error(saved_errno, std::system_category(),
+								"listen() failed");
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		int saved_errno = errno;
+		close(listen_fd);
+		throw std::system_error(saved_errno, std::system_category(),
+								"epoll_create1() failed");
+	}
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		int saved_errno = errno;
+		close(epoll_fd);
+		close(listen_fd);
+		throw std::system_error(saved_errno, std::system_category(),
+								"timerfd_create() failed");
+	}
+	ev.data.fd = timer_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+}
+
+MetricsServer::~MetricsServer() {
+	for (const auto &[fd, client] : clients)
+		close(fd);
+	close(timer_fd);
+	close(epoll_fd);
+	close(listen_fd);
+}
+
+void MetricsServer::poll() {
+	epoll_event events[16];
+	int nfds = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < nfds; ++i) {
+		int fd = events[i].data.fd;
+		if (fd == listen_fd) {
+			acceptClients();
+			continue;
+		}
+		if (fd == timer_fd) {
+			uint64_t expirations;
+			while (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+			}
+			closeExpired();
+			continue;
+		}
+
+		auto it = clients.find(fd);
+		if (it == clients.end())
+			continue;
+		Client &client = it->second;
+		if (client.response.empty())
+			readRequest(fd, client);
+		else if (sendResponse(fd, client))
+			closeClient(fd);
+	}
+}
+
+void MetricsServer::acceptClients() {
+	while (true) {
+		int fd = accept4(listen_fd, nullptr, nullptr,
+						 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4() failed");
+			return;
+		}
+		if (clients.size() >= MAX_CLIENTS) {
+			close(fd);
+			continue;
+		}
+
+		epoll_event ev{};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.fd = fd;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			perror("epoll_ctl() failed");
+			close(fd);
+			continue;
+		}
+		if (clients.empty()) {
+			itimerspec period{};
+			period.it_interval.tv_sec = 1;
+			period.it_value = period.it_interval;
+			timerfd_settime(timer_fd, 0, &period, nullptr);
+		}
+		clients[fd].deadline = Clock::now() + CLIENT_TIMEOUT;
+	}
+}
+
+void MetricsServer::readRequest(int fd, Client &client) {
+	char data[2048];
+	while (true) {
+		ssize_t len = recv(fd, data, sizeof(data), 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			closeClient(fd);
+			return;
+		}
+		if (len == 0) {
+			closeClient(fd);
+			return;
+		}
+		client.request.append(data, len);
+		if (client.request.size() > MAX_REQUEST) {
+			closeClient(fd);
+			return;
+		}
+	}
+
+	// тело запроса не нужно, достаточно конца заголовков
+	if (client.request.find("\r\n\r\n") == std::string::npos &&
+		client.request.find("\n\n") == std::string::npos)
+		return;
+
+	respond(client);
+	if (sendResponse(fd, client)) {
+		closeClient(fd);
+		return;
+	}
+	// остаток ответа уйдет по EPOLLOUT
+	epoll_event ev{};
+	ev.events = EPOLLOUT;
+	ev.data.fd = fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void MetricsServer::respond(Client &client) {
+	std::string_view request = client.request;
+	std::string_view line = request.substr(0, request.find_first_of("\r\n"));
+	std::string_view method = line.substr(0, line.find(' '));
+	std::string_view target;
+	if (method.size() < line.size()) {
+		target = line.substr(method.size() + 1);
+		target = target.substr(0, target.find(' '));
+		target = target.substr(0, target.find('?'));
+	}
+
+	const char *status = "200 OK";
+	std::ostringstream body;
+	if (method != "GET") {
+		status = "405 Method Not Allowed";
+		body << "only GET is supported\n";
+	} else if (target != "/metrics") {
+		status = "404 Not Found";
+		body << "metrics are served at /metrics\n";
+	} else {
+		render(body);
+	}
+
+	std::string text = body.str();
+	std::ostringstream out;
+	out << "HTTP/1.1 " << status << "\r\n"
+		<< "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+		<< "Content-Length: " << text.size() << "\r\n"
+		<< "Connection: close\r\n\r\n"
+		<< text;
+	client.response = out.str();
+}
+
+bool MetricsServer::sendResponse(int fd, Client &client) {
+	while (client.sent < client.response.size()) {
+		ssize_t n = send(fd, client.response.data() + client.sent,
+						 client.response.size() - client.sent, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return false;
+			return true;
+		}
+		client.sent += n;
+	}
+	return true;
+}
+
+void MetricsServer::closeClient(int fd) {
+	close(fd);
+	clients.erase(fd);
+	if (clients.empty()) {
+		itimerspec off{};
+		timerfd_settime(timer_fd, 0, &off, nullptr);
+	}
+}
+
+void MetricsServer::closeExpired() {
+	Clock::time_point now = Clock::now();
+	std::vector<int> expired;
+	for (const auto &[fd, client] : clients) {
+		if (client.deadline <= now)
+			expired.push_back(fd);
+	}
+	for (int fd : expired)
+		closeClient(fd);
+}
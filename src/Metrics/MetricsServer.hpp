@@ -0,0 +1,57 @@
+#pragma once
+#include <chrono>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+// HTTP-ответчик для Prometheus на отдельном порту (--metrics-port): GET
+// /metrics отдает текст, который собирает render. Сокеты живут в своем
+// epoll, а он добавляется в epoll потока приема ProxyServer, поэтому
+// воркеры и их циклы о нем не знают. Каждый ответ закрывает соединение.
+class MetricsServer {
+  public:
+	// host - IPv4-адрес для bind(), по умолчанию только loopback
+	MetricsServer(const std::string &host, int port,
+				  std::function<void(std::ostream &)> render);
+	~MetricsServer();
+	MetricsServer(const MetricsServer &) = delete;
+	MetricsServer &operator=(const MetricsServer &) = delete;
+
+	// готов к чтению, когда есть что обработать
+	int fd() const { return epoll_fd; }
+	// обработать готовые сокеты, не блокируясь
+	void poll();
+
+  private:
+	// одновременных соединений; лишние закрываются сразу
+	static constexpr size_t MAX_CLIENTS = 64;
+	static constexpr size_t MAX_REQUEST = 8192;
+	// на запрос и ответ целиком: молчащие клиенты иначе заняли бы все
+	// MAX_CLIENTS мест и не пустили бы Prometheus
+	static constexpr std::chrono::seconds CLIENT_TIMEOUT{5};
+
+	using Clock = std::chrono::steady_clock;
+
+	struct Client {
+		std::string request;
+		std::string response;
+		size_t sent = 0;
+		Clock::time_point deadline;
+	};
+
+	void acceptClients();
+	void readRequest(int fd, Client &client);
+	void respond(Client &client);
+	// true - ответ отправлен целиком или соединение оборвалось
+	bool sendResponse(int fd, Client &client);
+	void closeClient(int fd);
+	void closeExpired();
+
+	int listen_fd = -1;
+	int epoll_fd = -1;
+	// раз в секунду будит poll(), пока есть клиенты
+	int timer_fd = -1;
+	std::function<void(std::ostream &)> render;
+	std::unordered_map<int, Client> clients;
+};
@@ -0,0 +1,128 @@
+#include "MessageFramer.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdint>
+#include <cstring>
+
+#include "PgWire.hpp"
+
+// PostgreSQL отвергает стартовые пакеты длиннее 10000 байт
+constexpr uint32_t MAX_STARTUP_PACKET = 10000;
+constexpr size_t KEEP_PARTIAL_CAPACITY = 64 * 1024;
+
+MessageFramer::MessageFramer(bool startup_phase)
+	: phase(startup_phase ? Phase::Startup : Phase::Typed) {}
+
+void MessageFramer::feed(const char *data, size_t len, MessageSink &sink) {
+	while (len > 0 && phase != Phase::Opaque) {
+		if (body_remaining > 0) {
+			size_t take = std::min(len, body_remaining);
+			if (collecting)
+				partial.append(data, take);
+			data += take;
+			len -= take;
+			body_remaining -= take;
+
+			if (body_remaining == 0 && collecting) {
+				collecting = false;
+				deliver(partial.data(), partial.size(), sink);
+				if (partial.capacity() > KEEP_PARTIAL_CAPACITY)
+					std::string().swap(partial);
+				else
+					partial.clear();
+			}
+			continue;
+		}
+
+		const size_t header_size = phase == Phase::Startup ? 4 : 5;
+		const char *hdr;
+		if (header_len > 0 || len < header_size) {
+			size_t take = std::min(header_size - header_len, len);
+			std::memcpy(header + header_len, data, take);
+			header_len += take;
+			data += take;
+			len -= take;
+			if (header_len < header_size)
+				return;
+			header_len = 0;
+			hdr = header;
+		} else {
+			hdr = data;
+			data += header_size;
+			len -= header_size;
+		}
+
+		uint32_t msg_len;
+		std::memcpy(&msg_len, hdr + header_size - 4, sizeof(msg_len));
+		msg_len = ntohl(msg_len);
+
+		bool wanted;
+		if (phase == Phase::Startup) {
+			// TLS ClientHello после SSLRequest или просто не PostgreSQL
+			if (msg_len < 8 || msg_len > MAX_STARTUP_PACKET) {
+				phase = Phase::Opaque;
+				return;
+			}
+			type = 0;
+			wanted = true;
+		} else {
+			if (msg_len < 4) {
+				phase = Phase::Opaque;
+				return;
+			}
+			type = hdr[0];
+			wanted = sink.wantsBody(type);
+		}
+
+		size_t body_len = msg_len - 4;
+		if (wanted && body_len > MAX_COLLECTED_BODY) {
+			sink.onOversizedMessage(type, body_len);
+			wanted = false;
+		}
+
+		if (wanted && len >= body_len) {
+			const char *body = data;
+			data += body_len;
+			len -= body_len;
+			deliver(body, body_len, sink);
+		} else if (wanted) {
+			collecting = true;
+			partial.reserve(body_len);
+			partial.assign(data, len);
+			body_remaining = body_len - len;
+			return;
+		} else {
+			size_t take = std::min(len, body_len);
+			data += take;
+			len -= take;
+			body_remaining = body_len - take;
+		}
+	}
+}
+
+void MessageFramer::deliver(const char *body, size_t len, MessageSink &sink) {
+	if (phase != Phase::Startup) {
+		sink.onMessage(type, body, len);
+		return;
+	}
+
+	sink.onStartupMessage(body, len);
+
+	uint32_t code;
+	std::memcpy(&code, body, sizeof(code));
+	code = ntohl(code);
+	switch (code) {
+	case SSL_REQUEST_CODE:
+	case GSSENC_REQUEST_CODE:
+		// дальше либо повторный StartupMessage (сервер ответил 'N'), либо
+		// зашифрованный поток, который отсечется проверкой длины
+		break;
+	case PROTOCOL_V3:
+		phase = Phase::Typed;
+		break;
+	case CANCEL_REQUEST_CODE:
+	default:
+		phase = Phase::Opaque;
+		break;
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+// Получатель сообщений, выделенных MessageFramer из потока
+class MessageSink {
+  public:
+	virtual ~MessageSink() = default;
+
+	// нужно ли тело сообщения этого типа; ненужные тела пропускаются без
+	// копирования
+	virtual bool wantsBody(char type) const = 0;
+	virtual void onMessage(char type, const char *body, size_t len) = 0;
+	// нетипизированные сообщения начала сессии: StartupMessage, SSLRequest,
+	// GSSENCRequest, CancelRequest
+	virtual void onStartupMessage(const char *body, size_t len) {}
+	// тело нужно, но длиннее MAX_COLLECTED_BODY и будет пропущено
+	virtual void onOversizedMessage(char type, size_t len) {}
+};
+
+// Инкрементальный разбор потока сообщений протокола PostgreSQL.
+// Принимает куски данных произвольной длины (как пришли из recv()), хранит
+// незавершенный заголовок и тело между вызовами. Сообщения, целиком лежащие
+// в куске, передаются получателю указателем на исходные данные; копируются
+// только тела, разрезанные границей куска.
+class MessageFramer {
+  public:
+	// тела больше этого размера не собираются, а пропускаются
+	static constexpr size_t MAX_COLLECTED_BODY = 16 * 1024 * 1024;
+
+	// startup_phase = true для клиентского потока: сессия начинается с
+	// нетипизированных сообщений
+	explicit MessageFramer(bool startup_phase = false);
+
+	void feed(const char *data, size_t len, MessageSink &sink);
+
+	// поток перестал быть разбираемым (TLS, CancelRequest, мусор)
+	bool opaque() const { return phase == Phase::Opaque; }
+
+  private:
+	enum class Phase { Startup, Typed, Opaque };
+
+	void deliver(const char *body, size_t len, MessageSink &sink);
+
+	Phase phase;
+	char header[5];
+	size_t header_len = 0;
+
+	char type = 0;
+	size_t body_remaining = 0;
+	bool collecting = false;
+	std::string partial;
+};
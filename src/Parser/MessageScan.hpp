@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Поиск NUL-терминатора в пределах len (как strnlen). Имена операторов и
+// порталов обычно пустые или короткие, поэтому первые 16 байт проверяются
+// на месте одним сравнением SSE2, без вызова функции. Длинный хвост (текст
+// запроса) отдается strnlen: glibc сама выбирает при старте реализацию под
+// процессор (SSE2/AVX2/EVEX), и она быстрее собственных циклов
+// (см. pg_proxy_scan_bench).
+inline size_t scanNul(const char *data, size_t len) {
+#ifdef __SSE2__
+	if (len >= 16) {
+		__m128i block =
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(data));
+		int mask =
+			_mm_movemask_epi8(_mm_cmpeq_epi8(block, _mm_setzero_si128()));
+		if (mask != 0)
+			return __builtin_ctz(mask);
+		return 16 + strnlen(data + 16, len - 16);
+	}
+	for (size_t i = 0; i < len; ++i) {
+		if (data[i] == '\0')
+			return i;
+	}
+	return len;
+#else
+	return strnlen(data, len);
+#endif
+}
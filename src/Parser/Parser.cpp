@@ -1,65 +1,134 @@
 #include "Parser.hpp"
+#include "MessageScan.hpp"
 #include <arpa/inet.h>
 #include <cstdint>
 #include <cstring>
+#include <atomic>
 #include <iomanip>
 #include <iostream>
+#include <string_view>
 
-Parser::Parser(AsyncLogger *logger) : logger(logger), prepared_statements() {
+static std::atomic<uint64_t> next_connection_id{1};
+static std::atomic<uint32_t> next_statement_id{1};
+
+ParserSession::ParserSession(Parser *parser, QueryStats *stats)
+	: connection_id(next_connection_id.fetch_add(1, std::memory_order_relaxed)),
+	  queries(stats), parser(parser) {}
+
+bool ParserSession::wantsBody(char type) const {
+	return Parser::wantsBody(type);
+}
+
+void ParserSession::onMessage(char type, const char *body, size_t len) {
+	parser->parseMessage(*this, type, body, len);
+}
+
+void ParserSession::onStartupMessage(const char *body, size_t len) {
+	if (parser->parseStartup(*this, body, len)) {
+		startup_done = true;
+		queries.start();
+	}
+}
+
+uint32_t ParserSession::statementIndex(std::string_view name) {
+	auto it = statement_ids.find(name);
+	if (it != statement_ids.end())
+		return it->second;
+
+	uint32_t index;
+	if (!free_statements.empty()) {
+		index = free_statements.back();
+		free_statements.pop_back();
+	} else {
+		index = static_cast<uint32_t>(statements.size());
+		statements.emplace_back();
+	}
+	PreparedStatement &prepared = statements[index];
+	prepared.name.assign(name);
+	prepared.statement_id = 0;
+	prepared.stats_slot = QueryStats::OTHER;
+	statement_ids.emplace(name, index);
+	return index;
+}
+
+uint32_t ParserSession::findStatement(std::string_view name) const {
+	auto it = statement_ids.find(name);
+	return it == statement_ids.end() ? NO_STATEMENT : it->second;
+}
+
+void ParserSession::closeStatement(std::string_view name) {
+	auto it = statement_ids.find(name);
+	if (it == statement_ids.end())
+		return;
+
+	uint32_t index = it->second;
+	statement_ids.erase(it);
+	free_statements.push_back(index);
+	// вместе с оператором сервер закрывает созданные из него порталы
+	for (auto portal = portals.begin(); portal != portals.end();) {
+		if (portal->second.statement == index)
+			portal = portals.erase(portal);
+		else
+			++portal;
+	}
+}
+
+void ParserSession::onReadyForQuery(char tx_status) {
+	// ReadyForQuery после входа ответом на пачку не является
+	if (batches_done < batches_sent)
+		++batches_done;
+	// PostgreSQL закрывает порталы в конце транзакции
+	if (tx_status != 'I' || portals.empty())
+		return;
+	for (auto portal = portals.begin(); portal != portals.end();) {
+		if (portal->second.batch < batches_done)
+			portal = portals.erase(portal);
+		else
+			++portal;
+	}
+}
+
+Parser::Parser(AsyncLogger *logger) : logger(logger) {
 	if (logger == nullptr) {
 		throw std::invalid_argument("Logger is nullptr");
 	}
+	binary = logger->logFormat() == LogFormat::Binary;
 }
 
-bool Parser::parseClientMessage(const char *data, size_t len) {
+uint32_t Parser::internStatement(std::string_view text) {
+	// у каждого воркера своя таблица: определение текста попадает в то же
+	// кольцо логгера, что и ссылки на него, и в файле всегда идет раньше.
+	// В следующие сегменты его повторяет поток записи логгера.
+	thread_local StringMap<uint32_t> interned;
+
+	auto it = interned.find(text);
+	if (it != interned.end())
+		return it->second;
+
+	if (interned.size() >= LOG_MAX_INTERNED_STATEMENTS)
+		interned.clear();
+	uint32_t id = next_statement_id.fetch_add(1, std::memory_order_relaxed);
+	interned.emplace(text, id);
+	logger->logRecord(LogRecordType::Statement, 0, id, text);
+	return id;
+}
+
+bool Parser::parseClientMessage(ParserSession &session, const char *data,
+								size_t len) {
 	bool logged = false;
 	size_t offset = 0;
 
 	while (offset + 5 <= len) {
 		char type = data[offset];
-		uint32_t msg_len =
-			ntohl(*reinterpret_cast<const uint32_t *>(&data[offset + 1]));
+		// длина в потоке не выровнена
+		uint32_t msg_len;
+		std::memcpy(&msg_len, data + offset + 1, sizeof(msg_len));
+		msg_len = ntohl(msg_len);
 
-		if (offset + 1 + msg_len > len)
+		if (msg_len < 4 || offset + 1 + msg_len > len)
 			break;
 
-		const char *msg = data + offset + 5;
-		size_t msg_size = msg_len - 4;
-
-		switch (type) {
-		case 'Q':
-			logged |= parseQ(msg, msg_size);
-			break;
-		case 'P':
-			logged |= parseP(msg, msg_size);
-			break;
-		case 'E':
-			logged |= parseE(msg, msg_size);
-			break;
-		case 'B':
-			logged |= parseB(msg, msg_size);
-			break;
-		case 'S':
-			logged |= parseS(msg, msg_size);
-			break;
-		case 'X':
-			logged |= parseX(msg, msg_size);
-			break;
-		case 'C':
-			logged |= parseC(msg, msg_size);
-			break;
-		case 'D':
-			logged |= parseD(msg, msg_size);
-			break;
-		case 'H':
-			logged |= parseH(msg, msg_size);
-			break;
-		case 'F':
-			logged |= parseF(msg, msg_size);
-			break;
-		default:
-			break;
-		}
+		logged |= parseMessage(session, type, data + offset + 5, msg_len - 4);
 
 		offset += 1 + msg_len;
 	}
@@ -67,122 +136,235 @@ bool Parser::parseClientMessage(const char *data, size_t len) {
 	return logged;
 }
 
-void Parser::logQuery(const std::string &query) { logger->log(query); }
+bool Parser::parseMessage(ParserSession &session, char type, const char *msg,
+						  size_t msg_size) {
+	switch (type) {
+	case 'Q':
+		return parseQ(session, msg, msg_size);
+	case 'P':
+		return parseP(session, msg, msg_size);
+	case 'E':
+		return parseE(session, msg, msg_size);
+	case 'B':
+		return parseB(session, msg, msg_size);
+	case 'S':
+		return parseS(session, msg, msg_size);
+	case 'X':
+		return parseX(msg, msg_size);
+	case 'C':
+		return parseC(session, msg, msg_size);
+	case 'D':
+		return parseD(msg, msg_size);
+	case 'H':
+		return parseH(msg, msg_size);
+	case 'F':
+		return parseF(session, msg, msg_size);
+	default:
+		return false;
+	}
+}
+
+bool Parser::wantsBody(char type) {
+	switch (type) {
+	case 'Q':
+	case 'P':
+	case 'E':
+	case 'B':
+	case 'S':
+	case 'X':
+	case 'C':
+	case 'D':
+	case 'H':
+	case 'F':
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool Parser::parseStartup(ParserSession &session, const char *data,
+						  size_t len) {
+	constexpr uint32_t PROTOCOL_V3 = 196608;
+	uint32_t protocol;
+	std::memcpy(&protocol, data, sizeof(protocol));
+	if (ntohl(protocol) != PROTOCOL_V3)
+		return false;
+
+	std::string_view user;
+	std::string_view database;
+	size_t offset = 4;
+	while (offset < len && data[offset] != '\0') {
+		size_t key_len = scanNul(data + offset, len - offset);
+		size_t value_off = offset + key_len + 1;
+		if (value_off >= len)
+			break;
+		size_t value_len = scanNul(data + value_off, len - value_off);
+
+		std::string_view key(data + offset, key_len);
+		if (key == "user")
+			user = std::string_view(data + value_off, value_len);
+		else if (key == "database")
+			database = std::string_view(data + value_off, value_len);
+
+		offset = value_off + value_len + 1;
+	}
+
+	// по умолчанию база совпадает с именем пользователя
+	if (database.empty())
+		database = user;
+	if (binary)
+		logger->logRecord(LogRecordType::Startup, session.connection_id, 0,
+						  user, database);
+	else
+		logQuery("[STARTUP] user=", user, " database=", database);
+	return true;
+}
 
-bool Parser::parseQ(const char *data, size_t len) {
-	std::string query(data, strnlen(data, len));
+bool Parser::parseQ(ParserSession &session, const char *data, size_t len) {
+	std::string_view query(data, scanNul(data, len));
+	// пустой Query тоже получает ReadyForQuery
+	++session.batches_sent;
+	if (session.queries.enabled())
+		session.queries.onQuery(query);
 	if (!query.empty()) {
-		logQuery("[QUERY] " + query);
+		if (binary)
+			logger->logRecord(LogRecordType::Query, session.connection_id, 0,
+							  query);
+		else
+			logQuery("[QUERY] ", query);
 		return true;
 	}
 	return false;
 }
 
-bool Parser::parseP(const char *data, size_t len) {
-	size_t stmt_len = strnlen(data, len);
+bool Parser::parseP(ParserSession &session, const char *data, size_t len) {
+	size_t stmt_len = scanNul(data, len);
 	if (stmt_len >= len)
 		return false;
 
-	std::string statement_name(data, stmt_len);
+	std::string_view statement_name(data, stmt_len);
 	const char *query_start = data + stmt_len + 1;
-	size_t query_len = strnlen(query_start, len - stmt_len - 1);
+	size_t query_len = scanNul(query_start, len - stmt_len - 1);
 	if (stmt_len + 1 + query_len > len)
 		return false;
 
-	std::string query(query_start, query_len);
-	if (!query.empty()) {
-		prepared_statements[statement_name] = query;
-		logQuery("[PREPARE] " + statement_name + ": " + query);
-		return true;
+	std::string_view query(query_start, query_len);
+	if (query.empty())
+		return false;
+
+	PreparedStatement &prepared =
+		session.statements[session.statementIndex(statement_name)];
+	if (session.queries.enabled())
+		prepared.stats_slot = session.queries.prepare(query);
+	if (binary) {
+		// текст запроса уже в логе, сессии достаточно его id
+		prepared.statement_id = internStatement(query);
+		logger->logRecord(LogRecordType::Prepare, session.connection_id,
+						  prepared.statement_id, statement_name);
+	} else {
+		// повторный Parse того же имени переиспользует буфер
+		prepared.query.assign(query);
+		logQuery("[PREPARE] ", statement_name, ": ", query);
 	}
-	return false;
+	return true;
 }
 
-bool Parser::parseE(const char *data, size_t len) {
-	std::string portal(data, strnlen(data, len));
-	auto stmt_it = portal_to_statement.find(portal);
-	if (stmt_it != portal_to_statement.end()) {
-		const std::string &stmt_name = stmt_it->second;
-		auto prep_it = prepared_statements.find(stmt_name);
-		if (prep_it != prepared_statements.end()) {
-			logQuery("[EXECUTE] " + portal + " → " + stmt_name + ": " +
-					 prep_it->second);
-		} else {
-			logQuery("[EXECUTE] " + portal + " → unknown statement: '" +
-					 stmt_name + "'");
-		}
+bool Parser::parseE(ParserSession &session, const char *data, size_t len) {
+	std::string_view portal(data, scanNul(data, len));
+	auto portal_it = session.portals.find(portal);
+	if (portal_it == session.portals.end()) {
+		if (session.queries.enabled())
+			session.queries.onExecute(QueryStats::OTHER);
+		if (binary)
+			logger->logRecord(LogRecordType::ExecuteUnknownPortal,
+							  session.connection_id, 0, portal);
+		else
+			logQuery("[EXECUTE] unknown portal: '", portal, "'");
+		return true;
+	}
+
+	const ParserSession::Portal &bound = portal_it->second;
+	if (bound.statement == ParserSession::NO_STATEMENT) {
+		if (session.queries.enabled())
+			session.queries.onExecute(QueryStats::OTHER);
+		if (binary)
+			logger->logRecord(LogRecordType::ExecuteUnknownStatement,
+							  session.connection_id, 0, portal,
+							  bound.unknown_statement);
+		else
+			logQuery("[EXECUTE] ", portal, " → unknown statement: '",
+					 bound.unknown_statement, "'");
+		return true;
+	}
+
+	const PreparedStatement &prepared = session.statements[bound.statement];
+	if (session.queries.enabled())
+		session.queries.onExecute(prepared.stats_slot);
+	if (binary) {
+		logger->logRecord(LogRecordType::Execute, session.connection_id,
+						  prepared.statement_id, portal, prepared.name);
 	} else {
-		logQuery("[EXECUTE] unknown portal: '" + portal + "'");
+		logQuery("[EXECUTE] ", portal, " → ", prepared.name, ": ",
+				 prepared.query);
 	}
 	return true;
 }
 
-bool Parser::parseB(const char *data, size_t len) {
-	size_t portal_len = strnlen(data, len);
+bool Parser::parseB(ParserSession &session, const char *data, size_t len) {
+	size_t portal_len = scanNul(data, len);
 	if (portal_len >= len)
 		return false;
 
 	const char *stmt_ptr = data + portal_len + 1;
-	size_t stmt_len = strnlen(stmt_ptr, len - portal_len - 1);
+	size_t stmt_len = scanNul(stmt_ptr, len - portal_len - 1);
 	if (portal_len + 1 + stmt_len > len)
 		return false;
 
-	std::string portal(data, portal_len);
-	std::string stmt(stmt_ptr, stmt_len);
-	portal_to_statement[portal] = stmt;
-
-	std::string params;
-	const char *params_ptr = stmt_ptr + stmt_len + 1;
-	if (portal_len + 1 + stmt_len + 1 < len) {
-		params =
-			parseParameters(params_ptr, len - (portal_len + 1 + stmt_len + 1));
+	std::string_view portal(data, portal_len);
+	std::string_view stmt(stmt_ptr, stmt_len);
+	// неизвестное имя не заводит оператор: иначе Bind со случайными
+	// именами растил бы таблицы сессии без предела
+	auto portal_it = session.portals.find(portal);
+	if (portal_it == session.portals.end()) {
+		if (session.portals.size() >= ParserSession::MAX_PORTALS)
+			session.portals.clear();
+		portal_it = session.portals.emplace(portal, ParserSession::Portal{})
+						.first;
+	}
+	ParserSession::Portal &bound = portal_it->second;
+	bound.batch = session.batches_sent;
+	bound.statement = session.findStatement(stmt);
+	if (bound.statement == ParserSession::NO_STATEMENT)
+		bound.unknown_statement.assign(stmt);
+
+	std::string_view raw_params;
+	if (portal_len + 1 + stmt_len + 1 < len)
+		raw_params = std::string_view(stmt_ptr + stmt_len + 1,
+									  len - (portal_len + 1 + stmt_len + 1));
+
+	// в бинарном логе параметры лежат как есть, в текст их переводит
+	// pg_proxy_logcat
+	if (binary) {
+		logger->logRecord(LogRecordType::Bind, session.connection_id, 0,
+						  portal, stmt, raw_params);
+		return true;
 	}
 
-	logQuery("[BIND] " + portal + " → " + stmt +
-			 (params.empty() ? "" : " (" + params + ")"));
+	// буфер потока: строка параметров не выделяется заново на каждый Bind
+	thread_local std::string params;
+	params.clear();
+	formatBindParameters(params, raw_params.data(), raw_params.size());
+	if (params.empty())
+		logQuery("[BIND] ", portal, " → ", stmt);
+	else
+		logQuery("[BIND] ", portal, " → ", stmt, " (", params, ")");
 	return true;
 }
 
-std::string Parser::parseParameters(const char *data, size_t len) {
-	if (len < 2)
-		return "";
-
-	uint16_t num_params = ntohs(*reinterpret_cast<const uint16_t *>(data));
-	std::ostringstream oss;
-
-	const char *ptr = data + 2;
-	for (uint16_t i = 0;
-		 i < num_params && (ptr - data) < static_cast<ptrdiff_t>(len); ++i) {
-		if (i > 0)
-			oss << ", ";
-		if (*ptr == '\x01') {
-			oss << "TEXT:";
-			ptr++;
-			uint32_t param_len =
-				ntohl(*reinterpret_cast<const uint32_t *>(ptr));
-			ptr += 4;
-			if ((ptr - data) + param_len > static_cast<ptrdiff_t>(len))
-				break;
-			oss << std::string(ptr, param_len);
-			ptr += param_len;
-		} else if (*ptr == '\x00') {
-			oss << "BINARY:";
-			ptr++;
-			uint32_t param_len =
-				ntohl(*reinterpret_cast<const uint32_t *>(ptr));
-			ptr += 4;
-			if ((ptr - data) + param_len > static_cast<ptrdiff_t>(len))
-				break;
-			oss << "[binary " << param_len << " bytes]";
-			ptr += param_len;
-		} else {
-			break;
-		}
-	}
-	return oss.str();
-}
-
-bool Parser::parseS(const char *data, size_t len) {
+bool Parser::parseS(ParserSession &session, const char *data, size_t len) {
+	++session.batches_sent;
+	if (session.queries.enabled())
+		session.queries.onSync();
 	//	logQuery("[SYNC]");
 	return true;
 }
@@ -192,19 +374,22 @@ bool Parser::parseX(const char *data, size_t len) {
 	return true;
 }
 
-bool Parser::parseC(const char *data, size_t len) {
+bool Parser::parseC(ParserSession &session, const char *data, size_t len) {
 	if (len < 1)
 		return false;
 
 	char close_type = data[0];
-	std::string name(data + 1, strnlen(data + 1, len - 1));
+	std::string_view name(data + 1, scanNul(data + 1, len - 1));
 
 	switch (close_type) {
 	case 'S':
 		//logQuery("[CLOSE STATEMENT] " + name);
+		session.closeStatement(name);
 		break;
 	case 'P':
 		//logQuery("[CLOSE PORTAL] " + name);
+		if (auto it = session.portals.find(name); it != session.portals.end())
+			session.portals.erase(it);
 		break;
 	default:
 		break;
@@ -217,7 +402,7 @@ bool Parser::parseD(const char *data, size_t len) {
 		return false;
 
 	char desc_type = data[0];
-	std::string name(data + 1, strnlen(data + 1, len - 1));
+	std::string_view name(data + 1, scanNul(data + 1, len - 1));
 
 	switch (desc_type) {
 	case 'S':
@@ -237,7 +422,11 @@ bool Parser::parseH(const char *data, size_t len) {
 	return true;
 }
 
-bool Parser::parseF(const char *data, size_t len) {
+bool Parser::parseF(ParserSession &session, const char *data, size_t len) {
+	// на FunctionCall сервер отвечает ReadyForQuery, как на Sync
+	++session.batches_sent;
+	if (session.queries.enabled())
+		session.queries.onSync();
 	///logQuery("[FUNCTION CALL] (legacy)");
 	return true;
 }
\ No newline at end of file
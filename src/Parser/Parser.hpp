@@ -1,32 +1,131 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <string_view>
 #include <unordered_map>
+#include <vector>
 
 #include "AsyncLogger.hpp"
+#include "MessageFramer.hpp"
+#include "QueryStats.hpp"
+
+class Parser;
+
+struct StringHash {
+	using is_transparent = void;
+	size_t operator()(std::string_view text) const {
+		return std::hash<std::string_view>{}(text);
+	}
+};
+
+// таблица с поиском по string_view без временной std::string
+template <typename Value>
+using StringMap =
+	std::unordered_map<std::string, Value, StringHash, std::equal_to<>>;
+
+struct PreparedStatement {
+	std::string name;
+	std::string query;
+	// id интернированного текста в бинарном логе
+	uint32_t statement_id = 0;
+	// запись отпечатка в QueryStats воркера (--query-stats)
+	uint32_t stats_slot = QueryStats::OTHER;
+};
+
+// Состояние разбора одной клиентской сессии. Имена подготовленных
+// операторов и порталов в PostgreSQL локальны для соединения, поэтому
+// таблицы живут в ProxyConnection и освобождаются вместе с ним; общий Parser
+// состояния не хранит и вызывается из всех воркеров без блокировок.
+//
+// Имена операторов интернируются в номера: портал хранит номер, Execute
+// находит оператор по индексу. Обработчики ищут имена по string_view поверх
+// буфера приема, поэтому цикл Bind/Execute/Sync по уже известным именам
+// обходится без выделений памяти.
+class ParserSession : public MessageSink {
+  public:
+	static constexpr uint32_t NO_STATEMENT = UINT32_MAX;
+
+	// открытых порталов одновременно: где ReadyForQuery не разбирается,
+	// сверх этого таблица очищается, как таблица интернированных текстов
+	static constexpr size_t MAX_PORTALS = 1024;
+
+	// Bind с неизвестным оператором оставляет NO_STATEMENT и имя для
+	// строки лога: таблицы операторов заводит только Parse
+	struct Portal {
+		uint32_t statement = NO_STATEMENT;
+		std::string unknown_statement;
+		// номер пачки (до Sync, Query или FunctionCall), в которой привязан
+		uint64_t batch = 0;
+	};
+
+	ParserSession() = default;
+	explicit ParserSession(Parser *parser, QueryStats *stats = nullptr);
+
+	bool wantsBody(char type) const override;
+	void onMessage(char type, const char *body, size_t len) override;
+	void onStartupMessage(const char *body, size_t len) override;
+
+	// номер оператора по имени, новое имя заводится (Parse)
+	uint32_t statementIndex(std::string_view name);
+	// номер оператора по имени, NO_STATEMENT - не подготовлен
+	uint32_t findStatement(std::string_view name) const;
+	void closeStatement(std::string_view name);
+	// ReadyForQuery сервера: вне транзакции ('I') закрываются порталы,
+	// привязанные в пачках, на которые сервер уже ответил
+	void onReadyForQuery(char tx_status);
+
+	StringMap<uint32_t> statement_ids;
+	std::vector<PreparedStatement> statements;
+	// номера закрытых операторов для повторного использования
+	std::vector<uint32_t> free_statements;
+	StringMap<Portal> portals;
+	// отправленные и завершенные ReadyForQuery пачки
+	uint64_t batches_sent = 0;
+	uint64_t batches_done = 0;
+	// номер сессии в бинарном логе
+	uint64_t connection_id = 0;
+	// принят StartupMessage: дальше обе стороны говорят типизированными
+	// сообщениями
+	bool startup_done = false;
+	// запросы, ждущие ответа сервера; ответы подаются в него отдельным
+	// MessageFramer серверного потока
+	QueryTracker queries;
+
+  private:
+	Parser *parser = nullptr;
+};
 
 class Parser {
   public:
 	Parser(AsyncLogger *logger);
 	std::string parse(const char *data, size_t len);
-	bool parseClientMessage(const char *data, size_t len);
+	bool parseClientMessage(ParserSession &session, const char *data,
+							size_t len);
+	bool parseMessage(ParserSession &session, char type, const char *msg,
+					  size_t len);
+	bool parseStartup(ParserSession &session, const char *data, size_t len);
+	static bool wantsBody(char type);
+	const AsyncLogger *getLogger() const { return logger; }
 
   private:
 	AsyncLogger *logger;
+	// LogFormat::Binary: вместо строк пишутся записи для pg_proxy_logcat
+	bool binary;
 
-	std::unordered_map<std::string, std::string> prepared_statements;
-	std::unordered_map<std::string, std::string> portal_to_statement;
+	template <typename... Parts> void logQuery(const Parts &...parts) {
+		logger->log(parts...);
+	}
 
-	void logQuery(const std::string &query);
+	uint32_t internStatement(std::string_view text);
 
-	bool parseQ(const char *data, size_t len);
-	bool parseP(const char *data, size_t len);
-	bool parseE(const char *data, size_t len);
-	bool parseB(const char *data, size_t len);
-	bool parseS(const char *data, size_t len);
+	bool parseQ(ParserSession &session, const char *data, size_t len);
+	bool parseP(ParserSession &session, const char *data, size_t len);
+	bool parseE(ParserSession &session, const char *data, size_t len);
+	bool parseB(ParserSession &session, const char *data, size_t len);
+	bool parseS(ParserSession &session, const char *data, size_t len);
 	bool parseX(const char *data, size_t len);
-	bool parseC(const char *data, size_t len);
+	bool parseC(ParserSession &session, const char *data, size_t len);
 	bool parseD(const char *data, size_t len);
 	bool parseH(const char *data, size_t len);
-	bool parseF(const char *data, size_t len);
-	std::string parseParameters(const char *data, size_t len);
+	bool parseF(ParserSession &session, const char *data, size_t len);
 };
\ No newline at end of file
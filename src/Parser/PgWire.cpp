@@ -0,0 +1,89 @@
+#include "PgWire.hpp"
+#include <arpa/inet.h>
+#include <cstring>
+
+PgMessage::PgMessage(char type) {
+	if (type != 0)
+		data.push_back(type);
+	length_at = data.size();
+	data.append(4, '\0');
+}
+
+PgMessage &PgMessage::int16(uint16_t value) {
+	value = htons(value);
+	data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+	return *this;
+}
+
+PgMessage &PgMessage::int32(uint32_t value) {
+	value = htonl(value);
+	data.append(reinterpret_cast<const char *>(&value), sizeof(value));
+	return *this;
+}
+
+PgMessage &PgMessage::byte(char value) {
+	data.push_back(value);
+	return *this;
+}
+
+PgMessage &PgMessage::str(std::string_view value) {
+	data.append(value);
+	data.push_back('\0');
+	return *this;
+}
+
+PgMessage &PgMessage::bytes(std::string_view value) {
+	data.append(value);
+	return *this;
+}
+
+const std::string &PgMessage::finish() {
+	uint32_t len = htonl(static_cast<uint32_t>(data.size() - length_at));
+	std::memcpy(&data[length_at], &len, sizeof(len));
+	return data;
+}
+
+uint32_t PgReader::int32() {
+	if (len < 4) {
+		valid = false;
+		return 0;
+	}
+	uint32_t value;
+	std::memcpy(&value, data, sizeof(value));
+	data += 4;
+	len -= 4;
+	return ntohl(value);
+}
+
+std::string_view PgReader::str() {
+	const void *end = std::memchr(data, '\0', len);
+	if (end == nullptr) {
+		valid = false;
+		return {};
+	}
+	std::string_view value(data, static_cast<const char *>(end) - data);
+	data += value.size() + 1;
+	len -= value.size() + 1;
+	return value;
+}
+
+std::string_view PgReader::rest() {
+	std::string_view value(data, len);
+	data += len;
+	len = 0;
+	return value;
+}
+
+std::string errorResponse(std::string_view sqlstate, std::string_view message) {
+	return PgMessage('E')
+		.byte('S')
+		.str("FATAL")
+		.byte('V')
+		.str("FATAL")
+		.byte('C')
+		.str(sqlstate)
+		.byte('M')
+		.str(message)
+		.byte('\0')
+		.finish();
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+// коды версий из StartupMessage/служебных запросов
+constexpr uint32_t PROTOCOL_V3 = 196608;
+constexpr uint32_t CANCEL_REQUEST_CODE = 80877102;
+constexpr uint32_t SSL_REQUEST_CODE = 80877103;
+constexpr uint32_t GSSENC_REQUEST_CODE = 80877104;
+
+// Сборка сообщения протокола PostgreSQL: тип, int32 длина, поля.
+// type = 0 - нетипизированное сообщение (StartupMessage). Длина
+// проставляется в finish().
+class PgMessage {
+  public:
+	explicit PgMessage(char type);
+
+	PgMessage &int16(uint16_t value);
+	PgMessage &int32(uint32_t value);
+	PgMessage &byte(char value);
+	// строка с завершающим нулем
+	PgMessage &str(std::string_view value);
+	PgMessage &bytes(std::string_view value);
+
+	const std::string &finish();
+
+  private:
+	std::string data;
+	size_t length_at;
+};
+
+// Последовательное чтение полей тела сообщения. При выходе за границу
+// ok() становится false, а поля возвращаются пустыми.
+class PgReader {
+  public:
+	PgReader(const char *data, size_t len) : data(data), len(len) {}
+
+	uint32_t int32();
+	std::string_view str();
+	std::string_view rest();
+	bool ok() const { return valid; }
+
+  private:
+	const char *data;
+	size_t len;
+	bool valid = true;
+};
+
+// ErrorResponse уровня FATAL
+std::string errorResponse(std::string_view sqlstate, std::string_view message);
@@ -0,0 +1,154 @@
+#include "QueryRoute.hpp"
+#include <cctype>
+#include <string>
+
+static bool isWordStart(unsigned char c) {
+	return isalpha(c) || c == '_' || c >= 0x80;
+}
+
+static bool isWordChar(unsigned char c) {
+	return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+// функции, которые пишут или берут блокировки даже внутри SELECT
+static bool isWritingFunction(std::string_view name) {
+	return name == "nextval" || name == "setval" || name == "set_config" ||
+		   name == "pg_notify" || name.substr(0, 11) == "pg_advisory" ||
+		   name.substr(0, 15) == "pg_try_advisory" || name.substr(0, 3) == "lo_";
+}
+
+namespace {
+// Слова одного оператора вне кавычек и комментариев, в нижнем регистре
+class Statement {
+  public:
+	void word(std::string_view w, bool call) {
+		if (first.empty()) {
+			first = w;
+			prev = w;
+			return;
+		}
+		if (w == "insert" || w == "update" || w == "delete" || w == "merge" ||
+			w == "into" || w == "truncate")
+			writes = true;
+		// FOR UPDATE / FOR NO KEY UPDATE / FOR SHARE / FOR KEY SHARE
+		if (prev == "for" && (w == "share" || w == "no" || w == "key"))
+			writes = true;
+		if (call && isWritingFunction(w))
+			writes = true;
+		if (prev == "read" && w == "only")
+			read_only = true;
+		if (prev == "read" && w == "write")
+			read_write = true;
+		prev = w;
+	}
+
+	bool empty() const { return first.empty(); }
+
+	// false - оператор должен выполняться на основном сервере
+	bool readable(bool &starts_read_only) const {
+		if (first == "select" || first == "with" || first == "values" ||
+			first == "table" || first == "show")
+			return !writes;
+		if (first == "begin" || first == "start") {
+			if (!read_only || read_write)
+				return false;
+			starts_read_only = true;
+			return true;
+		}
+		// завершают уже выбранную транзакцию
+		return first == "commit" || first == "end" || first == "rollback" ||
+			   first == "abort";
+	}
+
+  private:
+	std::string first;
+	std::string prev;
+	bool writes = false;
+	bool read_only = false;
+	bool read_write = false;
+};
+} // namespace
+
+// конец $tag$ ... $tag$ или npos; pos указывает на первый '$'
+static size_t skipDollarQuoted(std::string_view q, size_t pos) {
+	size_t tag_end = pos + 1;
+	while (tag_end < q.size() && q[tag_end] != '$' &&
+		   isWordChar(static_cast<unsigned char>(q[tag_end])))
+		++tag_end;
+	if (tag_end >= q.size() || q[tag_end] != '$')
+		return std::string_view::npos;
+	std::string_view tag = q.substr(pos, tag_end - pos + 1);
+	size_t close = q.find(tag, tag_end + 1);
+	return close == std::string_view::npos ? close : close + tag.size();
+}
+
+QueryRoute classifyQuery(std::string_view q) {
+	Statement statement;
+	bool read_only_tx = false;
+	bool readable = true;
+	std::string word;
+
+	auto endStatement = [&]() {
+		if (!statement.empty() && !statement.readable(read_only_tx))
+			readable = false;
+		statement = Statement();
+	};
+
+	size_t i = 0;
+	while (i < q.size() && readable) {
+		unsigned char c = q[i];
+		if (c == '-' && i + 1 < q.size() && q[i + 1] == '-') {
+			i = q.find('\n', i);
+			if (i == std::string_view::npos)
+				break;
+		} else if (c == '/' && i + 1 < q.size() && q[i + 1] == '*') {
+			i = q.find("*/", i + 2);
+			if (i == std::string_view::npos)
+				return QueryRoute::Primary;
+			i += 2;
+		} else if (c == '\'' || c == '"') {
+			// '' и "" внутри - два соседних литерала, результат тот же
+			size_t close = q.find(c, i + 1);
+			if (close == std::string_view::npos)
+				return QueryRoute::Primary;
+			i = close + 1;
+		} else if (c == '$' && i + 1 < q.size() &&
+				   !isdigit(static_cast<unsigned char>(q[i + 1]))) {
+			i = skipDollarQuoted(q, i);
+			if (i == std::string_view::npos)
+				return QueryRoute::Primary;
+		} else if (c == ';') {
+			endStatement();
+			++i;
+		} else if (isWordStart(c)) {
+			size_t start = i;
+			while (i < q.size() && isWordChar(static_cast<unsigned char>(q[i])))
+				++i;
+			// E'...': обратная косая черта экранирует кавычку
+			if (i - start == 1 && (c == 'e' || c == 'E') && i < q.size() &&
+				q[i] == '\'') {
+				++i;
+				while (i < q.size() && q[i] != '\'')
+					i += q[i] == '\\' ? 2 : 1;
+				if (i >= q.size())
+					return QueryRoute::Primary;
+				++i;
+				continue;
+			}
+			word.assign(q.data() + start, i - start);
+			for (char &ch : word)
+				ch = static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+			size_t next = i;
+			while (next < q.size() && isspace(static_cast<unsigned char>(q[next])))
+				++next;
+			statement.word(word, next < q.size() && q[next] == '(');
+		} else {
+			++i;
+		}
+	}
+	endStatement();
+
+	if (!readable)
+		return QueryRoute::Primary;
+	return read_only_tx ? QueryRoute::ReadOnlyTransaction : QueryRoute::Replica;
+}
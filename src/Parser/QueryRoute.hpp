@@ -0,0 +1,19 @@
+#pragma once
+#include <string_view>
+
+// Куда можно отправить запрос при разделении чтения и записи (--replica)
+enum class QueryRoute {
+	// пишет, меняет состояние сессии или не распознан
+	Primary,
+	// только читает: SELECT, WITH, VALUES, TABLE, SHOW без блокировок строк,
+	// SELECT INTO и функций с побочными эффектами
+	Replica,
+	// BEGIN/START TRANSACTION READ ONLY, возможно вместе с читающими
+	// запросами: вся транзакция может идти на реплику
+	ReadOnlyTransaction,
+};
+
+// Разбирает все операторы текста (через ';'). Литералы, идентификаторы в
+// кавычках и комментарии пропускаются, поэтому слово UPDATE в строке не
+// делает запрос пишущим. В сомнительных случаях - Primary.
+QueryRoute classifyQuery(std::string_view query);
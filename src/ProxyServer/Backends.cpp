@@ -0,0 +1,103 @@
+#include "Backends.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <netdb.h>
+#include <stdexcept>
+#include <unistd.h>
+
+static std::unique_ptr<Backend> resolve(const BackendAddress &address,
+										BackendRole role) {
+	addrinfo hints{};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *res = nullptr;
+	std::string port = std::to_string(address.port);
+	int rc = getaddrinfo(address.host.c_str(), port.c_str(), &hints, &res);
+	if (rc != 0) {
+		throw std::runtime_error("Cannot resolve " + address.host + ": " +
+								 gai_strerror(rc));
+	}
+
+	auto backend = std::make_unique<Backend>();
+	backend->host = address.host;
+	backend->port = address.port;
+	backend->role = role;
+	std::memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+	backend->addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	return backend;
+}
+
+Backends::Backends(const ProxyOptions &options)
+	: by_latency(options.balance == BalanceMode::Latency),
+	  max_failures(options.health_fails) {
+	list.push_back(resolve({options.pg_host, options.pg_port},
+						   BackendRole::Primary));
+	for (const BackendAddress &address : options.backends)
+		list.push_back(resolve(address, BackendRole::Primary));
+	for (const BackendAddress &address : options.replicas)
+		list.push_back(resolve(address, BackendRole::Replica));
+}
+
+int Backends::pickByConnections(BackendRole role) {
+	return pick(
+		role,
+		[this](size_t i) {
+			return list[i]->connections.load(std::memory_order_relaxed);
+		},
+		next.fetch_add(1, std::memory_order_relaxed));
+}
+
+int Backends::connect(size_t i) {
+	Backend &backend = *list[i];
+	int fd = socket(backend.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+		return -1;
+
+	if (::connect(fd, reinterpret_cast<const sockaddr *>(&backend.addr),
+				  backend.addr_len) < 0 &&
+		errno != EINPROGRESS) {
+		int saved_errno = errno;
+		close(fd);
+		connectFailed(i);
+		errno = saved_errno;
+		return -1;
+	}
+
+	backend.connections.fetch_add(1, std::memory_order_relaxed);
+	return fd;
+}
+
+void Backends::release(size_t i) {
+	list[i]->connections.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void Backends::connectFailed(size_t i) { fail(i, "connect failed"); }
+
+void Backends::probeSucceeded(size_t i, uint32_t us) {
+	Backend &backend = *list[i];
+	// скользящее среднее с весом 1/8 у нового замера
+	uint32_t old = backend.latency_us.load(std::memory_order_relaxed);
+	backend.latency_us.store(old == 0 ? us : old - old / 8 + us / 8,
+							 std::memory_order_relaxed);
+	backend.failures.store(0, std::memory_order_relaxed);
+	if (!backend.healthy.exchange(true, std::memory_order_relaxed))
+		fprintf(stderr, "backend %s is back\n", backend.name().c_str());
+}
+
+void Backends::probeFailed(size_t i) { fail(i, "health check failed"); }
+
+void Backends::fail(size_t i, const char *reason) {
+	Backend &backend = *list[i];
+	uint32_t failures =
+		backend.failures.fetch_add(1, std::memory_order_relaxed) + 1;
+	if (failures < max_failures)
+		return;
+	// исключает и сообщает только один поток
+	if (backend.healthy.exchange(false, std::memory_order_relaxed)) {
+		backend.ejections.fetch_add(1, std::memory_order_relaxed);
+		fprintf(stderr, "backend %s ejected: %s %u times in a row\n",
+				backend.name().c_str(), reason, failures);
+	}
+}
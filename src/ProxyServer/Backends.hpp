@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+#include "ProxyOptions.hpp"
+
+// Primary: <pg_host> <pg_port> и --backend, Replica: --replica
+enum class BackendRole { Primary, Replica };
+
+// Сервер PostgreSQL. Адрес разрешается один раз при старте. Счетчики
+// общие для всех воркеров и потока проверок, поэтому каждый сервер лежит
+// на своей кэш-линии.
+struct alignas(64) Backend {
+	std::string host;
+	int port = 0;
+	BackendRole role = BackendRole::Primary;
+	sockaddr_storage addr{};
+	socklen_t addr_len = 0;
+
+	std::atomic<bool> healthy{true};
+	// открытые соединения прокси с сервером
+	std::atomic<int> connections{0};
+	// сглаженное время ответа на проверку, 0 - проверок еще не было
+	std::atomic<uint32_t> latency_us{0};
+	// неудачи подряд: проверки и connect() воркеров
+	std::atomic<uint32_t> failures{0};
+	std::atomic<uint64_t> ejections{0};
+
+	std::string name() const { return host + ":" + std::to_string(port); }
+};
+
+// Список серверов, выбор по нагрузке и учет здоровья. Сервер исключается
+// после --health-fails неудач подряд и возвращается первой удачной
+// проверкой HealthChecker.
+class Backends {
+  public:
+	explicit Backends(const ProxyOptions &options);
+
+	size_t size() const { return list.size(); }
+	Backend &operator[](size_t i) { return *list[i]; }
+	const Backend &operator[](size_t i) const { return *list[i]; }
+
+	// Здоровый сервер роли с наименьшей нагрузкой load(i) (с
+	// --balance=latency - нагрузкой, умноженной на время ответа). Равные
+	// перебираются начиная со start, чтобы нагрузка шла по кругу. Если
+	// здоровых нет: для Primary - лучший из всех (попытка лучше отказа),
+	// для Replica - -1.
+	template <typename Load>
+	int pick(BackendRole role, Load load, size_t start) const {
+		for (bool any : {false, true}) {
+			if (any && role == BackendRole::Replica)
+				break;
+			int best = -1;
+			uint64_t best_score = std::numeric_limits<uint64_t>::max();
+			for (size_t n = 0; n < list.size(); ++n) {
+				size_t i = (start + n) % list.size();
+				const Backend &backend = *list[i];
+				if (backend.role != role ||
+					(!any && !backend.healthy.load(std::memory_order_relaxed)))
+					continue;
+				uint64_t score = static_cast<uint64_t>(load(i));
+				if (by_latency) {
+					uint32_t us =
+						backend.latency_us.load(std::memory_order_relaxed);
+					score = (score + 1) * (us ? us : 1);
+				}
+				if (score < best_score) {
+					best = static_cast<int>(i);
+					best_score = score;
+				}
+			}
+			if (best >= 0)
+				return best;
+		}
+		return -1;
+	}
+
+	// pick() по числу соединений всех воркеров
+	int pickByConnections(BackendRole role);
+
+	// Неблокирующий connect() к серверу i, -1 с errno при ошибке.
+	// Удачный вызов учитывается в connections до release().
+	int connect(size_t i);
+	void release(size_t i);
+	// соединение не установилось (SO_ERROR, таймаут)
+	void connectFailed(size_t i);
+
+	void probeSucceeded(size_t i, uint32_t us);
+	void probeFailed(size_t i);
+
+  private:
+	void fail(size_t i, const char *reason);
+
+	std::vector<std::unique_ptr<Backend>> list;
+	bool by_latency = false;
+	uint32_t max_failures = 3;
+	std::atomic<size_t> next{0};
+};
@@ -0,0 +1,77 @@
+#include "CancelSender.hpp"
+#include <cerrno>
+#include <cstdio>
+#include <string>
+#include <sys/epoll.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "PgWire.hpp"
+
+CancelSender::CancelSender() {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"epoll_create1() failed");
+	}
+}
+
+CancelSender::~CancelSender() { close(epoll_fd); }
+
+void CancelSender::send(const Backend &backend, uint32_t pid, uint32_t key) {
+	int fd = socket(backend.addr.ss_family,
+					SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket() failed");
+		return;
+	}
+	auto *request = new Request{fd, pid, key};
+	if (connect(fd, reinterpret_cast<const sockaddr *>(&backend.addr),
+				backend.addr_len) == 0) {
+		finish(request, true);
+		return;
+	}
+	if (errno != EINPROGRESS) {
+		perror("connect() failed");
+		finish(request, false);
+		return;
+	}
+
+	// EPOLLONESHOT: событие получит ровно один вызов poll()
+	epoll_event ev{};
+	ev.events = EPOLLOUT | EPOLLONESHOT;
+	ev.data.ptr = request;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		finish(request, false);
+	}
+}
+
+void CancelSender::poll() {
+	epoll_event events[16];
+	int nfds = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < nfds; ++i) {
+		auto *request = static_cast<Request *>(events[i].data.ptr);
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if (getsockopt(request->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+			err = errno;
+		finish(request, err == 0);
+	}
+}
+
+void CancelSender::finish(Request *request, bool connected) {
+	if (connected) {
+		// сервер сам закрывает соединение, ответа на CancelRequest нет
+		std::string message = PgMessage(0)
+								  .int32(CANCEL_REQUEST_CODE)
+								  .int32(request->pid)
+								  .int32(request->key)
+								  .finish();
+		if (::send(request->fd, message.data(), message.size(),
+				   MSG_NOSIGNAL) != static_cast<ssize_t>(message.size()))
+			perror("send() of CancelRequest failed");
+	}
+	close(request->fd);
+	delete request;
+}
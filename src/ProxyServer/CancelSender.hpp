@@ -0,0 +1,34 @@
+#pragma once
+#include <cstdint>
+
+#include "Backends.hpp"
+
+// Отправка CancelRequest серверу PostgreSQL (--query-timeout-ms). Воркер
+// только начинает неблокирующий connect(), а сам запрос уходит из потока
+// приема, когда сокет подключится: соединения живут в своем epoll, который
+// добавляется в epoll потока приема, как у HealthChecker.
+class CancelSender {
+  public:
+	CancelSender();
+	~CancelSender();
+	CancelSender(const CancelSender &) = delete;
+	CancelSender &operator=(const CancelSender &) = delete;
+
+	int fd() const { return epoll_fd; }
+	// отменить запрос бэкенда pid на сервере; вызывается из воркеров
+	void send(const Backend &backend, uint32_t pid, uint32_t key);
+	// отправить запросы подключившихся сокетов, не блокируясь
+	void poll();
+
+  private:
+	struct Request {
+		int fd;
+		uint32_t pid;
+		uint32_t key;
+	};
+
+	// отправить запрос, если соединение установилось, и закрыть сокет
+	static void finish(Request *request, bool connected);
+
+	int epoll_fd = -1;
+};
@@ -0,0 +1,133 @@
+#include "ChunkBuffer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <utility>
+
+constexpr size_t CHUNKS_PER_SLAB = 64;
+
+void ChunkPool::grow() {
+	slabs.emplace_back(new Chunk[CHUNKS_PER_SLAB]);
+	Chunk *slab = slabs.back().get();
+	for (size_t i = 0; i < CHUNKS_PER_SLAB; ++i) {
+		slab[i].next = free_list;
+		free_list = &slab[i];
+	}
+	allocated_chunks.fetch_add(CHUNKS_PER_SLAB, std::memory_order_relaxed);
+}
+
+Chunk *ChunkPool::acquire() {
+	if (!free_list)
+		grow();
+	Chunk *chunk = free_list;
+	free_list = chunk->next;
+	chunk->next = nullptr;
+	chunk->begin = chunk->end = 0;
+	return chunk;
+}
+
+void ChunkPool::release(Chunk *chunk) {
+	chunk->next = free_list;
+	free_list = chunk;
+}
+
+ChunkBuffer::ChunkBuffer(ChunkBuffer &&other) noexcept
+	: pool(other.pool), head(std::exchange(other.head, nullptr)),
+	  tail(std::exchange(other.tail, nullptr)),
+	  bytes(std::exchange(other.bytes, 0)) {}
+
+ChunkBuffer &ChunkBuffer::operator=(ChunkBuffer &&other) noexcept {
+	if (this != &other) {
+		clear();
+		pool = other.pool;
+		head = std::exchange(other.head, nullptr);
+		tail = std::exchange(other.tail, nullptr);
+		bytes = std::exchange(other.bytes, 0);
+	}
+	return *this;
+}
+
+char *ChunkBuffer::writable(size_t &len) {
+	if (!tail || tail->end == CHUNK_SIZE) {
+		Chunk *chunk = pool->acquire();
+		if (tail)
+			tail->next = chunk;
+		else
+			head = chunk;
+		tail = chunk;
+	}
+	len = CHUNK_SIZE - tail->end;
+	return tail->data + tail->end;
+}
+
+void ChunkBuffer::commit(size_t n) {
+	tail->end += n;
+	bytes += n;
+}
+
+void ChunkBuffer::append(const char *src, size_t n) {
+	while (n > 0) {
+		size_t space;
+		char *dst = writable(space);
+		size_t part = std::min(space, n);
+		memcpy(dst, src, part);
+		commit(part);
+		src += part;
+		n -= part;
+	}
+}
+
+int ChunkBuffer::readable(iovec *iov, int max_iov) const {
+	int count = 0;
+	for (Chunk *chunk = head; chunk && count < max_iov; chunk = chunk->next) {
+		if (chunk->end == chunk->begin)
+			continue;
+		iov[count].iov_base = chunk->data + chunk->begin;
+		iov[count].iov_len = chunk->end - chunk->begin;
+		++count;
+	}
+	return count;
+}
+
+void ChunkBuffer::consume(size_t n) {
+	bytes -= n;
+	while (n > 0) {
+		size_t part = std::min<size_t>(n, head->end - head->begin);
+		head->begin += part;
+		n -= part;
+		if (head->begin == head->end) {
+			Chunk *next = head->next;
+			pool->release(head);
+			head = next;
+			if (!head)
+				tail = nullptr;
+		}
+	}
+}
+
+void ChunkBuffer::clear() {
+	while (head) {
+		Chunk *next = head->next;
+		pool->release(head);
+		head = next;
+	}
+	tail = nullptr;
+	bytes = 0;
+}
+
+bool flushBuffer(int fd, ChunkBuffer &buf) {
+	constexpr int MAX_IOV = 16;
+	iovec iov[MAX_IOV];
+
+	while (!buf.empty()) {
+		msghdr msg{};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = buf.readable(iov, MAX_IOV);
+		ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (sent < 0)
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		buf.consume(sent);
+	}
+	return false;
+}
@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string_view>
+#include <sys/uio.h>
+#include <vector>
+
+constexpr size_t CHUNK_SIZE = 16384;
+
+struct Chunk {
+	Chunk *next;
+	// непрочитанные байты лежат в data[begin, end)
+	uint32_t begin;
+	uint32_t end;
+	char data[CHUNK_SIZE];
+};
+
+// Пул кусков фиксированного размера одного воркера. Память берется у кучи
+// пачками и обратно не отдается, освобожденные куски идут в список
+// свободных, поэтому на пути пересылки аллокаций нет. Без блокировок:
+// пользуется только поток воркера.
+class ChunkPool {
+  public:
+	ChunkPool() = default;
+	ChunkPool(const ChunkPool &) = delete;
+	ChunkPool &operator=(const ChunkPool &) = delete;
+
+	Chunk *acquire();
+	void release(Chunk *chunk);
+
+	// сколько кусков выделено у кучи (читается из других потоков)
+	size_t allocated() const {
+		return allocated_chunks.load(std::memory_order_relaxed);
+	}
+
+  private:
+	void grow();
+
+	std::vector<std::unique_ptr<Chunk[]>> slabs;
+	Chunk *free_list = nullptr;
+	std::atomic<size_t> allocated_chunks{0};
+};
+
+// Очередь байтов из цепочки кусков пула: append/recv дописывают в хвост,
+// consume освобождает прочитанные куски из головы. Пустой буфер кусков не
+// держит.
+class ChunkBuffer {
+  public:
+	ChunkBuffer() = default;
+	explicit ChunkBuffer(ChunkPool *pool) : pool(pool) {}
+	~ChunkBuffer() { clear(); }
+
+	ChunkBuffer(const ChunkBuffer &) = delete;
+	ChunkBuffer &operator=(const ChunkBuffer &) = delete;
+	ChunkBuffer(ChunkBuffer &&other) noexcept;
+	ChunkBuffer &operator=(ChunkBuffer &&other) noexcept;
+
+	bool empty() const { return bytes == 0; }
+	size_t size() const { return bytes; }
+
+	// непрерывное место в хвосте для recv(); потом commit(n)
+	char *writable(size_t &len);
+	void commit(size_t n);
+
+	void append(const char *src, size_t n);
+	void append(std::string_view src) { append(src.data(), src.size()); }
+
+	// до max_iov непрерывных кусков данных с начала буфера
+	int readable(iovec *iov, int max_iov) const;
+	void consume(size_t n);
+
+	void clear();
+
+  private:
+	ChunkPool *pool = nullptr;
+	Chunk *head = nullptr;
+	Chunk *tail = nullptr;
+	size_t bytes = 0;
+};
+
+// sendmsg() содержимого буфера в сокет, пока тот принимает. true - ошибка
+// сокета (EAGAIN ошибкой не считается).
+bool flushBuffer(int fd, ChunkBuffer &buf);
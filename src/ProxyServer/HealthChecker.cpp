@@ -0,0 +1,158 @@
+#include "HealthChecker.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdint>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "PgWire.hpp"
+
+// data.u64 таймера; у проверок - номер сервера
+constexpr uint64_t TIMER = UINT64_MAX;
+
+HealthChecker::HealthChecker(Backends &backends, int interval_ms)
+	: backends(backends), probes(backends.size()) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"epoll_create1() failed");
+	}
+	timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0) {
+		int saved_errno = errno;
+		close(epoll_fd);
+		throw std::system_error(saved_errno, std::system_category(),
+								"timerfd_create() failed");
+	}
+
+	// первый раунд сразу после старта, дальше с периодом interval_ms
+	itimerspec spec{};
+	spec.it_value.tv_nsec = 1000000;
+	spec.it_interval.tv_sec = interval_ms / 1000;
+	spec.it_interval.tv_nsec = static_cast<long>(interval_ms % 1000) * 1000000;
+	timerfd_settime(timer_fd, 0, &spec, nullptr);
+
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.u64 = TIMER;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &ev);
+}
+
+HealthChecker::~HealthChecker() {
+	for (Probe &probe : probes) {
+		if (probe.fd >= 0)
+			close(probe.fd);
+	}
+	close(timer_fd);
+	close(epoll_fd);
+}
+
+void HealthChecker::poll() {
+	epoll_event events[16];
+	int nfds = epoll_wait(epoll_fd, events, 16, 0);
+	for (int i = 0; i < nfds; ++i) {
+		if (events[i].data.u64 == TIMER) {
+			uint64_t expirations;
+			read(timer_fd, &expirations, sizeof(expirations));
+			startRound();
+		} else {
+			onProbeEvent(events[i].data.u64, events[i].events);
+		}
+	}
+}
+
+void HealthChecker::startRound() {
+	for (size_t i = 0; i < probes.size(); ++i) {
+		// не ответил за период
+		if (probes[i].fd >= 0)
+			finish(i, false);
+		startProbe(i);
+	}
+}
+
+void HealthChecker::startProbe(size_t i) {
+	const Backend &backend = backends[i];
+	Probe &probe = probes[i];
+	probe.started = Clock::now();
+	probe.sent = false;
+	probe.fd = socket(backend.addr.ss_family,
+					  SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (probe.fd < 0) {
+		perror("socket() failed");
+		return;
+	}
+	if (connect(probe.fd, reinterpret_cast<const sockaddr *>(&backend.addr),
+				backend.addr_len) < 0 &&
+		errno != EINPROGRESS) {
+		finish(i, false);
+		return;
+	}
+
+	epoll_event ev{};
+	ev.events = EPOLLOUT;
+	ev.data.u64 = i;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, probe.fd, &ev) < 0) {
+		perror("epoll_ctl() failed");
+		close(probe.fd);
+		probe.fd = -1;
+	}
+}
+
+void HealthChecker::onProbeEvent(size_t i, uint32_t events) {
+	Probe &probe = probes[i];
+	if (probe.fd < 0)
+		return;
+
+	// Ошибка сокета или разрыв до отправки запроса - неудача. Разрыв после
+	// нее ответ не отменяет: байт мог прийти раньше закрытия.
+	if ((events & EPOLLERR) || (!probe.sent && (events & EPOLLHUP))) {
+		finish(i, false);
+		return;
+	}
+
+	if (!probe.sent) {
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if (getsockopt(probe.fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+			err = errno;
+		std::string request =
+			PgMessage(0).int32(SSL_REQUEST_CODE).finish();
+		if (err != 0 || send(probe.fd, request.data(), request.size(),
+							 MSG_NOSIGNAL) !=
+							static_cast<ssize_t>(request.size())) {
+			finish(i, false);
+			return;
+		}
+		probe.sent = true;
+		epoll_event ev{};
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.u64 = i;
+		epoll_ctl(epoll_fd, EPOLL_CTL_MOD, probe.fd, &ev);
+		return;
+	}
+
+	char reply;
+	ssize_t len = recv(probe.fd, &reply, 1, 0);
+	if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return;
+	// 'E' - ErrorResponse серверов, не знающих SSLRequest
+	finish(i, len == 1 && (reply == 'S' || reply == 'N' || reply == 'E'));
+}
+
+void HealthChecker::finish(size_t i, bool ok) {
+	Probe &probe = probes[i];
+	if (probe.fd >= 0) {
+		close(probe.fd);
+		probe.fd = -1;
+	}
+	if (ok) {
+		auto elapsed = Clock::now() - probe.started;
+		backends.probeSucceeded(
+			i, std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+				   .count());
+	} else {
+		backends.probeFailed(i);
+	}
+}
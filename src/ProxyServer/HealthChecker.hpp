@@ -0,0 +1,43 @@
+#pragma once
+#include <chrono>
+#include <vector>
+
+#include "Backends.hpp"
+
+// Периодическая проверка серверов из потока приема: неблокирующий
+// connect() и SSLRequest, на который PostgreSQL отвечает одним байтом
+// ('S' или 'N') без входа. С ssl = off сервер ничего не пишет в свой лог,
+// с ssl = on каждая проверка оставляет в нем "could not accept SSL
+// connection: EOF detected": TLS-рукопожатия после 'S' не будет. Не
+// ответивший до следующего раунда сервер считается неудачей. Сокеты живут в своем epoll,
+// который добавляется в epoll потока приема, как у MetricsServer.
+class HealthChecker {
+  public:
+	HealthChecker(Backends &backends, int interval_ms);
+	~HealthChecker();
+	HealthChecker(const HealthChecker &) = delete;
+	HealthChecker &operator=(const HealthChecker &) = delete;
+
+	int fd() const { return epoll_fd; }
+	// обработать готовые сокеты и таймер, не блокируясь
+	void poll();
+
+  private:
+	using Clock = std::chrono::steady_clock;
+
+	struct Probe {
+		int fd = -1;
+		Clock::time_point started;
+		bool sent = false;
+	};
+
+	void startRound();
+	void startProbe(size_t i);
+	void onProbeEvent(size_t i, uint32_t events);
+	void finish(size_t i, bool ok);
+
+	Backends &backends;
+	int epoll_fd = -1;
+	int timer_fd = -1;
+	std::vector<Probe> probes;
+};
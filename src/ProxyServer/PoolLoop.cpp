@@ -0,0 +1,1191 @@
+#include "PoolLoop.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+
+#include "Crypto.hpp"
+#include "PgWire.hpp"
+#include "QueryRoute.hpp"
+
+// коды AuthenticationXXX
+constexpr uint32_t AUTH_OK = 0;
+constexpr uint32_t AUTH_CLEARTEXT = 3;
+constexpr uint32_t AUTH_MD5 = 5;
+constexpr uint32_t AUTH_SASL = 10;
+constexpr uint32_t AUTH_SASL_CONTINUE = 11;
+constexpr uint32_t AUTH_SASL_FINAL = 12;
+
+static std::string md5Password(const std::string &password,
+							   const std::string &user,
+							   std::string_view salt) {
+	return "md5" + md5Hex(md5Hex(password + user) + std::string(salt));
+}
+
+class ClientSink : public MessageSink {
+  public:
+	ClientSink(PoolLoop &loop, PoolClient &client)
+		: loop(loop), client(client) {}
+
+	bool wantsBody(char type) const override { return true; }
+
+	void onMessage(char type, const char *body, size_t len) override {
+		if (!client.dead && !client.closing)
+			loop.onClientMessage(client, type, body, len);
+	}
+
+	void onStartupMessage(const char *body, size_t len) override {
+		if (!client.dead && !client.closing)
+			loop.onClientStartup(client, body, len);
+	}
+
+	void onOversizedMessage(char type, size_t len) override {
+		if (!client.dead)
+			loop.failClient(client, "54000", "message is too large");
+	}
+
+  private:
+	PoolLoop &loop;
+	PoolClient &client;
+};
+
+class ServerSink : public MessageSink {
+  public:
+	ServerSink(PoolLoop &loop, PoolServer &server)
+		: loop(loop), server(server) {}
+
+	// пока сервер у клиента, ответы уходят клиенту как есть, а разбирается
+	// только ReadyForQuery и то, что нужно статистике запросов
+	bool wantsBody(char type) const override {
+		return server.state != ServerState::Active || type == 'Z' ||
+			   (loop.options.query_stats && QueryTracker::wantsResponse(type));
+	}
+
+	void onMessage(char type, const char *body, size_t len) override {
+		if (!server.dead && !server.failed)
+			loop.onServerMessage(server, type, body, len);
+	}
+
+	void onOversizedMessage(char type, size_t len) override {
+		server.failed = true;
+	}
+
+  private:
+	PoolLoop &loop;
+	PoolServer &server;
+};
+
+PoolLoop::PoolLoop(Worker *worker, const ProxyOptions &options,
+				   Parser *const &parser, const AuthFile &auth_file,
+				   Backends &backends, CancelSender *cancel_sender)
+	: worker(worker), options(options), parser(parser), auth_file(auth_file),
+	  backends(backends), cancel_sender(cancel_sender),
+	  high_water(static_cast<size_t>(options.high_water_kb) * 1024),
+	  low_water(static_cast<size_t>(options.low_water_kb) * 1024) {}
+
+void PoolLoop::run() {
+	epoll_event events[MAX_EVENTS];
+
+	while (true) {
+		// спим до ближайшего таймера из двух колес, без таймеров - до событий
+		auto now = Clock::now();
+		int client_timeout = client_timers.timeoutMs(now);
+		int server_timeout = server_timers.timeoutMs(now);
+		int timeout = client_timeout < 0	? server_timeout
+					  : server_timeout < 0 ? client_timeout
+										   : std::min(client_timeout,
+													  server_timeout);
+		int nfds = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, timeout);
+		worker->loop_now = Clock::now();
+		if (nfds > 0)
+			worker->metrics.wakeups.fetch_add(1, std::memory_order_relaxed);
+		for (int i = 0; i < nfds; ++i) {
+			int fd = events[i].data.fd;
+
+			if (fd == worker->listen_fd) {
+				acceptClients();
+			} else if (fd == worker->wake_fd) {
+				drainNewConnections();
+			} else if (auto it = clients.find(fd); it != clients.end()) {
+				PoolClient &client = it->second;
+				if (!client.dead)
+					onClientEvent(client, events[i].events);
+				if (!client.dead)
+					armClient(client);
+			} else if (auto it = servers.find(fd); it != servers.end()) {
+				// сервер мог вернуться в пул во время обработки, а сроки
+				// его клиента - поменяться
+				int client_fd = it->second.client_fd;
+				if (!it->second.dead)
+					onServerEvent(it->second, events[i].events);
+				if (auto client = clients.find(client_fd);
+					client != clients.end() && !client->second.dead)
+					armClient(client->second);
+			}
+			reap();
+		}
+
+		client_timers.advance(worker->loop_now, [&](PoolClient &client) {
+			onClientTimer(client);
+		});
+		server_timers.advance(worker->loop_now, [&](PoolServer &server) {
+			onServerTimer(server);
+		});
+		reap();
+		worker->metrics.busy_ns.fetch_add(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				Clock::now() - worker->loop_now)
+				.count(),
+			std::memory_order_relaxed);
+	}
+}
+
+void PoolLoop::acceptClients() {
+	while (true) {
+		int client_fd =
+			accept4(worker->listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+		if (client_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4() failed");
+			return;
+		}
+		worker->metrics.accepts.fetch_add(1, std::memory_order_relaxed);
+		addClient(client_fd);
+	}
+}
+
+void PoolLoop::drainNewConnections() {
+	uint64_t value;
+	read(worker->wake_fd, &value, sizeof(value));
+
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	while (!worker->new_connections.empty()) {
+		addClient(worker->new_connections.front().client_fd);
+		worker->new_connections.pop();
+	}
+}
+
+void PoolLoop::addClient(int fd) {
+	// fd мог достаться от закрытого в этой же итерации соединения
+	clients.erase(fd);
+	PoolClient &client = clients[fd];
+	client.fd = fd;
+	client.to_server = ChunkBuffer(&worker->chunk_pool);
+	client.to_client = ChunkBuffer(&worker->chunk_pool);
+	client.held.data = ChunkBuffer(&worker->chunk_pool);
+	if (parser)
+		client.parser_session =
+			ParserSession(parser, worker->query_stats.get());
+	client.last_active = worker->loop_now;
+	armClient(client);
+
+	worker->updateEvents(fd, client.events, RELAY_EVENTS);
+	worker->metrics.active_connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PoolLoop::onClientEvent(PoolClient &client, uint32_t events) {
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+		readClient(client);
+		if (client.dead)
+			return;
+	}
+
+	if (events & EPOLLOUT) {
+		if (flushBuffer(client.fd, client.to_client)) {
+			closeClient(client);
+			return;
+		}
+		if (client.server_fd >= 0) {
+			PoolServer &server = servers[client.server_fd];
+			if (server.throttled && client.to_client.size() <= low_water)
+				resumeServer(server);
+		}
+	}
+}
+
+void PoolLoop::readClient(PoolClient &client) {
+	char data[BUFFER_SIZE];
+
+	while (!client.throttled) {
+		if (client.to_server.size() + client.held.data.size() >= high_water) {
+			throttleClient(client);
+			break;
+		}
+
+		ssize_t len = recv(client.fd, data, sizeof(data), 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			closeClient(client);
+			return;
+		} else if (len == 0) {
+			closeClient(client);
+			return;
+		}
+		client.last_active = worker->loop_now;
+
+		// сообщения перекладываются в to_server целиком, поэтому сервер
+		// можно отдать другому клиенту на любой границе сообщения
+		ClientSink sink(*this, client);
+		client.framer.feed(data, len, sink);
+		if (client.dead)
+			return;
+		// TLS после отказа, мусор вместо протокола
+		if (client.framer.opaque())
+			client.closing = true;
+
+		dispatchClient(client);
+		if (client.dead)
+			return;
+		worker->metrics.relayed_chunks.fetch_add(1, std::memory_order_relaxed);
+		worker->metrics.client_bytes.fetch_add(len, std::memory_order_relaxed);
+		worker->metrics.buffer_occupancy.record(client.to_server.size());
+	}
+}
+
+void PoolLoop::dispatchClient(PoolClient &client) {
+	if (flushBuffer(client.fd, client.to_client) || client.closing) {
+		closeClient(client);
+		return;
+	}
+	if (client.state != ClientState::Ready || client.to_server.empty())
+		return;
+
+	if (client.server_fd >= 0)
+		flushToServer(client, servers[client.server_fd]);
+	else if (!client.waiting)
+		acquireServer(client);
+}
+
+void PoolLoop::onClientStartup(PoolClient &client, const char *body,
+							   size_t len) {
+	PgReader reader(body, len);
+	uint32_t code = reader.int32();
+
+	if (code == SSL_REQUEST_CODE || code == GSSENC_REQUEST_CODE) {
+		// шифрование не поддерживается, клиент продолжит открытым текстом
+		client.to_client.append("N", 1);
+		return;
+	}
+	if (code == CANCEL_REQUEST_CODE) {
+		client.closing = true;
+		return;
+	}
+	if (code != PROTOCOL_V3) {
+		failClient(client, "0A000", "unsupported frontend protocol");
+		return;
+	}
+	if (parser)
+		client.parser_session.onStartupMessage(body, len);
+
+	while (reader.ok()) {
+		std::string_view name = reader.str();
+		if (name.empty())
+			break;
+		std::string_view value = reader.str();
+		if (name == "user")
+			client.user = value;
+		else if (name == "database")
+			client.database = value;
+	}
+	if (client.user.empty()) {
+		failClient(client, "28000",
+				   "no PostgreSQL user name specified in startup packet");
+		return;
+	}
+	if (client.database.empty())
+		client.database = client.user;
+	client.pool = pickPool(client, BackendRole::Primary);
+
+	if (!auth_file.loaded()) {
+		finishClientAuth(client);
+		return;
+	}
+	if (auth_file.password(client.user) == nullptr) {
+		failClient(client, "28P01",
+				   "password authentication failed for user \"" +
+					   client.user + "\"");
+		return;
+	}
+
+	randomBytes(client.salt, sizeof(client.salt));
+	client.to_client.append(
+		PgMessage('R')
+			.int32(AUTH_MD5)
+			.bytes(std::string_view(client.salt, sizeof(client.salt)))
+			.finish());
+	client.state = ClientState::Auth;
+}
+
+void PoolLoop::onClientMessage(PoolClient &client, char type, const char *body,
+							   size_t len) {
+	if (client.state == ClientState::Auth) {
+		if (type == 'p')
+			checkPassword(client, body, len);
+		else
+			failClient(client, "08P01", "expected password response");
+		return;
+	}
+
+	if (parser && client.parser_session.wantsBody(type))
+		client.parser_session.onMessage(type, body, len);
+
+	if (type == 'X') {
+		// Terminate серверу не передается: соединение остается в пуле
+		client.closing = true;
+		return;
+	}
+	if (!options.replicas.empty())
+		routeMessage(client, type, body, len);
+
+	bool held = client.held.active;
+	unsigned &syncs = held ? client.held.syncs : client.pending_syncs;
+	bool was_idle = syncs == 0;
+	bool &open_batch = held ? client.held.open_batch : client.open_batch;
+	switch (type) {
+	case 'Q':
+	case 'F':
+		++syncs;
+		break;
+	case 'S':
+		++syncs;
+		open_batch = false;
+		break;
+	case 'P':
+		// имя оператора - первая строка тела, пустое у безымянного
+		if (len > 0 && body[0] != '\0') {
+			if (held)
+				client.held.pinned = true;
+			else if (client.route != nullptr &&
+					 backends[client.route->backend].role ==
+						 BackendRole::Replica)
+				client.discard_server = true;
+			else
+				client.pinned = true;
+		}
+		open_batch = true;
+		break;
+	case 'B':
+	case 'E':
+	case 'D':
+	case 'C':
+	case 'H':
+		open_batch = true;
+		break;
+	default:
+		break;
+	}
+	if (!held && was_idle && syncs > 0) {
+		client.query_started = worker->loop_now;
+		client.cancel_sent = false;
+	}
+
+	ChunkBuffer &out = held ? client.held.data : client.to_server;
+	char header[5];
+	header[0] = type;
+	uint32_t msg_len = htonl(static_cast<uint32_t>(len + 4));
+	std::memcpy(header + 1, &msg_len, sizeof(msg_len));
+	out.append(header, sizeof(header));
+	out.append(body, len);
+}
+
+// Транзакция идет на сервер, выбранный по ее первому сообщению: реплика -
+// для читающего Query или безымянного Parse, основной - для всего
+// остального. Именованный Parse закрепляет клиента за сервером до конца
+// сессии, поэтому, начиная транзакцию, всегда выбирает основной; внутри
+// уже начатой на реплике транзакции он остается на ней без закрепления.
+// Запись, пришедшая следом за читающим запросом до его ReadyForQuery,
+// откладывается в held. Закрепленный клиент сервер не отпускает, и held
+// его не ждет.
+void PoolLoop::routeMessage(PoolClient &client, char type, const char *body,
+							size_t len) {
+	if (client.held.active || client.pinned)
+		return;
+	if (client.route != nullptr &&
+		(backends[client.route->backend].role == BackendRole::Primary ||
+		 client.read_only_tx || client.open_batch))
+		return;
+
+	QueryRoute route = QueryRoute::Primary;
+	if (type == 'Q') {
+		route = classifyQuery(std::string_view(body, strnlen(body, len)));
+	} else if (type == 'P') {
+		PgReader reader(body, len);
+		std::string_view name = reader.str();
+		std::string_view query = reader.str();
+		if (reader.ok() && name.empty())
+			route = classifyQuery(query);
+	} else if (type != 'F' && client.route != nullptr) {
+		// Bind/Execute/Sync и прочее продолжают выбранную транзакцию
+		return;
+	}
+
+	if (client.route == nullptr) {
+		if (route != QueryRoute::Primary)
+			client.route = pickPool(client, BackendRole::Replica);
+		// без здоровых реплик читающая транзакция идет на основной сервер
+		if (client.route == nullptr) {
+			client.route = pickPool(client, BackendRole::Primary);
+			return;
+		}
+		client.read_only_tx = route == QueryRoute::ReadOnlyTransaction;
+		worker->metrics.replica_transactions.fetch_add(
+			1, std::memory_order_relaxed);
+		return;
+	}
+
+	if (route == QueryRoute::ReadOnlyTransaction)
+		client.read_only_tx = true;
+	else if (route == QueryRoute::Primary)
+		client.held.active = true;
+}
+
+// Реплика освободилась: отложенное становится началом транзакции на
+// основном сервере
+void PoolLoop::releaseHeld(PoolClient &client) {
+	std::swap(client.to_server, client.held.data);
+	client.pending_syncs = client.held.syncs;
+	client.open_batch = client.held.open_batch;
+	client.pinned = client.held.pinned;
+	client.route = pickPool(client, BackendRole::Primary);
+	client.query_started = worker->loop_now;
+	client.cancel_sent = false;
+	client.held.syncs = 0;
+	client.held.open_batch = false;
+	client.held.pinned = false;
+	client.held.active = false;
+}
+
+void PoolLoop::checkPassword(PoolClient &client, const char *body,
+							 size_t len) {
+	PgReader reader(body, len);
+	std::string_view response = reader.str();
+	const std::string *password = auth_file.password(client.user);
+	if (!reader.ok() || password == nullptr ||
+		!constantTimeEquals(
+			response, md5Password(*password, client.user,
+								  std::string_view(client.salt,
+												   sizeof(client.salt))))) {
+		failClient(client, "28P01",
+				   "password authentication failed for user \"" +
+					   client.user + "\"");
+		return;
+	}
+	finishClientAuth(client);
+}
+
+void PoolLoop::finishClientAuth(PoolClient &client) {
+	ServerPool &pool = *client.pool;
+	if (pool.params_ready) {
+		sendWelcome(client);
+		return;
+	}
+
+	client.state = ClientState::WaitingLogin;
+	pool.login_waiters.push_back(client.fd);
+	if (pool.connecting == 0 && !launchServer(pool))
+		failWaiters(pool, errorResponse("08006", "could not connect to server"));
+}
+
+void PoolLoop::sendWelcome(PoolClient &client) {
+	randomBytes(&client.cancel_pid, sizeof(client.cancel_pid));
+	randomBytes(&client.cancel_key, sizeof(client.cancel_key));
+
+	client.to_client.append(PgMessage('R').int32(AUTH_OK).finish());
+	client.to_client.append(client.pool->parameter_status);
+	client.to_client.append(PgMessage('K')
+								.int32(client.cancel_pid)
+								.int32(client.cancel_key)
+								.finish());
+	client.to_client.append(PgMessage('Z').byte('I').finish());
+	client.state = ClientState::Ready;
+}
+
+void PoolLoop::failClient(PoolClient &client, std::string_view sqlstate,
+						  std::string_view message) {
+	std::string error = errorResponse(sqlstate, message);
+	client.to_client.append(error);
+	flushBuffer(client.fd, client.to_client);
+	closeClient(client);
+}
+
+void PoolLoop::onServerEvent(PoolServer &server, uint32_t events) {
+	if (server.state == ServerState::Connecting) {
+		if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			return;
+
+		int err = 0;
+		socklen_t err_len = sizeof(err);
+		if (getsockopt(server.fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+			err = errno;
+		if (err != 0) {
+			worker->metrics.connect_failures.fetch_add(
+				1, std::memory_order_relaxed);
+			backends.connectFailed(server.pool->backend);
+			ServerPool &pool = *server.pool;
+			closeServer(server);
+			failWaiters(pool,
+						errorResponse("08006", "could not connect to server"));
+			return;
+		}
+
+		auto elapsed = Clock::now() - server.started;
+		worker->metrics.connect_latency.record(
+			std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+				.count());
+
+		server.state = ServerState::Login;
+		server.out.append(PgMessage(0)
+							  .int32(PROTOCOL_V3)
+							  .str("user")
+							  .str(server.pool->user)
+							  .str("database")
+							  .str(server.pool->database)
+							  .byte('\0')
+							  .finish());
+		events |= EPOLLOUT;
+	}
+
+	if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+		readServer(server);
+		if (server.dead)
+			return;
+	}
+
+	if (events & EPOLLOUT) {
+		if (server.state == ServerState::Active)
+			flushToServer(clients[server.client_fd], server);
+		else if (flushBuffer(server.fd, server.out))
+			closeServer(server);
+	}
+}
+
+void PoolLoop::readServer(PoolServer &server) {
+	char data[BUFFER_SIZE];
+
+	while (!server.throttled) {
+		if (server.state == ServerState::Active) {
+			PoolClient &client = clients[server.client_fd];
+			if (client.to_client.size() >= high_water) {
+				throttleServer(server);
+				break;
+			}
+
+			// ответы идут клиенту без разбора на сообщения
+			size_t space;
+			char *dst = client.to_client.writable(space);
+			ssize_t len = recv(server.fd, dst, space, 0);
+			if (len < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				closeServer(server);
+				return;
+			} else if (len == 0) {
+				closeServer(server);
+				return;
+			}
+			client.to_client.commit(len);
+			worker->metrics.relayed_chunks.fetch_add(
+				1, std::memory_order_relaxed);
+			worker->metrics.server_bytes.fetch_add(len,
+												   std::memory_order_relaxed);
+
+			ServerSink sink(*this, server);
+			server.framer.feed(dst, len, sink);
+			if (flushBuffer(client.fd, client.to_client)) {
+				closeClient(client);
+				if (server.dead)
+					return;
+				continue;
+			}
+			worker->metrics.buffer_occupancy.record(client.to_client.size());
+			releaseIfIdle(server, client);
+			if (server.dead)
+				return;
+			continue;
+		}
+
+		ssize_t len = recv(server.fd, data, sizeof(data), 0);
+		if (len < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			closeServer(server);
+			return;
+		} else if (len == 0) {
+			closeServer(server);
+			return;
+		}
+
+		ServerSink sink(*this, server);
+		server.framer.feed(data, len, sink);
+		afterServerMessages(server);
+		if (server.dead)
+			return;
+	}
+}
+
+void PoolLoop::onServerMessage(PoolServer &server, char type, const char *body,
+							   size_t len) {
+	if (server.state == ServerState::Active) {
+		QueryTracker &queries = clients[server.client_fd].parser_session.queries;
+		if (queries.active())
+			queries.onMessage(type, body, len);
+		if (type != 'Z')
+			return;
+	}
+
+	if (type == 'Z') {
+		server.tx_status = len > 0 ? body[0] : 'I';
+		if (server.state == ServerState::Active) {
+			PoolClient &client = clients[server.client_fd];
+			if (client.pending_syncs > 0)
+				--client.pending_syncs;
+			client.parser_session.onReadyForQuery(server.tx_status);
+			// сервер ответил: отсюда отсчитывается простой в транзакции
+			client.last_active = worker->loop_now;
+		} else if (server.state == ServerState::Login) {
+			server.login_done = true;
+		} else if (server.state == ServerState::Resetting) {
+			server.reset_done = true;
+		}
+		return;
+	}
+
+	if (server.state == ServerState::Login) {
+		switch (type) {
+		case 'R':
+			onServerAuth(server, body, len);
+			break;
+		case 'S':
+			server.parameter_status +=
+				PgMessage('S').bytes(std::string_view(body, len)).finish();
+			break;
+		case 'K': {
+			PgReader reader(body, len);
+			server.backend_pid = reader.int32();
+			server.backend_key = reader.int32();
+			break;
+		}
+		case 'E':
+			server.failed = true;
+			server.error = PgMessage('E')
+							   .bytes(std::string_view(body, len))
+							   .finish();
+			break;
+		default:
+			break;
+		}
+		return;
+	}
+
+	// ошибка вне транзакции (например, FATAL при остановке сервера):
+	// соединение больше непригодно
+	if (type == 'E' && server.state != ServerState::Resetting)
+		server.failed = true;
+}
+
+void PoolLoop::onServerAuth(PoolServer &server, const char *body, size_t len) {
+	PgReader reader(body, len);
+	uint32_t code = reader.int32();
+	if (code == AUTH_OK)
+		return;
+
+	const std::string &user = server.pool->user;
+	const std::string *password = auth_file.password(user);
+	if (password == nullptr) {
+		server.failed = true;
+		server.error = errorResponse(
+			"28P01", "server requested a password for user \"" + user +
+						 "\", but it is missing in the auth file");
+		return;
+	}
+
+	std::string response;
+	switch (code) {
+	case AUTH_CLEARTEXT:
+		server.out.append(PgMessage('p').str(*password).finish());
+		return;
+	case AUTH_MD5:
+		server.out.append(
+			PgMessage('p')
+				.str(md5Password(*password, user, reader.rest().substr(0, 4)))
+				.finish());
+		return;
+	case AUTH_SASL:
+		// список механизмов, завершенный пустой строкой
+		while (reader.ok()) {
+			std::string_view mechanism = reader.str();
+			if (mechanism.empty())
+				break;
+			if (mechanism != "SCRAM-SHA-256")
+				continue;
+			server.scram = std::make_unique<ScramClient>(*password);
+			response = server.scram->clientFirstMessage();
+			server.out.append(PgMessage('p')
+								  .str(mechanism)
+								  .int32(response.size())
+								  .bytes(response)
+								  .finish());
+			return;
+		}
+		break;
+	case AUTH_SASL_CONTINUE:
+		if (server.scram &&
+			server.scram->clientFinalMessage(reader.rest(), response)) {
+			server.out.append(PgMessage('p').bytes(response).finish());
+			return;
+		}
+		break;
+	case AUTH_SASL_FINAL:
+		if (server.scram && server.scram->verifyServerFinal(reader.rest()))
+			return;
+		break;
+	default:
+		break;
+	}
+
+	server.failed = true;
+	server.error = errorResponse("28000", "unsupported server authentication");
+}
+
+void PoolLoop::afterServerMessages(PoolServer &server) {
+	if (server.failed) {
+		ServerPool &pool = *server.pool;
+		bool login = server.state == ServerState::Login;
+		std::string error = std::move(server.error);
+		closeServer(server);
+		if (login)
+			failWaiters(pool, error);
+		return;
+	}
+
+	if (!server.out.empty() && flushBuffer(server.fd, server.out)) {
+		closeServer(server);
+		return;
+	}
+
+	if (server.login_done) {
+		server.login_done = false;
+		loginComplete(server);
+	} else if (server.reset_done) {
+		server.reset_done = false;
+		serverIdle(server);
+	}
+}
+
+void PoolLoop::loginComplete(PoolServer &server) {
+	ServerPool &pool = *server.pool;
+	--pool.connecting;
+	server_timers.cancel(server.timer);
+	worker->metrics.server_logins.fetch_add(1, std::memory_order_relaxed);
+	if (!pool.params_ready) {
+		pool.parameter_status = std::move(server.parameter_status);
+		pool.params_ready = true;
+	}
+	server.parameter_status.clear();
+	server.scram.reset();
+	serverIdle(server);
+
+	std::vector<int> waiters;
+	waiters.swap(pool.login_waiters);
+	for (int fd : waiters) {
+		auto it = clients.find(fd);
+		if (it == clients.end() || it->second.dead ||
+			it->second.state != ClientState::WaitingLogin)
+			continue;
+		sendWelcome(it->second);
+		dispatchClient(it->second);
+	}
+}
+
+ServerPool &PoolLoop::poolFor(const std::string &user,
+							  const std::string &database, size_t backend) {
+	auto [it, inserted] = pools.try_emplace({user, database, backend});
+	if (inserted) {
+		it->second.user = user;
+		it->second.database = database;
+		it->second.backend = backend;
+	}
+	return it->second;
+}
+
+ServerPool *PoolLoop::pickPool(const PoolClient &client, BackendRole role) {
+	// нагрузка - занятые серверы и ждущие клиенты пула в этом воркере
+	auto load = [&](size_t backend) -> size_t {
+		auto it = pools.find({client.user, client.database, backend});
+		if (it == pools.end())
+			return 0;
+		const ServerPool &pool = it->second;
+		size_t busy = pool.servers > pool.idle.size()
+						  ? pool.servers - pool.idle.size()
+						  : 0;
+		return busy + pool.waiting.size();
+	};
+	int backend = backends.pick(role, load, next_pick++);
+	if (backend < 0)
+		return nullptr;
+	return &poolFor(client.user, client.database, backend);
+}
+
+bool PoolLoop::launchServer(ServerPool &pool) {
+	int fd = backends.connect(pool.backend);
+	if (fd < 0) {
+		perror("connect() failed");
+		worker->metrics.connect_failures.fetch_add(1,
+												   std::memory_order_relaxed);
+		return false;
+	}
+
+	servers.erase(fd);
+	PoolServer &server = servers[fd];
+	server.fd = fd;
+	server.pool = &pool;
+	server.started = Clock::now();
+	server.out = ChunkBuffer(&worker->chunk_pool);
+	if (options.connect_timeout_ms > 0) {
+		auto timeout = std::chrono::milliseconds(options.connect_timeout_ms);
+		server_timers.schedule(server.timer, server.started + timeout);
+	}
+	++pool.servers;
+	++pool.connecting;
+
+	worker->updateEvents(fd, server.events, RELAY_EVENTS);
+	worker->metrics.pool_servers.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+void PoolLoop::acquireServer(PoolClient &client) {
+	ServerPool &pool = client.route ? *client.route : *client.pool;
+	while (!pool.idle.empty()) {
+		int fd = pool.idle.back();
+		pool.idle.pop_back();
+		auto it = servers.find(fd);
+		if (it == servers.end() || it->second.dead ||
+			it->second.state != ServerState::Idle || it->second.pool != &pool)
+			continue;
+		attach(client, it->second);
+		return;
+	}
+
+	client.waiting = true;
+	client.wait_started = Clock::now();
+	pool.waiting.emplace_back(client.wait_started, client.fd);
+	worker->metrics.pool_waits.fetch_add(1, std::memory_order_relaxed);
+
+	if (pool.servers < static_cast<unsigned>(options.pool_size) &&
+		pool.connecting < pool.waiting.size())
+		launchServer(pool);
+}
+
+void PoolLoop::attach(PoolClient &client, PoolServer &server) {
+	client.waiting = false;
+	client.server_fd = server.fd;
+	server.client_fd = client.fd;
+	server.state = ServerState::Active;
+	armClient(client);
+	flushToServer(client, server);
+}
+
+void PoolLoop::releaseIfIdle(PoolServer &server, PoolClient &client) {
+	if (server.dead || server.state != ServerState::Active ||
+		server.tx_status != 'I' || client.pending_syncs > 0 ||
+		client.open_batch || client.pinned || !client.to_server.empty())
+		return;
+
+	client.server_fd = -1;
+	client.route = nullptr;
+	client.read_only_tx = false;
+	worker->metrics.pool_transactions.fetch_add(1, std::memory_order_relaxed);
+	if (client.discard_server) {
+		client.discard_server = false;
+		resetServer(server);
+	} else {
+		serverIdle(server);
+	}
+
+	if (client.held.active) {
+		releaseHeld(client);
+		dispatchClient(client);
+	}
+}
+
+void PoolLoop::serverIdle(PoolServer &server) {
+	server.state = ServerState::Idle;
+	server.client_fd = -1;
+	if (server.throttled)
+		resumeServer(server);
+
+	ServerPool &pool = *server.pool;
+	while (!pool.waiting.empty()) {
+		auto [started, fd] = pool.waiting.front();
+		pool.waiting.pop_front();
+		auto it = clients.find(fd);
+		if (it == clients.end() || it->second.dead || !it->second.waiting ||
+			it->second.wait_started != started)
+			continue;
+		attach(it->second, server);
+		return;
+	}
+	pool.idle.push_back(server.fd);
+}
+
+void PoolLoop::resetServer(PoolServer &server) {
+	server.state = ServerState::Resetting;
+	server.client_fd = -1;
+	if (server.throttled)
+		resumeServer(server);
+	server.out.append(PgMessage('Q').str("DISCARD ALL").finish());
+	if (flushBuffer(server.fd, server.out))
+		closeServer(server);
+}
+
+void PoolLoop::flushToServer(PoolClient &client, PoolServer &server) {
+	if (flushBuffer(server.fd, client.to_server)) {
+		closeServer(server);
+		return;
+	}
+	if (client.throttled && client.to_server.size() <= low_water)
+		resumeClient(client);
+}
+
+void PoolLoop::failWaiters(ServerPool &pool, const std::string &error) {
+	std::vector<int> waiters;
+	waiters.swap(pool.login_waiters);
+	// без серверов клиентам в очереди ждать нечего
+	if (pool.servers == 0) {
+		for (auto &[started, fd] : pool.waiting)
+			waiters.push_back(fd);
+		pool.waiting.clear();
+	}
+
+	for (int fd : waiters) {
+		auto it = clients.find(fd);
+		if (it == clients.end() || it->second.dead)
+			continue;
+		PoolClient &client = it->second;
+		if (client.state != ClientState::WaitingLogin && !client.waiting)
+			continue;
+		client.to_client.append(error);
+		flushBuffer(client.fd, client.to_client);
+		closeClient(client);
+	}
+}
+
+void PoolLoop::throttleClient(PoolClient &client) {
+	client.throttled = true;
+	worker->updateEvents(client.fd, client.events, EPOLLOUT | EPOLLET);
+	worker->metrics.throttles.fetch_add(1, std::memory_order_relaxed);
+	worker->metrics.throttled_now.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PoolLoop::resumeClient(PoolClient &client) {
+	client.throttled = false;
+	worker->updateEvents(client.fd, client.events, RELAY_EVENTS);
+	worker->metrics.throttled_now.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void PoolLoop::throttleServer(PoolServer &server) {
+	server.throttled = true;
+	worker->updateEvents(server.fd, server.events, EPOLLOUT | EPOLLET);
+	worker->metrics.throttles.fetch_add(1, std::memory_order_relaxed);
+	worker->metrics.throttled_now.fetch_add(1, std::memory_order_relaxed);
+}
+
+void PoolLoop::resumeServer(PoolServer &server) {
+	server.throttled = false;
+	worker->updateEvents(server.fd, server.events, RELAY_EVENTS);
+	worker->metrics.throttled_now.fetch_sub(1, std::memory_order_relaxed);
+}
+
+void PoolLoop::closeClient(PoolClient &client) {
+	if (client.dead)
+		return;
+	client.dead = true;
+	client_timers.cancel(client.timer);
+
+	if (client.server_fd >= 0) {
+		PoolServer &server = servers[client.server_fd];
+		client.server_fd = -1;
+		server.client_fd = -1;
+		// сервер возвращается в пул, только если он точно вне транзакции и
+		// не получил от клиента недописанное сообщение
+		bool clean = server.tx_status == 'I' && client.pending_syncs == 0 &&
+					 !client.open_batch && client.to_server.empty();
+		if (!clean)
+			closeServer(server);
+		else if (client.pinned || client.discard_server)
+			resetServer(server);
+		else
+			serverIdle(server);
+	}
+
+	close(client.fd);
+	worker->metrics.active_connections.fetch_sub(1, std::memory_order_relaxed);
+	if (client.throttled)
+		worker->metrics.throttled_now.fetch_sub(1, std::memory_order_relaxed);
+	dead_clients.push_back(client.fd);
+}
+
+void PoolLoop::closeServer(PoolServer &server) {
+	if (server.dead)
+		return;
+	server.dead = true;
+	server_timers.cancel(server.timer);
+
+	ServerPool &pool = *server.pool;
+	--pool.servers;
+	// номер fd перейдет к новому серверу, возможно, из другого пула
+	auto idle = std::find(pool.idle.begin(), pool.idle.end(), server.fd);
+	if (idle != pool.idle.end())
+		pool.idle.erase(idle);
+	if (server.state == ServerState::Connecting ||
+		server.state == ServerState::Login)
+		--pool.connecting;
+
+	close(server.fd);
+	backends.release(pool.backend);
+	worker->metrics.pool_servers.fetch_sub(1, std::memory_order_relaxed);
+	if (server.throttled)
+		worker->metrics.throttled_now.fetch_sub(1, std::memory_order_relaxed);
+	dead_servers.push_back(server.fd);
+
+	// клиент посреди транзакции без сервера продолжить не может
+	if (server.client_fd >= 0) {
+		PoolClient &client = clients[server.client_fd];
+		server.client_fd = -1;
+		client.server_fd = -1;
+		closeClient(client);
+	}
+}
+
+void PoolLoop::reap() {
+	for (int fd : dead_clients) {
+		auto it = clients.find(fd);
+		if (it != clients.end() && it->second.dead)
+			clients.erase(it);
+	}
+	dead_clients.clear();
+
+	for (int fd : dead_servers) {
+		auto it = servers.find(fd);
+		if (it != servers.end() && it->second.dead)
+			servers.erase(it);
+	}
+	dead_servers.clear();
+}
+
+PoolLoop::ClientTimeout PoolLoop::nextTimeout(PoolClient &client,
+											  Clock::time_point &deadline) {
+	using std::chrono::milliseconds;
+	if (client.waiting) {
+		if (options.pool_wait_timeout_ms == 0)
+			return ClientTimeout::None;
+		deadline =
+			client.wait_started + milliseconds(options.pool_wait_timeout_ms);
+		return ClientTimeout::Wait;
+	}
+
+	PoolServer *server =
+		client.server_fd >= 0 ? &servers[client.server_fd] : nullptr;
+	if (client.pending_syncs > 0) {
+		// отменить можно только запрос на сервере клиента
+		if (options.query_timeout_ms == 0 || server == nullptr ||
+			client.cancel_sent || server->backend_pid == 0)
+			return ClientTimeout::None;
+		deadline =
+			client.query_started + milliseconds(options.query_timeout_ms);
+		return ClientTimeout::Query;
+	}
+	if (server != nullptr && server->tx_status != 'I') {
+		if (options.idle_in_transaction_timeout_ms == 0)
+			return ClientTimeout::None;
+		deadline = client.last_active +
+				   milliseconds(options.idle_in_transaction_timeout_ms);
+		return ClientTimeout::IdleInTransaction;
+	}
+	// до первого входа на сервер клиент ждет прокси, а не молчит сам
+	if (options.client_idle_timeout_ms == 0 ||
+		client.state == ClientState::WaitingLogin)
+		return ClientTimeout::None;
+	deadline =
+		client.last_active + milliseconds(options.client_idle_timeout_ms);
+	return ClientTimeout::Idle;
+}
+
+void PoolLoop::armClient(PoolClient &client) {
+	Clock::time_point deadline;
+	if (nextTimeout(client, deadline) != ClientTimeout::None)
+		client_timers.scheduleEarlier(client.timer, deadline);
+}
+
+// Таймер мог быть поставлен на срок, который активность уже отодвинула:
+// тогда он просто переставляется
+void PoolLoop::onClientTimer(PoolClient &client) {
+	Clock::time_point deadline;
+	ClientTimeout timeout = nextTimeout(client, deadline);
+	if (timeout == ClientTimeout::None)
+		return;
+	if (deadline > worker->loop_now) {
+		client_timers.schedule(client.timer, deadline);
+		return;
+	}
+
+	switch (timeout) {
+	case ClientTimeout::Wait: {
+		worker->metrics.pool_wait_timeouts.fetch_add(1,
+													 std::memory_order_relaxed);
+		ServerPool &pool = client.route ? *client.route : *client.pool;
+		failClient(client, "08P01", "query_wait_timeout");
+		// таймаут у всех одинаковый, очередь упорядочена по сроку: вместе с
+		// этим клиентом из ее начала уходят и уже не ждущие
+		while (!pool.waiting.empty()) {
+			auto [started, fd] = pool.waiting.front();
+			auto it = clients.find(fd);
+			if (it != clients.end() && !it->second.dead &&
+				it->second.waiting && it->second.wait_started == started)
+				break;
+			pool.waiting.pop_front();
+		}
+		break;
+	}
+	case ClientTimeout::Query: {
+		// ответ на отмену (ErrorResponse 57014) придет клиенту обычным путем
+		PoolServer &server = servers[client.server_fd];
+		client.cancel_sent = true;
+		cancel_sender->send(backends[server.pool->backend], server.backend_pid,
+							server.backend_key);
+		worker->metrics.query_timeouts.fetch_add(1, std::memory_order_relaxed);
+		break;
+	}
+	case ClientTimeout::IdleInTransaction:
+		// сервер посреди транзакции закрывается вместе с клиентом
+		worker->metrics.idle_in_transaction_timeouts.fetch_add(
+			1, std::memory_order_relaxed);
+		failClient(client, "25P03",
+				   "terminating connection due to idle-in-transaction timeout");
+		break;
+	case ClientTimeout::Idle:
+		worker->metrics.idle_timeouts.fetch_add(1, std::memory_order_relaxed);
+		failClient(client, "57P05",
+				   "terminating connection due to idle-session timeout");
+		break;
+	case ClientTimeout::None:
+		break;
+	}
+}
+
+void PoolLoop::onServerTimer(PoolServer &server) {
+	if (server.state != ServerState::Connecting &&
+		server.state != ServerState::Login)
+		return;
+	worker->metrics.connect_timeouts.fetch_add(1, std::memory_order_relaxed);
+	if (server.state == ServerState::Connecting)
+		backends.connectFailed(server.pool->backend);
+	ServerPool &pool = *server.pool;
+	closeServer(server);
+	failWaiters(pool, errorResponse("08006", "server login timed out"));
+}
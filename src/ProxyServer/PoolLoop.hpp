@@ -0,0 +1,244 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "AuthFile.hpp"
+#include "ProxyServer.hpp"
+#include "Scram.hpp"
+
+struct ServerPool;
+
+// Startup: ждем StartupMessage (на SSLRequest отвечаем 'N').
+// Auth: клиенту отправлен md5-запрос пароля.
+// WaitingLogin: пул еще ни разу не входил на сервер, и ParameterStatus для
+// клиента неоткуда взять - ждем первого входа.
+// Ready: сессия установлена, сервер выдается на время транзакции.
+enum class ClientState { Startup, Auth, WaitingLogin, Ready };
+
+// Connecting/Login: connect() и вход на сервер.
+// Idle: лежит в пуле. Active: привязан к клиенту.
+// Resetting: DISCARD ALL после клиента, закрепившего сервер.
+enum class ServerState { Connecting, Login, Idle, Active, Resetting };
+
+// Сообщения клиента, отложенные до освобождения сервера реплики: запись
+// пришла, пока не завершился предыдущий читающий запрос (конвейер), и
+// уйдет на основной сервер. Счетчики - как у PoolClient для to_server.
+struct HeldMessages {
+	ChunkBuffer data;
+	unsigned syncs = 0;
+	bool open_batch = false;
+	bool pinned = false;
+	bool active = false;
+};
+
+struct PoolClient {
+	int fd;
+	ClientState state = ClientState::Startup;
+	MessageFramer framer{true};
+	ParserSession parser_session;
+	std::string user;
+	std::string database;
+	// пул основного сервера, чьи ParameterStatus получил клиент
+	ServerPool *pool = nullptr;
+	// пул, из которого берется сервер текущей транзакции: пул одного из
+	// основных серверов или реплики; nullptr - транзакция еще не началась
+	ServerPool *route = nullptr;
+	// на реплике идет BEGIN READ ONLY: до ее конца все идет туда же
+	bool read_only_tx = false;
+	HeldMessages held;
+	char salt[4];
+	// выданный клиенту BackendKeyData
+	uint32_t cancel_pid = 0;
+	uint32_t cancel_key = 0;
+	// привязанный сервер или -1
+	int server_fd = -1;
+	// целые сообщения клиента, еще не принятые сервером
+	ChunkBuffer to_server;
+	ChunkBuffer to_client;
+	// отправленные Query/Sync/FunctionCall, на которые еще не пришел
+	// ReadyForQuery
+	unsigned pending_syncs = 0;
+	// после последнего Sync были сообщения расширенного протокола
+	bool open_batch = false;
+	// именованный подготовленный оператор живет на конкретном сервере:
+	// такой клиент держит сервер до конца сессии
+	bool pinned = false;
+	// именованный оператор создан внутри транзакции на реплике: клиент за
+	// ней не закрепляется, а сервер после транзакции сбрасывается
+	bool discard_server = false;
+	// стоит в ServerPool::waiting с меткой wait_started
+	bool waiting = false;
+	Clock::time_point wait_started;
+	// ожидание сервера и таймауты сессии; сроки пересчитываются при
+	// срабатывании (PoolLoop::onClientTimer)
+	Timer<PoolClient> timer{this};
+	// последнее чтение от клиента или ReadyForQuery его транзакции
+	Clock::time_point last_active;
+	// когда pending_syncs стал ненулевым
+	Clock::time_point query_started;
+	bool cancel_sent = false;
+	// Terminate или CancelRequest: закрыть после разбора куска
+	bool closing = false;
+	bool throttled = false;
+	// fd закрыт, запись удаляется в конце обработки события
+	bool dead = false;
+	uint32_t events = 0;
+};
+
+struct PoolServer {
+	int fd;
+	ServerState state = ServerState::Connecting;
+	ServerPool *pool = nullptr;
+	MessageFramer framer;
+	Clock::time_point started;
+	int client_fd = -1;
+	// статус транзакции из последнего ReadyForQuery: 'I', 'T' или 'E'
+	char tx_status = 'I';
+	uint32_t backend_pid = 0;
+	uint32_t backend_key = 0;
+	// сообщения входа и сброса; в Active серверу пишется to_server клиента
+	ChunkBuffer out;
+	std::unique_ptr<ScramClient> scram;
+	// ParameterStatus, полученные при входе
+	std::string parameter_status;
+	// выставляются разбором ответа, обрабатываются после него
+	bool login_done = false;
+	bool reset_done = false;
+	bool failed = false;
+	// ErrorResponse для клиентов, ждавших неудавшегося входа
+	std::string error;
+	// таймаут подключения и входа
+	Timer<PoolServer> timer{this};
+	bool throttled = false;
+	bool dead = false;
+	uint32_t events = 0;
+};
+
+// Серверные соединения одной пары (user, database) к одному серверу в
+// воркере
+struct ServerPool {
+	std::string user;
+	std::string database;
+	// номер сервера в Backends
+	size_t backend = 0;
+	// ParameterStatus первого вошедшего сервера, их получают клиенты
+	std::string parameter_status;
+	bool params_ready = false;
+	std::vector<int> idle;
+	// все серверы пула, включая подключающиеся
+	unsigned servers = 0;
+	unsigned connecting = 0;
+	// (начало ожидания, client_fd) в порядке поступления
+	std::deque<std::pair<Clock::time_point, int>> waiting;
+	// клиенты в состоянии WaitingLogin
+	std::vector<int> login_waiters;
+};
+
+// Цикл воркера в режиме --pool-mode=transaction. Клиент проходит
+// аутентификацию у прокси, а сервер из пула получает только на время
+// транзакции: сервер возвращается в пул по ReadyForQuery со статусом 'I',
+// когда у клиента не осталось незавершенных запросов.
+// С --replica транзакция, которая начинается читающим запросом (или
+// BEGIN READ ONLY), получает сервер реплики, остальные - основной сервер.
+// Среди нескольких серверов роли выбирается здоровый с наименьшей
+// нагрузкой в этом воркере.
+class PoolLoop {
+  public:
+	PoolLoop(Worker *worker, const ProxyOptions &options,
+			 Parser *const &parser, const AuthFile &auth_file,
+			 Backends &backends, CancelSender *cancel_sender);
+
+	void run();
+
+  private:
+	friend class ClientSink;
+	friend class ServerSink;
+
+	void acceptClients();
+	void drainNewConnections();
+	void addClient(int fd);
+
+	void onClientEvent(PoolClient &client, uint32_t events);
+	void readClient(PoolClient &client);
+	void dispatchClient(PoolClient &client);
+	void onClientStartup(PoolClient &client, const char *body, size_t len);
+	void onClientMessage(PoolClient &client, char type, const char *body,
+						 size_t len);
+	void checkPassword(PoolClient &client, const char *body, size_t len);
+	void finishClientAuth(PoolClient &client);
+	void sendWelcome(PoolClient &client);
+	void failClient(PoolClient &client, std::string_view sqlstate,
+					std::string_view message);
+
+	void onServerEvent(PoolServer &server, uint32_t events);
+	void readServer(PoolServer &server);
+	void onServerMessage(PoolServer &server, char type, const char *body,
+						 size_t len);
+	void onServerAuth(PoolServer &server, const char *body, size_t len);
+	void afterServerMessages(PoolServer &server);
+	void loginComplete(PoolServer &server);
+
+	void routeMessage(PoolClient &client, char type, const char *body,
+					  size_t len);
+	void releaseHeld(PoolClient &client);
+
+	ServerPool &poolFor(const std::string &user, const std::string &database,
+						size_t backend);
+	// пул сервера роли для пользователя клиента, nullptr - нет здоровой
+	// реплики
+	ServerPool *pickPool(const PoolClient &client, BackendRole role);
+	bool launchServer(ServerPool &pool);
+	void acquireServer(PoolClient &client);
+	void attach(PoolClient &client, PoolServer &server);
+	void releaseIfIdle(PoolServer &server, PoolClient &client);
+	void serverIdle(PoolServer &server);
+	void resetServer(PoolServer &server);
+	void flushToServer(PoolClient &client, PoolServer &server);
+	void failWaiters(ServerPool &pool, const std::string &error);
+
+	void throttleClient(PoolClient &client);
+	void resumeClient(PoolClient &client);
+	void throttleServer(PoolServer &server);
+	void resumeServer(PoolServer &server);
+
+	void closeClient(PoolClient &client);
+	void closeServer(PoolServer &server);
+	void reap();
+
+	// что случится с клиентом и когда, если ничего не изменится
+	enum class ClientTimeout { None, Wait, Query, IdleInTransaction, Idle };
+	ClientTimeout nextTimeout(PoolClient &client, Clock::time_point &deadline);
+	// ставит таймер клиента на ближайший срок, если тот раньше
+	void armClient(PoolClient &client);
+	void onClientTimer(PoolClient &client);
+	void onServerTimer(PoolServer &server);
+
+	Worker *worker;
+	const ProxyOptions &options;
+	Parser *const &parser;
+	const AuthFile &auth_file;
+	Backends &backends;
+	// nullptr без --query-timeout-ms
+	CancelSender *cancel_sender;
+	size_t high_water;
+	size_t low_water;
+
+	std::unordered_map<int, PoolClient> clients;
+	std::unordered_map<int, PoolServer> servers;
+	// map: адреса пулов не меняются, на них ссылаются клиенты и серверы
+	std::map<std::tuple<std::string, std::string, size_t>, ServerPool> pools;
+	// с какого сервера pickPool() начинает перебор, чтобы равные по
+	// нагрузке получали транзакции по кругу
+	size_t next_pick = 0;
+	std::vector<int> dead_clients;
+	std::vector<int> dead_servers;
+	TimerWheel<PoolClient> client_timers;
+	TimerWheel<PoolServer> server_timers;
+};
@@ -0,0 +1,350 @@
+#include "ProxyOptions.hpp"
+#include <cstdlib>
+#include <sched.h>
+#include <stdexcept>
+#include <string_view>
+
+static const char *USAGE =
+	"Usage: ./pg_proxy <listen_port> <pg_host> <pg_port> [options]\n"
+	"Options:\n"
+	"  --backend=HOST:PORT      еще один сервер наравне с <pg_host> <pg_port>\n"
+	"                           (можно несколько)\n"
+	"  --balance=MODE           least-conn | latency: выбор сервера (least-conn)\n"
+	"  --health-interval-ms=N   период проверки серверов, 0 - нет (1000)\n"
+	"  --health-fails=N         неудач подряд до исключения сервера (3)\n"
+	"  --connect-timeout-ms=N   таймаут подключения к серверу, 0 - нет (5000)\n"
+	"  --client-idle-timeout-ms=N\n"
+	"                           закрыть клиента, молчащего вне транзакции,\n"
+	"                           0 - нет (0)\n"
+	"  --idle-in-transaction-timeout-ms=N\n"
+	"                           закрыть клиента, молчащего в транзакции,\n"
+	"                           0 - нет (0)\n"
+	"  --query-timeout-ms=N     отменить запрос дольше этого (CancelRequest),\n"
+	"                           0 - нет (0)\n"
+	"  --workers=N              число воркеров (по --cpu-list или числу CPU)\n"
+	"  --cpu-list=LIST          закрепить воркеры за процессорами, например\n"
+	"                           0-7,16-23\n"
+	"  --acceptor-cpu=N         закрепить поток приема за процессором\n"
+	"  --incoming-cpu           с --reuseport и --cpu-list: соединение\n"
+	"                           принимает воркер процессора, получившего\n"
+	"                           его пакеты (SO_INCOMING_CPU)\n"
+	"  --rebalance-ms=N         переносить простаивающие сессии из\n"
+	"                           загруженного воркера в свободный, 0 - нет (0)\n"
+	"  --reuseport              свой SO_REUSEPORT сокет у каждого воркера\n"
+	"  --splice                 пересылка без копирования через splice()\n"
+	"  --no-query-log           не разбирать и не логировать запросы\n"
+	"  --io-uring               цикл воркеров на io_uring вместо epoll\n"
+	"  --high-water-kb=N        остановить чтение стороны при таком буфере (1024)\n"
+	"  --low-water-kb=N         возобновить чтение ниже этого буфера (256)\n"
+	"  --buffer-limit-kb=N      устаревший синоним --high-water-kb=N\n"
+	"                           (и --low-water-kb=N, если он не задан)\n"
+	"  --pool-mode=MODE         none | transaction: пул серверных соединений\n"
+	"  --pool-size=N            серверов на (user, database) в воркере (20)\n"
+	"  --pool-wait-timeout-ms=N сколько клиент ждет свободный сервер,\n"
+	"                           0 - без ограничения (5000)\n"
+	"  --auth-file=PATH         пароли пользователей в формате userlist.txt\n"
+	"  --replica=HOST:PORT      реплика для читающих транзакций (можно\n"
+	"                           несколько, только с --pool-mode=transaction)\n"
+	"  --log-format=FORMAT      text | binary: формат лога запросов (text)\n"
+	"  --log-segment-mb=N       размер сегмента лога (64)\n"
+	"  --log-segment-seconds=N  закрывать сегмент по времени, 0 - нет (0)\n"
+	"  --log-retention=N        хранить N последних сегментов, 0 - все (0)\n"
+	"  --log-queue-kb=N         очередь лога одного потока (1024)\n"
+	"  --log-overflow=POLICY    block | drop | sample: при переполнении\n"
+	"                           очереди ждать, отбрасывать или пропускать\n"
+	"                           каждую N-ю запись (block)\n"
+	"  --log-sample-rate=N      N для --log-overflow=sample (10)\n"
+	"  --query-stats            время и число строк по отпечаткам запросов,\n"
+	"                           по SIGUSR1 в resources/query_stats.txt\n"
+	"  --metrics-port=N         метрики Prometheus по HTTP: GET /metrics\n"
+	"  --metrics-bind=ADDR      IPv4-адрес порта метрик (127.0.0.1)\n";
+
+static int parseInt(std::string_view name, const std::string &value) {
+	char *end = nullptr;
+	long result = strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || result < 0) {
+		throw std::invalid_argument("Invalid value for " + std::string(name) +
+									": " + value);
+	}
+	return static_cast<int>(result);
+}
+
+static int parseCpu(std::string_view name, const std::string &value) {
+	int cpu = parseInt(name, value);
+	if (cpu >= CPU_SETSIZE) {
+		throw std::invalid_argument("Invalid CPU for " + std::string(name) +
+									": " + value);
+	}
+	return cpu;
+}
+
+// "0-3,8,10-11"
+static std::vector<int> parseCpuList(std::string_view name,
+									 const std::string &value) {
+	std::vector<int> cpus;
+	size_t start = 0;
+	while (start <= value.size()) {
+		size_t comma = value.find(',', start);
+		if (comma == std::string::npos)
+			comma = value.size();
+		std::string range = value.substr(start, comma - start);
+		size_t dash = range.find('-');
+		int first = parseCpu(name, range.substr(0, dash));
+		int last = dash == std::string::npos
+					   ? first
+					   : parseCpu(name, range.substr(dash + 1));
+		if (last < first) {
+			throw std::invalid_argument("Invalid range for " +
+										std::string(name) + ": " + range);
+		}
+		for (int cpu = first; cpu <= last; ++cpu)
+			cpus.push_back(cpu);
+		start = comma + 1;
+	}
+	return cpus;
+}
+
+static BackendAddress parseAddress(std::string_view name,
+								   const std::string &value) {
+	size_t colon = value.rfind(':');
+	if (colon == std::string::npos || colon == 0) {
+		throw std::invalid_argument("Invalid value for " + std::string(name) +
+									" (expected host:port): " + value);
+	}
+	BackendAddress address;
+	address.host = value.substr(0, colon);
+	address.port = parseInt(name, value.substr(colon + 1));
+	if (address.port == 0 || address.port > 65535) {
+		throw std::invalid_argument("Invalid port for " + std::string(name) +
+									": " + value);
+	}
+	return address;
+}
+
+ProxyOptions parseOptions(int argc, char *argv[]) {
+	if (argc < 4) {
+		throw std::invalid_argument(USAGE);
+	}
+
+	ProxyOptions options;
+	options.listen_port = atoi(argv[1]);
+	options.pg_host = argv[2];
+	options.pg_port = atoi(argv[3]);
+	// --buffer-limit-kb без --low-water-kb: чтение возобновляется сразу
+	// ниже предела, как до появления двух порогов
+	int buffer_limit_kb = 0;
+	bool low_water_set = false;
+
+	for (int i = 4; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string_view name = arg.substr(0, eq);
+		std::string value =
+			eq == std::string_view::npos ? "" : std::string(arg.substr(eq + 1));
+
+		if (name == "--backend") {
+			options.backends.push_back(parseAddress(name, value));
+		} else if (name == "--balance") {
+			if (value == "least-conn") {
+				options.balance = BalanceMode::LeastConnections;
+			} else if (value == "latency") {
+				options.balance = BalanceMode::Latency;
+			} else {
+				throw std::invalid_argument("Invalid value for --balance: " +
+											value);
+			}
+		} else if (name == "--health-interval-ms") {
+			options.health_interval_ms = parseInt(name, value);
+		} else if (name == "--health-fails") {
+			options.health_fails = parseInt(name, value);
+		} else if (name == "--workers") {
+			options.workers = parseInt(name, value);
+		} else if (name == "--cpu-list") {
+			options.worker_cpus = parseCpuList(name, value);
+		} else if (name == "--acceptor-cpu") {
+			options.acceptor_cpu = parseCpu(name, value);
+		} else if (name == "--incoming-cpu") {
+			options.incoming_cpu = true;
+		} else if (name == "--rebalance-ms") {
+			options.rebalance_ms = parseInt(name, value);
+		} else if (name == "--connect-timeout-ms") {
+			options.connect_timeout_ms = parseInt(name, value);
+		} else if (name == "--client-idle-timeout-ms") {
+			options.client_idle_timeout_ms = parseInt(name, value);
+		} else if (name == "--idle-in-transaction-timeout-ms") {
+			options.idle_in_transaction_timeout_ms = parseInt(name, value);
+		} else if (name == "--query-timeout-ms") {
+			options.query_timeout_ms = parseInt(name, value);
+		} else if (name == "--reuseport") {
+			options.reuseport = true;
+		} else if (name == "--splice") {
+			options.splice = true;
+		} else if (name == "--no-query-log") {
+			options.query_log = false;
+		} else if (name == "--io-uring") {
+			options.io_uring = true;
+		} else if (name == "--high-water-kb") {
+			options.high_water_kb = parseInt(name, value);
+		} else if (name == "--low-water-kb") {
+			options.low_water_kb = parseInt(name, value);
+			low_water_set = true;
+		} else if (name == "--buffer-limit-kb") {
+			buffer_limit_kb = parseInt(name, value);
+			if (buffer_limit_kb == 0) {
+				throw std::invalid_argument(
+					"--buffer-limit-kb must be positive");
+			}
+		} else if (name == "--pool-mode") {
+			if (value == "none") {
+				options.pool_mode = PoolMode::None;
+			} else if (value == "transaction") {
+				options.pool_mode = PoolMode::Transaction;
+			} else {
+				throw std::invalid_argument("Invalid value for --pool-mode: " +
+											value);
+			}
+		} else if (name == "--pool-size") {
+			options.pool_size = parseInt(name, value);
+		} else if (name == "--pool-wait-timeout-ms") {
+			options.pool_wait_timeout_ms = parseInt(name, value);
+		} else if (name == "--auth-file") {
+			options.auth_file = value;
+		} else if (name == "--replica") {
+			options.replicas.push_back(parseAddress(name, value));
+		} else if (name == "--log-format") {
+			if (value == "text") {
+				options.log_format = LogFormat::Text;
+			} else if (value == "binary") {
+				options.log_format = LogFormat::Binary;
+			} else {
+				throw std::invalid_argument("Invalid value for --log-format: " +
+											value);
+			}
+		} else if (name == "--log-segment-mb") {
+			options.log_segments.segment_bytes =
+				static_cast<size_t>(parseInt(name, value)) * 1024 * 1024;
+		} else if (name == "--log-segment-seconds") {
+			options.log_segments.segment_seconds = parseInt(name, value);
+		} else if (name == "--log-retention") {
+			options.log_segments.retention = parseInt(name, value);
+		} else if (name == "--log-queue-kb") {
+			options.log_queue.ring_bytes =
+				static_cast<size_t>(parseInt(name, value)) * 1024;
+		} else if (name == "--log-overflow") {
+			if (value == "block") {
+				options.log_queue.overflow = LogOverflow::Block;
+			} else if (value == "drop") {
+				options.log_queue.overflow = LogOverflow::Drop;
+			} else if (value == "sample") {
+				options.log_queue.overflow = LogOverflow::Sample;
+			} else {
+				throw std::invalid_argument(
+					"Invalid value for --log-overflow: " + value);
+			}
+		} else if (name == "--log-sample-rate") {
+			options.log_queue.sample_rate = parseInt(name, value);
+		} else if (name == "--query-stats") {
+			options.query_stats = true;
+		} else if (name == "--metrics-port") {
+			options.metrics_port = parseInt(name, value);
+		} else if (name == "--metrics-bind") {
+			options.metrics_bind = value;
+		} else {
+			throw std::invalid_argument("Unknown option " + std::string(arg) +
+										"\n" + USAGE);
+		}
+	}
+
+	if (buffer_limit_kb != 0) {
+		options.high_water_kb = buffer_limit_kb;
+		if (!low_water_set)
+			options.low_water_kb = buffer_limit_kb;
+	}
+	if (options.high_water_kb == 0 ||
+		options.low_water_kb > options.high_water_kb) {
+		throw std::invalid_argument(
+			"--low-water-kb must not exceed a positive --high-water-kb");
+	}
+
+	// без своего сокета у воркера и без процессора выбирать не из чего
+	if (options.incoming_cpu &&
+		(!options.reuseport || options.worker_cpus.empty())) {
+		throw std::invalid_argument(
+			"--incoming-cpu requires --reuseport and --cpu-list");
+	}
+
+	// у io_uring в ядре висят операции соединения, у пула клиент и сервер
+	// живут отдельно, а слоты --query-stats - номера в таблице воркера
+	if (options.rebalance_ms > 0 &&
+		(options.pool_mode != PoolMode::None || options.io_uring ||
+		 options.query_stats)) {
+		throw std::invalid_argument("--rebalance-ms is not supported with "
+									"--pool-mode, --io-uring or --query-stats");
+	}
+
+	if (options.io_uring && options.splice) {
+		throw std::invalid_argument(
+			"--splice is not supported together with --io-uring");
+	}
+
+	// Таймауты сессии ведет колесо таймеров epoll-цикла. Без пула
+	// начало сессии и границы запросов видны только по разобранному
+	// потоку, а splice() обходит разбор ответов сервера.
+	bool session_timeouts = options.client_idle_timeout_ms > 0 ||
+							options.idle_in_transaction_timeout_ms > 0 ||
+							options.query_timeout_ms > 0;
+	if (session_timeouts && options.io_uring) {
+		throw std::invalid_argument(
+			"--client-idle-timeout-ms, --idle-in-transaction-timeout-ms and "
+			"--query-timeout-ms are not supported with --io-uring");
+	}
+	if (session_timeouts && options.pool_mode == PoolMode::None &&
+		(!options.query_log || options.splice)) {
+		throw std::invalid_argument(
+			"--client-idle-timeout-ms, --idle-in-transaction-timeout-ms and "
+			"--query-timeout-ms are not supported with --no-query-log or "
+			"--splice");
+	}
+
+	if (options.log_segments.segment_bytes == 0) {
+		throw std::invalid_argument("--log-segment-mb must be positive");
+	}
+	if (options.log_queue.sample_rate == 0) {
+		throw std::invalid_argument("--log-sample-rate must be positive");
+	}
+
+	if (options.health_fails == 0) {
+		throw std::invalid_argument("--health-fails must be positive");
+	}
+
+	if (options.metrics_port > 65535) {
+		throw std::invalid_argument("--metrics-port must be a TCP port");
+	}
+
+	// запросы берутся из разбора клиентского потока, ответы - из разбора
+	// серверного, который splice() обходит
+	if (options.query_stats && (!options.query_log || options.splice)) {
+		throw std::invalid_argument(
+			"--query-stats is not supported with --no-query-log or --splice");
+	}
+
+	if (options.pool_mode == PoolMode::Transaction) {
+		if (options.splice || options.io_uring) {
+			throw std::invalid_argument("--pool-mode=transaction is not "
+										"supported with --splice or --io-uring");
+		}
+		if (options.pool_size == 0) {
+			throw std::invalid_argument("--pool-size must be positive");
+		}
+	}
+
+	// без пула сервер выбирается один раз на сессию, и переключать
+	// транзакции между серверами некому
+	if (!options.replicas.empty() &&
+		options.pool_mode != PoolMode::Transaction) {
+		throw std::invalid_argument(
+			"--replica requires --pool-mode=transaction");
+	}
+
+	return options;
+}
@@ -0,0 +1,100 @@
+#pragma once
+#include <string>
+#include <vector>
+
+#include "LogRecord.hpp"
+#include "LogSegment.hpp"
+
+// None: у каждого клиента свое соединение с PostgreSQL.
+// Transaction: воркер держит пул залогиненных серверных соединений и
+// выдает клиенту сервер только на время транзакции.
+enum class PoolMode { None, Transaction };
+
+// выбор сервера: наименьшее число соединений или оно же, взвешенное
+// временем ответа на проверку
+enum class BalanceMode { LeastConnections, Latency };
+
+struct BackendAddress {
+	std::string host;
+	int port = 0;
+};
+
+struct ProxyOptions {
+	int listen_port = 0;
+	std::string pg_host;
+	int pg_port = 0;
+	// --backend=host:port (можно несколько): серверы наравне с
+	// <pg_host> <pg_port>, соединения распределяются между ними
+	std::vector<BackendAddress> backends;
+	BalanceMode balance = BalanceMode::LeastConnections;
+	// период проверки серверов, 0 - без проверок
+	int health_interval_ms = 1000;
+	// неудачных проверок или подключений подряд до исключения сервера
+	int health_fails = 3;
+
+	// 0 - без таймаута
+	int connect_timeout_ms = 5000;
+	// Таймауты сессии клиента, 0 - нет. Как у одноименных настроек
+	// PostgreSQL: idle - клиент вне транзакции молчит, idle in transaction -
+	// молчит внутри транзакции (оба закрывают соединение), query - запрос
+	// без ReadyForQuery дольше этого получает CancelRequest.
+	int client_idle_timeout_ms = 0;
+	int idle_in_transaction_timeout_ms = 0;
+	int query_timeout_ms = 0;
+	// число воркеров, 0 - по размеру --cpu-list, без него - по числу
+	// процессоров в сети
+	int workers = 0;
+	// --cpu-list: воркер i закрепляется за worker_cpus[i % size], его
+	// буферы и соединения выделяются уже на узле NUMA этого процессора
+	std::vector<int> worker_cpus;
+	// процессор потока приема, -1 - не закреплять
+	int acceptor_cpu = -1;
+	// SO_INCOMING_CPU на сокетах --reuseport: соединение принимает воркер
+	// процессора, обработавшего его пакеты
+	bool incoming_cpu = false;
+	// период выравнивания нагрузки: простаивающие сессии переносятся из
+	// самого загруженного воркера в самый свободный, 0 - нет
+	int rebalance_ms = 0;
+	// каждый воркер принимает соединения на своем SO_REUSEPORT сокете
+	bool reuseport = false;
+	// пересылка через splice(): сервер -> клиент всегда, клиент -> сервер
+	// только при выключенном логировании запросов
+	bool splice = false;
+	bool query_log = true;
+	// цикл воркеров на io_uring вместо epoll
+	bool io_uring = false;
+	// буфер одного направления выше high_water: источник перестает
+	// читаться (EPOLLIN снимается) до разгрузки ниже low_water
+	int high_water_kb = 1024;
+	int low_water_kb = 256;
+
+	PoolMode pool_mode = PoolMode::None;
+	// максимум серверных соединений на пару (user, database) в одном воркере
+	int pool_size = 20;
+	// сколько клиент может ждать свободный сервер, 0 - без ограничения
+	int pool_wait_timeout_ms = 5000;
+	// пароли для проверки клиентов и входа на сервер (userlist.txt)
+	std::string auth_file;
+	// --replica=host:port (можно несколько): в режиме пула читающие
+	// транзакции уходят на реплики, остальное - на <pg_host> <pg_port>
+	std::vector<BackendAddress> replicas;
+
+	// text: resources/logs.txt, binary: resources/logs.bin для
+	// pg_proxy_logcat
+	LogFormat log_format = LogFormat::Text;
+	LogSegmentOptions log_segments;
+	// кольца потоков-производителей и поведение при их переполнении
+	LogQueueOptions log_queue;
+
+	// статистика по отпечаткам запросов, сбрасывается по SIGUSR1 в
+	// resources/query_stats.txt
+	bool query_stats = false;
+
+	// HTTP-порт с метриками в формате Prometheus (GET /metrics), 0 - нет
+	int metrics_port = 0;
+	// адрес этого порта: метрики раскрывают нагрузку и адреса серверов
+	std::string metrics_bind = "127.0.0.1";
+};
+
+// ./pg_proxy <listen_port> <pg_host> <pg_port> [--option=value ...]
+ProxyOptions parseOptions(int argc, char *argv[]);
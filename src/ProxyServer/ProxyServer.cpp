@@ -1,59 +1,210 @@
+#include <algorithm>
 #include <cerrno>
+#include <csignal>
+#include <fstream>
 #include <iostream>
+#include <pthread.h>
+#include <sched.h>
 #include <stdexcept>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
 #include <system_error>
 
+#include "PgWire.hpp"
+#include "PoolLoop.hpp"
 #include "ProxyServer.hpp"
+#include "UringLoop.hpp"
 
 ProxyServer::ProxyServer(int argc, char *argv[]) {
 	initializeServer(argc, argv);
 }
 
-void ProxyServer::initializeServer(int argc, char *argv[]) {
-	if (argc != 4) {
-		throw std::invalid_argument(
-			"Usage: ./pg_proxy <listen_port> <pg_host> <pg_port>\n");
+// Закрепляет вызывающий поток за процессором. Linux выделяет страницы на
+// узле NUMA потока, впервые их коснувшегося, поэтому все, что поток
+// выделит после этого, окажется локальным.
+static void pinCurrentThread(int cpu) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (rc != 0) {
+		errno = rc;
+		perror("pthread_setaffinity_np() failed");
 	}
+}
 
-	listen_port = atoi(argv[1]);
-	pg_host = argv[2];
-	pg_port = atoi(argv[3]);
+void ProxyServer::initializeServer(int argc, char *argv[]) {
+	options = parseOptions(argc, argv);
+	if (!options.auth_file.empty())
+		auth_file = AuthFile(options.auth_file);
+	backends = std::make_unique<Backends>(options);
 
-	listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+	epoll_fd = epoll_create1(0);
 
-	sockaddr_in listen_addr{};
-	listen_addr.sin_family = AF_INET;
-	listen_addr.sin_addr.s_addr = INADDR_ANY;
-	listen_addr.sin_port = htons(listen_port);
+	// В режиме --reuseport каждый воркер слушает порт сам, общего сокета нет
+	if (!options.reuseport) {
+		listen_fd = createListenSocket(false);
+		ev.events = EPOLLIN;
+		ev.data.fd = listen_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	}
 
-	if (bind(listen_fd, (sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
-		throw std::system_error(errno, std::system_category(), "bind() failed");
+	// SIGUSR1 -> вывод метрик. Маска выставляется до запуска воркеров,
+	// чтобы они ее унаследовали и сигнал приходил только через signalfd.
+	sigset_t mask;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+	signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (signal_fd < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"signalfd() failed");
 	}
+	ev.events = EPOLLIN;
+	ev.data.fd = signal_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, signal_fd, &ev);
 
-	if (listen(listen_fd, SOMAXCONN) < 0) {
-		throw std::runtime_error("Failed to listen");
+	// метрики отдает этот же поток: воркеры только пишут свои счетчики
+	if (options.metrics_port != 0) {
+		metrics_server = std::make_unique<MetricsServer>(
+			options.metrics_bind, options.metrics_port,
+			[this](std::ostream &out) { reportPrometheus(out); });
+		ev.events = EPOLLIN;
+		ev.data.fd = metrics_server->fd();
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, metrics_server->fd(), &ev);
 	}
 
-	setNonblocking(listen_fd);
+	if (options.health_interval_ms != 0) {
+		health_checker = std::make_unique<HealthChecker>(
+			*backends, options.health_interval_ms);
+		ev.events = EPOLLIN;
+		ev.data.fd = health_checker->fd();
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, health_checker->fd(), &ev);
+	}
 
-	epoll_fd = epoll_create1(0);
-	ev.events = EPOLLIN;
-	ev.data.fd = listen_fd;
-	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+	if (options.query_timeout_ms != 0) {
+		cancel_sender = std::make_unique<CancelSender>();
+		ev.events = EPOLLIN;
+		ev.data.fd = cancel_sender->fd();
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, cancel_sender->fd(), &ev);
+	}
+	session_timeouts = options.client_idle_timeout_ms > 0 ||
+					   options.idle_in_transaction_timeout_ms > 0 ||
+					   options.query_timeout_ms > 0;
 
-	for (int i = 0; i < num_threads; ++i) {
+	// процессоры, на которых процессу разрешено работать (taskset, cgroup)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"sched_getaffinity() failed");
+	}
+	for (int cpu : options.worker_cpus) {
+		if (!CPU_ISSET(cpu, &allowed)) {
+			throw std::invalid_argument("--cpu-list: CPU " +
+										std::to_string(cpu) +
+										" is not available");
+		}
+	}
+	if (options.acceptor_cpu >= 0 &&
+		!CPU_ISSET(options.acceptor_cpu, &allowed)) {
+		throw std::invalid_argument("--acceptor-cpu: CPU " +
+									std::to_string(options.acceptor_cpu) +
+									" is not available");
+	}
+
+	size_t worker_count = options.workers;
+	if (worker_count == 0 && !options.worker_cpus.empty())
+		worker_count = options.worker_cpus.size();
+	else if (worker_count == 0)
+		worker_count = CPU_COUNT(&allowed);
+	for (size_t i = 0; i < worker_count; ++i) {
 		auto worker = std::make_unique<Worker>();
+		if (!options.worker_cpus.empty())
+			worker->cpu = options.worker_cpus[i % options.worker_cpus.size()];
 		worker->epoll_fd = epoll_create1(0);
-		worker->thread =
-			std::thread([this, w = worker.get()]() { workerLoop(w); });
+		if (options.query_stats)
+			worker->query_stats = std::make_unique<QueryStats>();
+
+		// цикл сессий различает fd по data.ptr, цикл пула - по data.fd
+		bool by_endpoint =
+			options.pool_mode == PoolMode::None && !options.io_uring;
+		epoll_event wev{};
+		wev.events = EPOLLIN;
+		if (options.reuseport) {
+			worker->listen_fd = createListenSocket(true);
+			if (options.incoming_cpu &&
+				setsockopt(worker->listen_fd, SOL_SOCKET, SO_INCOMING_CPU,
+						   &worker->cpu, sizeof(worker->cpu)) < 0) {
+				throw std::system_error(errno, std::system_category(),
+										"setsockopt(SO_INCOMING_CPU) failed");
+			}
+			if (by_endpoint)
+				wev.data.ptr = &worker->listen_end;
+			else
+				wev.data.fd = worker->listen_fd;
+			epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->listen_fd, &wev);
+		}
+		// с --reuseport новых соединений от потока приема нет, но
+		// перенесенные сессии приходят так же
+		if (!options.reuseport || options.rebalance_ms > 0) {
+			worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (by_endpoint)
+				wev.data.ptr = &worker->wake_end;
+			else
+				wev.data.fd = worker->wake_fd;
+			epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_fd, &wev);
+		}
+
+		worker->thread = std::thread([this, w = worker.get()]() {
+			// до первых выделений памяти циклом воркера: пул кусков, слаб
+			// соединений и буферы io_uring ложатся на узел его процессора
+			if (w->cpu >= 0)
+				pinCurrentThread(w->cpu);
+			if (options.pool_mode == PoolMode::Transaction) {
+				PoolLoop loop(w, options, parser, auth_file, *backends,
+							  cancel_sender.get());
+				loop.run();
+			} else if (options.io_uring) {
+				UringLoop loop(w, options, parser, *backends);
+				loop.run();
+			} else {
+				workerLoop(w);
+			}
+		});
 		workers.push_back(std::move(worker));
 	}
+	loads.resize(workers.size());
+	loads_sampled = Clock::now();
+
+	if (options.rebalance_ms > 0) {
+		rebalance_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (rebalance_fd < 0) {
+			throw std::system_error(errno, std::system_category(),
+									"timerfd_create() failed");
+		}
+		itimerspec period{};
+		period.it_interval.tv_sec = options.rebalance_ms / 1000;
+		period.it_interval.tv_nsec = (options.rebalance_ms % 1000) * 1000000L;
+		period.it_value = period.it_interval;
+		timerfd_settime(rebalance_fd, 0, &period, nullptr);
+		ev.events = EPOLLIN;
+		ev.data.fd = rebalance_fd;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, rebalance_fd, &ev);
+	}
 }
 void ProxyServer::run() {
+	// после запуска воркеров: иначе они унаследовали бы это закрепление
+	if (options.acceptor_cpu >= 0)
+		pinCurrentThread(options.acceptor_cpu);
 	std::cout << "Сервер запущен!" << std::endl;
 	while (true) {
 		int nfds = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
 		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
 			throw std::system_error(errno, std::system_category(),
 									"epoll_wait() failed");
 		}
@@ -61,6 +212,26 @@ void ProxyServer::run() {
 		for (int i = 0; i < nfds; ++i) {
 			if (events[i].data.fd == listen_fd) {
 				acceptNewConnections();
+			} else if (events[i].data.fd == signal_fd) {
+				signalfd_siginfo info;
+				while (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+				}
+				reportMetrics(std::cout);
+				if (options.query_stats)
+					reportQueryStats("resources/query_stats.txt");
+			} else if (metrics_server &&
+					   events[i].data.fd == metrics_server->fd()) {
+				metrics_server->poll();
+			} else if (health_checker &&
+					   events[i].data.fd == health_checker->fd()) {
+				health_checker->poll();
+			} else if (cancel_sender &&
+					   events[i].data.fd == cancel_sender->fd()) {
+				cancel_sender->poll();
+			} else if (events[i].data.fd == rebalance_fd) {
+				uint64_t expirations;
+				read(rebalance_fd, &expirations, sizeof(expirations));
+				rebalance();
 			}
 		}
 	}
@@ -69,61 +240,411 @@ void ProxyServer::attachParser(Parser *parser) {
 	if (parser == nullptr) {
 		throw std::invalid_argument("Parser is nullptr");
 	}
-	this->parser = parser;
+	// при --no-query-log клиентский поток не разбирается и может идти
+	// через splice()
+	if (options.query_log)
+		this->parser = parser;
+}
+
+void ProxyServer::reportMetrics(std::ostream &out) const {
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const WorkerMetrics &m = workers[i]->metrics;
+		uint64_t chunks = m.relayed_chunks.load(std::memory_order_relaxed);
+		uint64_t ctl_calls = m.epoll_ctl_calls.load(std::memory_order_relaxed);
+		out << "worker " << i << ": connections="
+			<< m.active_connections.load(std::memory_order_relaxed)
+			<< " accepts=" << m.accepts.load(std::memory_order_relaxed)
+			<< " connects=" << m.connect_latency.count()
+			<< " connect_p50=" << m.connect_latency.percentile(0.5) << "us"
+			<< " connect_p99=" << m.connect_latency.percentile(0.99) << "us"
+			<< " connect_max="
+			<< m.connect_latency.max_us.load(std::memory_order_relaxed) << "us"
+			<< " connect_failures="
+			<< m.connect_failures.load(std::memory_order_relaxed)
+			<< " connect_timeouts="
+			<< m.connect_timeouts.load(std::memory_order_relaxed)
+			<< " idle_timeouts="
+			<< m.idle_timeouts.load(std::memory_order_relaxed)
+			<< " idle_in_transaction_timeouts="
+			<< m.idle_in_transaction_timeouts.load(std::memory_order_relaxed)
+			<< " query_timeouts="
+			<< m.query_timeouts.load(std::memory_order_relaxed)
+			<< " spliced_bytes="
+			<< m.spliced_bytes.load(std::memory_order_relaxed)
+			<< " client_bytes=" << m.client_bytes.load(std::memory_order_relaxed)
+			<< " server_bytes=" << m.server_bytes.load(std::memory_order_relaxed)
+			<< " wakeups=" << m.wakeups.load(std::memory_order_relaxed)
+			<< " busy_ms="
+			<< m.busy_ns.load(std::memory_order_relaxed) / 1000000
+			<< " migrated_in="
+			<< m.migrated_in.load(std::memory_order_relaxed)
+			<< " buffer_chunks=" << workers[i]->chunk_pool.allocated()
+			<< " throttles=" << m.throttles.load(std::memory_order_relaxed)
+			<< " throttled_connections="
+			<< m.throttled_connections.load(std::memory_order_relaxed)
+			<< " throttled_now="
+			<< m.throttled_now.load(std::memory_order_relaxed)
+			<< " pool_servers="
+			<< m.pool_servers.load(std::memory_order_relaxed)
+			<< " server_logins="
+			<< m.server_logins.load(std::memory_order_relaxed)
+			<< " pool_waits=" << m.pool_waits.load(std::memory_order_relaxed)
+			<< " pool_wait_timeouts="
+			<< m.pool_wait_timeouts.load(std::memory_order_relaxed)
+			<< " pool_transactions="
+			<< m.pool_transactions.load(std::memory_order_relaxed)
+			<< " replica_transactions="
+			<< m.replica_transactions.load(std::memory_order_relaxed)
+			<< " relayed_chunks=" << chunks << " epoll_ctl=" << ctl_calls
+			<< " epoll_ctl_per_chunk="
+			<< (chunks ? static_cast<double>(ctl_calls) / chunks : 0.0)
+			<< '\n';
+	}
+	for (size_t i = 0; i < backends->size(); ++i) {
+		const Backend &b = (*backends)[i];
+		out << "backend " << b.name() << ": role="
+			<< (b.role == BackendRole::Primary ? "primary" : "replica")
+			<< " up=" << b.healthy.load(std::memory_order_relaxed)
+			<< " connections="
+			<< b.connections.load(std::memory_order_relaxed)
+			<< " probe=" << b.latency_us.load(std::memory_order_relaxed)
+			<< "us failures=" << b.failures.load(std::memory_order_relaxed)
+			<< " ejections=" << b.ejections.load(std::memory_order_relaxed)
+			<< '\n';
+	}
+	if (parser != nullptr) {
+		AsyncLogger::Stats log = parser->getLogger()->stats();
+		out << "logger: producers=" << log.producers
+			<< " queue_kb=" << log.ringBytes / 1024
+			<< " queued_kb=" << log.queued / 1024
+			<< " queue_high_water_kb=" << log.highWater / 1024
+			<< " dropped=" << log.dropped << " blocked=" << log.blocked
+			<< '\n';
+	}
+	out.flush();
+}
+
+// Семейство метрик с меткой worker: get(метрики, номер воркера) -> значение
+template <typename Get>
+static void prometheusFamily(
+	std::ostream &out, const char *name, const char *type, const char *help,
+	const std::vector<std::unique_ptr<Worker>> &workers, Get get) {
+	out << "# HELP " << name << ' ' << help << '\n'
+		<< "# TYPE " << name << ' ' << type << '\n';
+	for (size_t i = 0; i < workers.size(); ++i)
+		out << name << "{worker=\"" << i << "\"} " << get(*workers[i]) << '\n';
+}
+
+// Корзины гистограммы накопительные; scale переводит границу 2^i в
+// единицы метрики
+template <typename Histogram>
+static void prometheusBuckets(std::ostream &out, const char *name,
+							  const char *labels, const Histogram &h,
+							  double scale, double sum) {
+	// границы до 2^30 без экспоненты и округления
+	std::streamsize precision = out.precision(10);
+	uint64_t cumulative = 0;
+	for (size_t b = 0; b + 1 < Histogram::BUCKETS; ++b) {
+		cumulative += h.buckets[b].load(std::memory_order_relaxed);
+		out << name << "_bucket{" << labels << ",le=\""
+			<< static_cast<double>(1ULL << b) * scale << "\"} " << cumulative
+			<< '\n';
+	}
+	cumulative += h.buckets[Histogram::BUCKETS - 1].load(
+		std::memory_order_relaxed);
+	out << name << "_bucket{" << labels << ",le=\"+Inf\"} " << cumulative
+		<< '\n'
+		<< name << "_sum{" << labels << "} " << sum << '\n'
+		<< name << "_count{" << labels << "} " << cumulative << '\n';
+	out.precision(precision);
+}
+
+// Семейство метрик с метками backend и role
+template <typename Get>
+static void prometheusBackends(std::ostream &out, const char *name,
+							   const char *type, const char *help,
+							   const Backends &backends, Get get) {
+	out << "# HELP " << name << ' ' << help << '\n'
+		<< "# TYPE " << name << ' ' << type << '\n';
+	for (size_t i = 0; i < backends.size(); ++i) {
+		const Backend &b = backends[i];
+		out << name << "{backend=\"" << b.name() << "\",role=\""
+			<< (b.role == BackendRole::Primary ? "primary" : "replica")
+			<< "\"} " << get(b) << '\n';
+	}
+}
+
+void ProxyServer::reportPrometheus(std::ostream &out) const {
+	auto counter = [&](const char *name, const char *help, auto field) {
+		prometheusFamily(out, name, "counter", help, workers,
+						 [&](const Worker &w) {
+							 return (w.metrics.*field).load(
+								 std::memory_order_relaxed);
+						 });
+	};
+	auto gauge = [&](const char *name, const char *help, auto field) {
+		prometheusFamily(out, name, "gauge", help, workers,
+						 [&](const Worker &w) {
+							 return (w.metrics.*field).load(
+								 std::memory_order_relaxed);
+						 });
+	};
+
+	gauge("pg_proxy_active_connections", "Client connections of the worker.",
+		  &WorkerMetrics::active_connections);
+	counter("pg_proxy_accepts_total", "Accepted client connections.",
+			&WorkerMetrics::accepts);
+	counter("pg_proxy_wakeups_total",
+			"Event loop wakeups that returned events.",
+			&WorkerMetrics::wakeups);
+	prometheusFamily(out, "pg_proxy_busy_seconds_total", "counter",
+					 "Time the worker loop spent outside waiting for events.",
+					 workers, [](const Worker &w) {
+						 return w.metrics.busy_ns.load(
+									std::memory_order_relaxed) *
+								1e-9;
+					 });
+	if (options.rebalance_ms > 0) {
+		counter("pg_proxy_migrated_connections_total",
+				"Idle sessions moved to this worker by --rebalance-ms.",
+				&WorkerMetrics::migrated_in);
+	}
+	counter("pg_proxy_epoll_ctl_total", "epoll_ctl() calls.",
+			&WorkerMetrics::epoll_ctl_calls);
+	counter("pg_proxy_relayed_chunks_total",
+			"Successful reads relayed to the other side.",
+			&WorkerMetrics::relayed_chunks);
+	counter("pg_proxy_spliced_bytes_total", "Bytes relayed with splice().",
+			&WorkerMetrics::spliced_bytes);
+
+	out << "# HELP pg_proxy_relayed_bytes_total Bytes relayed per direction.\n"
+		   "# TYPE pg_proxy_relayed_bytes_total counter\n";
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const WorkerMetrics &m = workers[i]->metrics;
+		out << "pg_proxy_relayed_bytes_total{worker=\"" << i
+			<< "\",direction=\"client_to_server\"} "
+			<< m.client_bytes.load(std::memory_order_relaxed) << '\n'
+			<< "pg_proxy_relayed_bytes_total{worker=\"" << i
+			<< "\",direction=\"server_to_client\"} "
+			<< m.server_bytes.load(std::memory_order_relaxed) << '\n';
+	}
+
+	counter("pg_proxy_connect_failures_total",
+			"Failed connects to PostgreSQL.",
+			&WorkerMetrics::connect_failures);
+	counter("pg_proxy_connect_timeouts_total",
+			"Connects to PostgreSQL that timed out.",
+			&WorkerMetrics::connect_timeouts);
+	counter("pg_proxy_idle_timeouts_total",
+			"Clients closed after being idle outside a transaction.",
+			&WorkerMetrics::idle_timeouts);
+	counter("pg_proxy_idle_in_transaction_timeouts_total",
+			"Clients closed after being idle inside a transaction.",
+			&WorkerMetrics::idle_in_transaction_timeouts);
+	counter("pg_proxy_query_timeouts_total",
+			"Queries cancelled for running longer than the query timeout.",
+			&WorkerMetrics::query_timeouts);
+	out << "# HELP pg_proxy_connect_duration_seconds Time to connect to "
+		   "PostgreSQL.\n"
+		   "# TYPE pg_proxy_connect_duration_seconds histogram\n";
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const LatencyHistogram &h = workers[i]->metrics.connect_latency;
+		std::string labels = "worker=\"" + std::to_string(i) + "\"";
+		prometheusBuckets(out, "pg_proxy_connect_duration_seconds",
+						  labels.c_str(), h, 1e-6,
+						  h.total_us.load(std::memory_order_relaxed) * 1e-6);
+	}
+
+	prometheusFamily(out, "pg_proxy_buffer_chunks", "gauge",
+					 "Buffer chunks allocated by the worker.", workers,
+					 [](const Worker &w) { return w.chunk_pool.allocated(); });
+	out << "# HELP pg_proxy_buffer_occupancy_bytes Bytes waiting to be sent "
+		   "in a direction, sampled after each read.\n"
+		   "# TYPE pg_proxy_buffer_occupancy_bytes histogram\n";
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const SizeHistogram &h = workers[i]->metrics.buffer_occupancy;
+		std::string labels = "worker=\"" + std::to_string(i) + "\"";
+		prometheusBuckets(
+			out, "pg_proxy_buffer_occupancy_bytes", labels.c_str(), h, 1.0,
+			static_cast<double>(h.total_bytes.load(std::memory_order_relaxed)));
+	}
+	counter("pg_proxy_throttles_total",
+			"Times reading a side was paused at --high-water-kb.",
+			&WorkerMetrics::throttles);
+	gauge("pg_proxy_throttled_sides", "Sides whose reading is paused now.",
+		  &WorkerMetrics::throttled_now);
+
+	if (options.pool_mode == PoolMode::Transaction) {
+		gauge("pg_proxy_pool_servers", "Pooled server connections.",
+			  &WorkerMetrics::pool_servers);
+		counter("pg_proxy_server_logins_total", "Logins to PostgreSQL.",
+				&WorkerMetrics::server_logins);
+		counter("pg_proxy_pool_waits_total",
+				"Clients queued for a free server.",
+				&WorkerMetrics::pool_waits);
+		counter("pg_proxy_pool_wait_timeouts_total",
+				"Clients that timed out waiting for a server.",
+				&WorkerMetrics::pool_wait_timeouts);
+		counter("pg_proxy_pool_transactions_total",
+				"Transactions after which the server returned to the pool.",
+				&WorkerMetrics::pool_transactions);
+		if (!options.replicas.empty()) {
+			counter("pg_proxy_replica_transactions_total",
+					"Transactions routed to a --replica server.",
+					&WorkerMetrics::replica_transactions);
+		}
+	}
+
+	prometheusBackends(out, "pg_proxy_backend_up", "gauge",
+					   "1 if the backend is in rotation, 0 if ejected.",
+					   *backends, [](const Backend &b) {
+						   return b.healthy.load(std::memory_order_relaxed) ? 1
+																			: 0;
+					   });
+	prometheusBackends(out, "pg_proxy_backend_connections", "gauge",
+					   "Open proxy connections to the backend.", *backends,
+					   [](const Backend &b) {
+						   return b.connections.load(std::memory_order_relaxed);
+					   });
+	prometheusBackends(out, "pg_proxy_backend_probe_latency_seconds", "gauge",
+					   "Smoothed health check round trip.", *backends,
+					   [](const Backend &b) {
+						   return b.latency_us.load(std::memory_order_relaxed) *
+								  1e-6;
+					   });
+	prometheusBackends(out, "pg_proxy_backend_ejections_total", "counter",
+					   "Times the backend was taken out of rotation.",
+					   *backends, [](const Backend &b) {
+						   return b.ejections.load(std::memory_order_relaxed);
+					   });
+
+	if (parser != nullptr) {
+		AsyncLogger::Stats log = parser->getLogger()->stats();
+		out << "# HELP pg_proxy_logger_queued_bytes Log bytes waiting for "
+			   "the writer thread.\n"
+			   "# TYPE pg_proxy_logger_queued_bytes gauge\n"
+			<< "pg_proxy_logger_queued_bytes " << log.queued << '\n'
+			<< "# HELP pg_proxy_logger_queue_high_water_bytes Highest fill of "
+			   "a producer queue.\n"
+			   "# TYPE pg_proxy_logger_queue_high_water_bytes gauge\n"
+			<< "pg_proxy_logger_queue_high_water_bytes " << log.highWater
+			<< '\n'
+			<< "# HELP pg_proxy_logger_queue_capacity_bytes Size of one "
+			   "producer queue.\n"
+			   "# TYPE pg_proxy_logger_queue_capacity_bytes gauge\n"
+			<< "pg_proxy_logger_queue_capacity_bytes " << log.ringBytes << '\n'
+			<< "# HELP pg_proxy_logger_dropped_total Log records dropped on "
+			   "overflow.\n"
+			   "# TYPE pg_proxy_logger_dropped_total counter\n"
+			<< "pg_proxy_logger_dropped_total " << log.dropped << '\n'
+			<< "# HELP pg_proxy_logger_blocked_total Times a producer waited "
+			   "for queue space.\n"
+			   "# TYPE pg_proxy_logger_blocked_total counter\n"
+			<< "pg_proxy_logger_blocked_total " << log.blocked << '\n';
+	}
+}
+
+void ProxyServer::reportQueryStats(const std::string &path) const {
+	std::unordered_map<uint64_t, QueryStatsSummary> merged;
+	for (const auto &worker : workers)
+		worker->query_stats->collect(merged);
+
+	std::vector<const QueryStatsSummary *> sorted;
+	sorted.reserve(merged.size());
+	for (const auto &[fingerprint, summary] : merged)
+		sorted.push_back(&summary);
+	std::sort(sorted.begin(), sorted.end(), [](auto *a, auto *b) {
+		return a->total_us > b->total_us;
+	});
+
+	std::ofstream out(path, std::ios::trunc);
+	if (!out) {
+		perror(path.c_str());
+		return;
+	}
+	out << "calls\ttotal_ms\tmean_us\tmin_us\tp50_us\tp95_us\tp99_us\t"
+		   "max_us\trows\terrors\tquery\n";
+	for (const QueryStatsSummary *s : sorted) {
+		out << s->calls << '\t' << s->total_us / 1000 << '\t'
+			<< s->total_us / s->calls << '\t' << s->min_us << '\t'
+			<< s->percentile(0.5) << '\t' << s->percentile(0.95) << '\t'
+			<< s->percentile(0.99) << '\t' << s->max_us << '\t' << s->rows
+			<< '\t' << s->errors << '\t' << s->text << '\n';
+	}
 }
 
 void ProxyServer::workerLoop(Worker *worker) {
 	epoll_event events[MAX_EVENTS];
 
 	while (true) {
-		{
-			std::unique_lock<std::mutex> lock(worker->mutex);
-			while (!worker->new_connections.empty()) {
-				auto [client_fd, server_fd] = worker->new_connections.front();
-				worker->new_connections.pop();
-
-				ProxyConnection conn{client_fd, server_fd};
-				worker->connections[client_fd] = conn;
-				worker->fd_to_owner[client_fd] = client_fd;
-				worker->fd_to_owner[server_fd] = client_fd;
-
-				epoll_event ev1;
-				ev1.events = EPOLLIN | EPOLLET;
-				ev1.data.fd = client_fd;
-
-				epoll_event ev2;
-				ev2.events = EPOLLIN | EPOLLET;
-				ev2.data.fd = server_fd;
-
-				epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, client_fd, &ev1);
-				epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, server_fd, &ev2);
-			}
-		}
-
-		int nfds = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, 100);
+		// спим до ближайшего таймера, без таймеров - до событий
+		int nfds = epoll_wait(worker->epoll_fd, events, MAX_EVENTS,
+							  worker->timers.timeoutMs(Clock::now()));
+		worker->loop_now = Clock::now();
+		if (nfds > 0)
+			worker->metrics.wakeups.fetch_add(1, std::memory_order_relaxed);
 		for (int i = 0; i < nfds; ++i) {
-			int fd = events[i].data.fd;
+			auto *endpoint = static_cast<EpollEndpoint *>(events[i].data.ptr);
+
+			if (endpoint == &worker->listen_end) {
+				acceptWorkerConnections(worker);
+				continue;
+			}
+			if (endpoint == &worker->wake_end) {
+				drainNewConnections(worker);
+				continue;
+			}
 
-			auto it = worker->fd_to_owner.find(fd);
-			if (it == worker->fd_to_owner.end())
+			ProxyConnection &conn = *endpoint->conn;
+			// закрыто событием раньше в этой же пачке
+			if (conn.dead)
 				continue;
+			int fd = endpoint->client_side ? conn.client_fd : conn.server_fd;
+			conn.last_active = worker->loop_now;
 
-			int conn_key = it->second;
-			auto &conn = worker->connections[conn_key];
+			if (conn.state == ConnState::Connecting && fd == conn.server_fd) {
+				if (completeConnect(worker, conn)) {
+					closeConnection(worker, conn);
+					continue;
+				}
+				// маска не меняется после подключения, поэтому пришедший
+				// вместе с EPOLLOUT фронт EPOLLIN нужно обработать сейчас
+			}
 
-			if (events[i].events & EPOLLIN) {
+			if ((events[i].events &
+				 (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) &&
+				conn.state != ConnState::Closing) {
 				if (handleReadEvent(worker, fd, conn)) {
 					closeConnection(worker, conn);
 					continue;
 				}
 			}
-			if (events[i].events & EPOLLOUT) {
+			// EPOLLOUT клиента приходит сразу после регистрации, но писать
+			// ему до подключения к PostgreSQL нечего
+			if ((events[i].events & EPOLLOUT) &&
+				conn.state != ConnState::Connecting) {
 				if (handleWriteEvent(worker, fd, conn)) {
 					closeConnection(worker, conn);
 					continue;
 				}
 			}
+			armTimeouts(worker, conn);
 		}
+
+		worker->timers.advance(worker->loop_now, [&](ProxyConnection &conn) {
+			onTimer(worker, conn);
+		});
+		reapConnections(worker);
+		// вне пачки событий: на перенесенные соединения в ней уже не
+		// может быть ссылок
+		if (worker->migrate_count.load(std::memory_order_relaxed) > 0)
+			migrateIdle(worker);
+
+		worker->metrics.busy_ns.fetch_add(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(
+				Clock::now() - worker->loop_now)
+				.count(),
+			std::memory_order_relaxed);
 	}
 }
 
@@ -131,131 +652,750 @@ void ProxyServer::setNonblocking(int fd) {
 	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 }
 
+int ProxyServer::createListenSocket(bool reuseport) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	if (reuseport &&
+		setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"setsockopt(SO_REUSEPORT) failed");
+	}
+
+	sockaddr_in listen_addr{};
+	listen_addr.sin_family = AF_INET;
+	listen_addr.sin_addr.s_addr = INADDR_ANY;
+	listen_addr.sin_port = htons(options.listen_port);
+
+	if (bind(fd, (sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
+		throw std::system_error(errno, std::system_category(), "bind() failed");
+	}
+
+	if (listen(fd, SOMAXCONN) < 0) {
+		throw std::runtime_error("Failed to listen");
+	}
+
+	setNonblocking(fd);
+	return fd;
+}
+
 void ProxyServer::acceptNewConnections() {
-	int client_fd = accept(listen_fd, nullptr, nullptr);
-	if (client_fd < 0) {
-		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+	while (true) {
+		int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+		if (client_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4() failed");
 			return;
-		throw std::system_error(errno, std::system_category(),
-								"accept() failed");
+		}
+
+		// connect() неблокирующий: рукопожатие с PostgreSQL завершается уже в
+		// epoll-цикле воркера, поток приема не ждет RTT до бэкенда
+		PendingConnection pending{client_fd, -1, Clock::now()};
+		// в режиме пула сервер клиенту выдает воркер
+		if (options.pool_mode == PoolMode::None) {
+			pending.server_fd = connectToPg(pending.backend);
+			if (pending.server_fd < 0) {
+				perror("connect() failed");
+				close(client_fd);
+				continue;
+			}
+		}
+
+		Worker *worker = pickWorker();
+		worker->metrics.accepts.fetch_add(1, std::memory_order_relaxed);
+
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			worker->new_connections.push(pending);
+		}
+		uint64_t one = 1;
+		write(worker->wake_fd, &one, sizeof(one));
+	}
+}
+
+void ProxyServer::acceptWorkerConnections(Worker *worker) {
+	while (true) {
+		int client_fd =
+			accept4(worker->listen_fd, nullptr, nullptr, SOCK_NONBLOCK);
+		if (client_fd < 0) {
+			if (errno == EINTR)
+				continue;
+			// EAGAIN, а также ECONNABORTED, EMFILE и т.п. не должны
+			// останавливать воркер
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4() failed");
+			return;
+		}
+
+		worker->metrics.accepts.fetch_add(1, std::memory_order_relaxed);
+		PendingConnection pending{client_fd, -1, Clock::now()};
+		pending.server_fd = connectToPg(pending.backend);
+		if (pending.server_fd < 0) {
+			perror("connect() failed");
+			close(client_fd);
+			continue;
+		}
+		registerConnection(worker, pending);
+	}
+}
+
+void ProxyServer::drainNewConnections(Worker *worker) {
+	uint64_t value;
+	read(worker->wake_fd, &value, sizeof(value));
+
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	while (!worker->new_connections.empty()) {
+		registerConnection(worker, worker->new_connections.front());
+		worker->new_connections.pop();
+	}
+	for (auto &moved : worker->migrated)
+		adoptConnection(worker, std::move(moved));
+	worker->migrated.clear();
+}
+
+// замеры загрузки не чаще раза в LOAD_SAMPLE_INTERVAL: между ними
+// новые соединения учитываются в WorkerLoad::assigned
+constexpr auto LOAD_SAMPLE_INTERVAL = std::chrono::milliseconds(100);
+// сессия без событий дольше этого считается простаивающей
+constexpr auto MIGRATION_IDLE = std::chrono::milliseconds(100);
+// разница загрузки (в тысячных), с которой начинается перенос
+constexpr uint32_t REBALANCE_GAP_PERMILLE = 200;
+constexpr unsigned MAX_MIGRATIONS = 64;
+
+void ProxyServer::sampleLoads(bool force) {
+	auto now = Clock::now();
+	auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					   now - loads_sampled)
+					   .count();
+	if (elapsed <= 0 || (!force && now - loads_sampled < LOAD_SAMPLE_INTERVAL))
+		return;
+	loads_sampled = now;
+
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const WorkerMetrics &m = workers[i]->metrics;
+		WorkerLoad &load = loads[i];
+		uint64_t busy = m.busy_ns.load(std::memory_order_relaxed);
+		uint64_t bytes = m.client_bytes.load(std::memory_order_relaxed) +
+						 m.server_bytes.load(std::memory_order_relaxed);
+		uint64_t busy_permille =
+			std::min<uint64_t>(1000, (busy - load.busy_ns) * 1000 / elapsed);
+		uint64_t bytes_per_sec = static_cast<uint64_t>(
+			static_cast<double>(bytes - load.bytes) * 1e9 / elapsed);
+		// пополам со старым значением, чтобы один всплеск не решал
+		load.busy_permille = (load.busy_permille + busy_permille) / 2;
+		load.bytes_per_sec = (load.bytes_per_sec + bytes_per_sec) / 2;
+		load.busy_ns = busy;
+		load.bytes = bytes;
+		load.assigned = 0;
 	}
+}
 
-	setNonblocking(client_fd);
-	int server_fd = connectToPg();
-	setNonblocking(server_fd);
+// Оценка складывается из трех долей в тысячных: занятость цикла (с весом
+// 2), доля соединений и доля трафика среди всех воркеров. Равные
+// перебираются по кругу, поэтому без нагрузки выходит round-robin.
+Worker *ProxyServer::pickWorker() {
+	sampleLoads(false);
 
-	auto &worker = workers[next_worker];
+	std::vector<uint64_t> connections(workers.size());
+	uint64_t total_connections = 0;
+	uint64_t total_rate = 0;
+	for (size_t i = 0; i < workers.size(); ++i) {
+		connections[i] = workers[i]->metrics.active_connections.load(
+							 std::memory_order_relaxed) +
+						 loads[i].assigned;
+		total_connections += connections[i];
+		total_rate += loads[i].bytes_per_sec;
+	}
+
+	size_t best = 0;
+	uint64_t best_score = UINT64_MAX;
+	for (size_t n = 0; n < workers.size(); ++n) {
+		size_t i = (next_worker + n) % workers.size();
+		uint64_t score = 2 * static_cast<uint64_t>(loads[i].busy_permille);
+		if (total_connections > 0)
+			score += connections[i] * 1000 / total_connections;
+		if (total_rate > 0)
+			score += loads[i].bytes_per_sec * 1000 / total_rate;
+		if (score < best_score) {
+			best = i;
+			best_score = score;
+		}
+	}
 	next_worker = (next_worker + 1) % workers.size();
+	++loads[best].assigned;
+	return workers[best].get();
+}
+
+// Просит самый загруженный воркер отдать часть простаивающих сессий самому
+// свободному: столько, чтобы при равной нагрузке сессий их занятость
+// сравнялась
+void ProxyServer::rebalance() {
+	sampleLoads(true);
+	if (workers.size() < 2)
+		return;
+
+	size_t hot = 0;
+	size_t cold = 0;
+	for (size_t i = 1; i < workers.size(); ++i) {
+		if (loads[i].busy_permille > loads[hot].busy_permille)
+			hot = i;
+		if (loads[i].busy_permille < loads[cold].busy_permille)
+			cold = i;
+	}
+	uint32_t hot_busy = loads[hot].busy_permille;
+	uint32_t gap = hot_busy - loads[cold].busy_permille;
+	if (gap < REBALANCE_GAP_PERMILLE)
+		return;
+	// предыдущая просьба еще не выполнена
+	if (workers[hot]->migrate_count.load(std::memory_order_relaxed) > 0)
+		return;
+
+	uint64_t hot_connections =
+		workers[hot]->metrics.active_connections.load(std::memory_order_relaxed);
+	uint64_t count = hot_connections * gap / (2 * hot_busy);
+	count = std::clamp<uint64_t>(count, 1, MAX_MIGRATIONS);
+
+	workers[hot]->migrate_to.store(cold, std::memory_order_relaxed);
+	workers[hot]->migrate_count.store(static_cast<unsigned>(count),
+									  std::memory_order_release);
+	// без таймеров воркер спит в epoll_wait() до событий
+	uint64_t one = 1;
+	write(workers[hot]->wake_fd, &one, sizeof(one));
+}
+
+// Все, что относится к сессии, кроме буферов (переносятся только пустые и
+// привязаны к пулу воркера), масок epoll, таймера и указателей на само
+// соединение
+static void moveSession(ProxyConnection &to, ProxyConnection &from) {
+	to.client_fd = from.client_fd;
+	to.server_fd = from.server_fd;
+	to.backend = from.backend;
+	to.state = from.state;
+	to.connect_started = from.connect_started;
+	to.client_framer = std::move(from.client_framer);
+	to.parser_session = std::move(from.parser_session);
+	to.server_framer = std::move(from.server_framer);
+	to.throttle_count = from.throttle_count;
+	to.to_client = from.to_client;
+	to.to_server = from.to_server;
+	to.last_active = from.last_active;
+	to.query_running = from.query_running;
+	to.cancel_sent = from.cancel_sent;
+	to.query_started = from.query_started;
+	to.tx_status = from.tx_status;
+	to.backend_pid = from.backend_pid;
+	to.backend_key = from.backend_key;
+}
+
+// Переносимая сессия простаивает: ничего не ждет отправки ни в одну
+// сторону и давно не получала событий. Сокеты и каналы splice() просто
+// переходят в epoll другого воркера.
+void ProxyServer::migrateIdle(Worker *worker) {
+	unsigned count =
+		worker->migrate_count.exchange(0, std::memory_order_acquire);
+	size_t target_index = worker->migrate_to.load(std::memory_order_relaxed);
+	if (count == 0 || target_index >= workers.size() ||
+		workers[target_index].get() == worker)
+		return;
+	Worker *target = workers[target_index].get();
+
+	std::vector<std::unique_ptr<ProxyConnection>> moved;
+	size_t table_size = worker->by_client_fd.size();
+	size_t n = 0;
+	for (; n < table_size && moved.size() < count; ++n) {
+		size_t fd = (worker->migrate_cursor + n) % table_size;
+		ProxyConnection *conn = worker->by_client_fd[fd];
+		if (conn == nullptr || conn->dead ||
+			conn->state != ConnState::Relaying || !conn->client_buf.empty() ||
+			!conn->server_buf.empty() || conn->client_throttled ||
+			conn->server_throttled || conn->to_client.bytes > 0 ||
+			conn->to_server.bytes > 0 ||
+			worker->loop_now - conn->last_active < MIGRATION_IDLE)
+			continue;
+
+		// данные, пришедшие между DEL и ADD, не теряются: EPOLL_CTL_ADD
+		// сразу сообщает о готовом сокете
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, nullptr);
+		epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn->server_fd, nullptr);
+		worker->metrics.epoll_ctl_calls.fetch_add(2, std::memory_order_relaxed);
+		worker->timers.cancel(conn->timer);
+
+		auto session = std::make_unique<ProxyConnection>();
+		moveSession(*session, *conn);
+		moved.push_back(std::move(session));
+		worker->by_client_fd[fd] = nullptr;
+		worker->connections.release(conn);
+		worker->metrics.active_connections.fetch_sub(
+			1, std::memory_order_relaxed);
+	}
+	worker->migrate_cursor =
+		table_size ? (worker->migrate_cursor + n) % table_size : 0;
+	if (moved.empty())
+		return;
 
 	{
-		std::lock_guard<std::mutex> lock(worker->mutex);
-		worker->new_connections.emplace(client_fd, server_fd);
+		std::lock_guard<std::mutex> lock(target->mutex);
+		for (auto &session : moved)
+			target->migrated.push_back(std::move(session));
 	}
-	worker->cv.notify_one();
+	uint64_t one = 1;
+	write(target->wake_fd, &one, sizeof(one));
 }
-int ProxyServer::connectToPg() {
-	int fd = socket(AF_INET, SOCK_STREAM, 0);
 
-	sockaddr_in addr{};
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(pg_port);
+void ProxyServer::adoptConnection(Worker *worker,
+								  std::unique_ptr<ProxyConnection> moved) {
+	ProxyConnection &conn = *worker->connections.acquire();
+	moveSession(conn, *moved);
+	conn.client_buf = ChunkBuffer(&worker->chunk_pool);
+	conn.server_buf = ChunkBuffer(&worker->chunk_pool);
 
-	inet_pton(AF_INET, pg_host.c_str(), &addr.sin_addr);
+	if (worker->by_client_fd.size() <= static_cast<size_t>(conn.client_fd))
+		worker->by_client_fd.resize(conn.client_fd + 1);
+	worker->by_client_fd[conn.client_fd] = &conn;
+	worker->updateEvents(conn.client_fd, conn.client_events, RELAY_EVENTS,
+						 &conn.client_end);
+	worker->updateEvents(conn.server_fd, conn.server_events, RELAY_EVENTS,
+						 &conn.server_end);
 
-	if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
-		close(fd);
-		throw std::system_error(errno, std::system_category(),
-								"connect() failed");
+	armTimeouts(worker, conn);
+
+	worker->metrics.active_connections.fetch_add(1, std::memory_order_relaxed);
+	worker->metrics.migrated_in.fetch_add(1, std::memory_order_relaxed);
+}
+int ProxyServer::connectToPg(int &backend) {
+	backend = backends->pickByConnections(BackendRole::Primary);
+	return backends->connect(backend);
+}
+
+void ProxyServer::registerConnection(Worker *worker,
+									 const PendingConnection &pending) {
+	ProxyConnection &conn = *worker->connections.acquire();
+	conn.client_fd = pending.client_fd;
+	conn.server_fd = pending.server_fd;
+	conn.backend = pending.backend;
+	conn.connect_started = pending.connect_started;
+	conn.client_buf = ChunkBuffer(&worker->chunk_pool);
+	conn.server_buf = ChunkBuffer(&worker->chunk_pool);
+	conn.parser_session = ParserSession(parser, worker->query_stats.get());
+	if (options.splice) {
+		openSplicePipe(conn.to_client);
+		// парсеру нужны байты клиента, поэтому это направление идет через
+		// splice() только без логирования
+		if (!parser)
+			openSplicePipe(conn.to_server);
 	}
+	if (worker->by_client_fd.size() <= static_cast<size_t>(conn.client_fd))
+		worker->by_client_fd.resize(conn.client_fd + 1);
+	worker->by_client_fd[conn.client_fd] = &conn;
 
-	return fd;
+	// сокеты регистрируются один раз на все время жизни соединения;
+	// завершение connect() приходит как EPOLLOUT (или EPOLLERR)
+	worker->updateEvents(pending.client_fd, conn.client_events, RELAY_EVENTS,
+						 &conn.client_end);
+	worker->updateEvents(pending.server_fd, conn.server_events, RELAY_EVENTS,
+						 &conn.server_end);
+
+	conn.last_active = worker->loop_now;
+	armTimeouts(worker, conn);
+	worker->metrics.active_connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool ProxyServer::completeConnect(Worker *worker, ProxyConnection &conn) {
+	int err = 0;
+	socklen_t err_len = sizeof(err);
+	if (getsockopt(conn.server_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+		err = errno;
+	if (err != 0) {
+		worker->metrics.connect_failures.fetch_add(1,
+												   std::memory_order_relaxed);
+		backends->connectFailed(conn.backend);
+		return true;
+	}
+
+	auto elapsed = Clock::now() - conn.connect_started;
+	worker->metrics.connect_latency.record(
+		std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+			.count());
+
+	conn.state = ConnState::Relaying;
+	// то, что клиент успел прислать, пока шло подключение
+	return handleWriteEvent(worker, conn.server_fd, conn);
+}
+
+// Что случится с соединением и когда, если ничего не изменится
+enum class SessionTimeout { None, Connect, Query, IdleInTransaction, Idle };
+
+static SessionTimeout nextTimeout(const ProxyOptions &options,
+								  const ProxyConnection &conn,
+								  Clock::time_point &deadline) {
+	using std::chrono::milliseconds;
+	if (conn.state == ConnState::Connecting) {
+		if (options.connect_timeout_ms == 0)
+			return SessionTimeout::None;
+		deadline =
+			conn.connect_started + milliseconds(options.connect_timeout_ms);
+		return SessionTimeout::Connect;
+	}
+	if (conn.query_running) {
+		// отменить можно только запрос сервера, приславшего BackendKeyData
+		if (options.query_timeout_ms == 0 || conn.cancel_sent ||
+			conn.backend_pid == 0)
+			return SessionTimeout::None;
+		deadline = conn.query_started + milliseconds(options.query_timeout_ms);
+		return SessionTimeout::Query;
+	}
+	if (conn.tx_status != 'I') {
+		if (options.idle_in_transaction_timeout_ms == 0)
+			return SessionTimeout::None;
+		deadline = conn.last_active +
+				   milliseconds(options.idle_in_transaction_timeout_ms);
+		return SessionTimeout::IdleInTransaction;
+	}
+	if (options.client_idle_timeout_ms == 0)
+		return SessionTimeout::None;
+	deadline = conn.last_active + milliseconds(options.client_idle_timeout_ms);
+	return SessionTimeout::Idle;
+}
+
+void ProxyServer::armTimeouts(Worker *worker, ProxyConnection &conn) {
+	Clock::time_point deadline;
+	if (nextTimeout(options, conn, deadline) != SessionTimeout::None)
+		worker->timers.scheduleEarlier(conn.timer, deadline);
+}
+
+// Таймер мог быть поставлен на срок, который активность уже отодвинула:
+// тогда он просто переставляется
+void ProxyServer::onTimer(Worker *worker, ProxyConnection &conn) {
+	Clock::time_point deadline;
+	SessionTimeout timeout = nextTimeout(options, conn, deadline);
+	if (timeout == SessionTimeout::None)
+		return;
+	if (deadline > worker->loop_now) {
+		worker->timers.schedule(conn.timer, deadline);
+		return;
+	}
+
+	switch (timeout) {
+	case SessionTimeout::Connect:
+		worker->metrics.connect_timeouts.fetch_add(1,
+												   std::memory_order_relaxed);
+		backends->connectFailed(conn.backend);
+		closeConnection(worker, conn);
+		break;
+	case SessionTimeout::Query:
+		// ответ на отмену (ErrorResponse 57014) придет клиенту обычным путем
+		conn.cancel_sent = true;
+		cancel_sender->send((*backends)[conn.backend], conn.backend_pid,
+							conn.backend_key);
+		worker->metrics.query_timeouts.fetch_add(1, std::memory_order_relaxed);
+		break;
+	case SessionTimeout::IdleInTransaction:
+		worker->metrics.idle_in_transaction_timeouts.fetch_add(
+			1, std::memory_order_relaxed);
+		closeTimedOut(worker, conn, "25P03",
+					  "terminating connection due to idle-in-transaction "
+					  "timeout");
+		break;
+	case SessionTimeout::Idle:
+		worker->metrics.idle_timeouts.fetch_add(1, std::memory_order_relaxed);
+		closeTimedOut(worker, conn, "57P05",
+					  "terminating connection due to idle-session timeout");
+		break;
+	case SessionTimeout::None:
+		break;
+	}
+}
+
+// Клиент получает FATAL, как от самого PostgreSQL, если сессия уже
+// началась и сообщение не разорвет недосланный ответ сервера. Закрытый
+// сокет сервера завершает бэкенд и откатывает его транзакцию.
+void ProxyServer::closeTimedOut(Worker *worker, ProxyConnection &conn,
+								std::string_view sqlstate,
+								std::string_view message) {
+	if (conn.parser_session.startup_done && conn.server_buf.empty() &&
+		conn.to_client.bytes == 0) {
+		std::string error = errorResponse(sqlstate, message);
+		send(conn.client_fd, error.data(), error.size(),
+			 MSG_NOSIGNAL | MSG_DONTWAIT);
+	}
+	closeConnection(worker, conn);
 }
 
+bool ProxyServer::openSplicePipe(SplicePipe &pipe) {
+	int fds[2];
+	if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+		// например, исчерпан лимит fd: направление останется буферным
+		perror("pipe2() failed");
+		return false;
+	}
+	pipe.read_fd = fds[0];
+	pipe.write_fd = fds[1];
+	int capacity = fcntl(pipe.write_fd, F_GETPIPE_SZ);
+	pipe.capacity = capacity > 0 ? capacity : 65536;
+	return true;
+}
+
+bool ProxyServer::spliceRelay(Worker *worker, int src_fd, int dst_fd,
+							  SplicePipe &pipe,
+							  std::atomic<uint64_t> &relayed_bytes) {
+	constexpr unsigned flags = SPLICE_F_NONBLOCK | SPLICE_F_MOVE;
+
+	// EAGAIN при splice() в канал не отличает "сокет пуст" от "канал
+	// заполнен", поэтому после каждого освобождения места в канале снова
+	// пробуем читать источник, пока ни одна из сторон не продвинется
+	while (true) {
+		bool progress = false;
+
+		if (!pipe.source_eof && pipe.bytes < pipe.capacity) {
+			ssize_t n = splice(src_fd, nullptr, pipe.write_fd, nullptr,
+							   pipe.capacity - pipe.bytes, flags);
+			if (n > 0) {
+				pipe.bytes += n;
+				progress = true;
+			} else if (n == 0) {
+				pipe.source_eof = true;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return true;
+			}
+		}
+
+		if (pipe.bytes > 0) {
+			ssize_t n = splice(pipe.read_fd, nullptr, dst_fd, nullptr,
+							   pipe.bytes, flags);
+			if (n > 0) {
+				pipe.bytes -= n;
+				worker->metrics.spliced_bytes.fetch_add(
+					n, std::memory_order_relaxed);
+				relayed_bytes.fetch_add(n, std::memory_order_relaxed);
+				progress = true;
+			} else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				return true;
+			}
+		}
+
+		if (!progress)
+			break;
+	}
+
+	return pipe.source_eof && pipe.bytes == 0;
+}
+
+// Ответы сервера в epoll-цикле сессий: ReadyForQuery и BackendKeyData для
+// таймаутов сессии, остальное - статистике запросов
+class ServerStreamSink : public MessageSink {
+  public:
+	explicit ServerStreamSink(ProxyConnection &conn) : conn(conn) {}
+
+	bool wantsBody(char type) const override {
+		return type == 'Z' || type == 'K' ||
+			   (conn.parser_session.queries.active() &&
+				QueryTracker::wantsResponse(type));
+	}
+
+	void onMessage(char type, const char *body, size_t len) override {
+		if (type == 'Z') {
+			conn.tx_status = len > 0 ? body[0] : 'I';
+			conn.query_running = false;
+			conn.parser_session.onReadyForQuery(conn.tx_status);
+		} else if (type == 'K') {
+			PgReader reader(body, len);
+			conn.backend_pid = reader.int32();
+			conn.backend_key = reader.int32();
+		}
+		QueryTracker &queries = conn.parser_session.queries;
+		if (queries.active() && QueryTracker::wantsResponse(type))
+			queries.onMessage(type, body, len);
+	}
+
+  private:
+	ProxyConnection &conn;
+};
+
 bool ProxyServer::handleReadEvent(Worker *worker, int fd,
 								  ProxyConnection &conn) {
-	char buffer[BUFFER_SIZE];
-	bool closed = false;
+	if (fd == conn.server_fd && conn.to_client.active())
+		return spliceRelay(worker, conn.server_fd, conn.client_fd,
+						   conn.to_client, worker->metrics.server_bytes);
+	if (fd == conn.client_fd && conn.to_server.active()) {
+		// пока идет connect(), данные клиента остаются в его сокете
+		if (conn.state != ConnState::Relaying)
+			return false;
+		return spliceRelay(worker, conn.client_fd, conn.server_fd,
+						   conn.to_server, worker->metrics.client_bytes);
+	}
+
+	bool from_client = fd == conn.client_fd;
+	ChunkBuffer &buf = from_client ? conn.client_buf : conn.server_buf;
+	// событие могло прийти в одной пачке с тем, что сняло EPOLLIN
+	if (from_client ? conn.client_throttled : conn.server_throttled)
+		return false;
+	size_t high_water = static_cast<size_t>(options.high_water_kb) * 1024;
 
 	while (true) {
-		ssize_t len = recv(fd, buffer, sizeof(buffer), 0);
+		if (buf.size() >= high_water) {
+			// остальное полежит в сокете источника, а TCP окно притормозит
+			// отправителя
+			throttleRead(worker, conn, from_client);
+			break;
+		}
+
+		// читаем сразу в кусок буфера, без промежуточного копирования
+		size_t space;
+		char *dst = buf.writable(space);
+		ssize_t len = recv(fd, dst, space, 0);
 		if (len < 0) {
 			if (errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
-			closed = true;
-			break;
+			return true;
 		} else if (len == 0) {
-			closed = true;
+			// сторона закрылась: если есть что дослать другой стороне,
+			// переходим в Closing и закрываемся после отправки
+			if (buf.empty() || conn.state != ConnState::Relaying)
+				return true;
+			conn.state = ConnState::Closing;
 			break;
-		} else {
-			if (fd == conn.client_fd) {
-				if (parser) {
-					parser->parseClientMessage(buffer, len);
+		}
+
+		buf.commit(len);
+		worker->metrics.relayed_chunks.fetch_add(1, std::memory_order_relaxed);
+		(from_client ? worker->metrics.client_bytes
+					 : worker->metrics.server_bytes)
+			.fetch_add(len, std::memory_order_relaxed);
+		// пишем сразу, не дожидаясь EPOLLOUT: если сокет не примет все,
+		// остаток уйдет по фронту EPOLLOUT
+		if (from_client) {
+			if (parser) {
+				conn.client_framer.feed(dst, len, conn.parser_session);
+				// все, что клиент прислал после ReadyForQuery, считается
+				// запросом до следующего ReadyForQuery
+				if (session_timeouts && conn.parser_session.startup_done &&
+					!conn.query_running) {
+					conn.query_running = true;
+					conn.cancel_sent = false;
+					conn.query_started = worker->loop_now;
 				}
-				conn.client_buf.append(buffer, len);
-				worker->updateEvents(conn.server_fd, conn.client_buf);
-			} else if (fd == conn.server_fd) {
-				conn.server_buf.append(buffer, len);
-				worker->updateEvents(conn.client_fd, conn.server_buf);
 			}
+			if (conn.state == ConnState::Relaying &&
+				flushBuffer(conn.server_fd, conn.client_buf))
+				return true;
+		} else {
+			if (conn.parser_session.queries.active() ||
+				(session_timeouts && conn.parser_session.startup_done)) {
+				ServerStreamSink sink(conn);
+				conn.server_framer.feed(dst, len, sink);
+			}
+			if (flushBuffer(conn.client_fd, conn.server_buf))
+				return true;
 		}
+		worker->metrics.buffer_occupancy.record(buf.size());
 	}
 
-	if (closed) {
-		closeConnection(worker, conn);
-		return true;
-	}
+	// кусок, взятый под recv(), который вернул EAGAIN, возвращаем в пул
+	if (buf.empty())
+		buf.clear();
 	return false;
 }
 
 bool ProxyServer::handleWriteEvent(Worker *worker, int fd,
 								   ProxyConnection &conn) {
+	if (fd == conn.server_fd && conn.to_server.active())
+		return spliceRelay(worker, conn.client_fd, conn.server_fd,
+						   conn.to_server, worker->metrics.client_bytes);
+	if (fd == conn.client_fd && conn.to_client.active())
+		return spliceRelay(worker, conn.server_fd, conn.client_fd,
+						   conn.to_client, worker->metrics.server_bytes);
+
 	bool closed = false;
 
-	if (fd == conn.server_fd && !conn.client_buf.empty()) {
-		while (!conn.client_buf.empty()) {
-			ssize_t sent = send(conn.server_fd, conn.client_buf.ptr(),
-								conn.client_buf.size(), 0);
-			if (sent < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					break;
-				closed = true;
-				break;
-			}
-			conn.client_buf.consume(sent);
-		}
-		worker->updateEvents(conn.server_fd, conn.client_buf);
+	size_t low_water = static_cast<size_t>(options.low_water_kb) * 1024;
+
+	if (fd == conn.server_fd) {
+		closed = flushBuffer(conn.server_fd, conn.client_buf);
+		if (!closed && conn.client_throttled &&
+			conn.client_buf.size() <= low_water)
+			resumeRead(worker, conn, true);
+	} else if (fd == conn.client_fd) {
+		closed = flushBuffer(conn.client_fd, conn.server_buf);
+		if (!closed && conn.server_throttled &&
+			conn.server_buf.size() <= low_water)
+			resumeRead(worker, conn, false);
 	}
 
-	if (fd == conn.client_fd && !conn.server_buf.empty()) {
-		while (!conn.server_buf.empty()) {
-			ssize_t sent = send(conn.client_fd, conn.server_buf.ptr(),
-								conn.server_buf.size(), 0);
-			if (sent < 0) {
-				if (errno == EAGAIN || errno == EWOULDBLOCK)
-					break;
-				closed = true;
-				break;
-			}
-			conn.server_buf.consume(sent);
-		}
-		worker->updateEvents(conn.client_fd, conn.server_buf);
+	if (conn.state == ConnState::Closing && conn.client_buf.empty() &&
+		conn.server_buf.empty())
+		closed = true;
+
+	return closed;
+}
+
+void ProxyServer::throttleRead(Worker *worker, ProxyConnection &conn,
+							   bool client_side) {
+	if (client_side) {
+		conn.client_throttled = true;
+		worker->updateEvents(conn.client_fd, conn.client_events,
+							 EPOLLOUT | EPOLLET, &conn.client_end);
+	} else {
+		conn.server_throttled = true;
+		worker->updateEvents(conn.server_fd, conn.server_events,
+							 EPOLLOUT | EPOLLET, &conn.server_end);
 	}
 
-	if (closed) {
-		closeConnection(worker, conn);
-		return true;
+	worker->metrics.throttles.fetch_add(1, std::memory_order_relaxed);
+	worker->metrics.throttled_now.fetch_add(1, std::memory_order_relaxed);
+	if (conn.throttle_count++ == 0)
+		worker->metrics.throttled_connections.fetch_add(
+			1, std::memory_order_relaxed);
+}
+
+void ProxyServer::resumeRead(Worker *worker, ProxyConnection &conn,
+							 bool client_side) {
+	// EPOLL_CTL_MOD заново проверяет готовность сокета, поэтому уже
+	// накопившиеся в нем данные придут отдельным событием EPOLLIN
+	if (client_side) {
+		conn.client_throttled = false;
+		worker->updateEvents(conn.client_fd, conn.client_events,
+							 RELAY_EVENTS, &conn.client_end);
+	} else {
+		conn.server_throttled = false;
+		worker->updateEvents(conn.server_fd, conn.server_events,
+							 RELAY_EVENTS, &conn.server_end);
 	}
-	return false;
+	worker->metrics.throttled_now.fetch_sub(1, std::memory_order_relaxed);
 }
 
 void ProxyServer::closeConnection(Worker *worker, ProxyConnection &conn) {
-	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn.client_fd, nullptr);
-	epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, conn.server_fd, nullptr);
+	if (conn.dead)
+		return;
+	conn.state = ConnState::Closing;
+	conn.dead = true;
 
+	// close() сам убирает сокет из epoll: fd не дублируются, поэтому
+	// EPOLL_CTL_DEL был бы лишним системным вызовом
+	worker->timers.cancel(conn.timer);
 	close(conn.client_fd);
 	close(conn.server_fd);
+	backends->release(conn.backend);
+	for (SplicePipe *pipe : {&conn.to_client, &conn.to_server}) {
+		if (pipe->active()) {
+			close(pipe->read_fd);
+			close(pipe->write_fd);
+		}
+	}
+
+	worker->metrics.active_connections.fetch_sub(1, std::memory_order_relaxed);
+	worker->metrics.throttled_now.fetch_sub(
+		conn.client_throttled + conn.server_throttled,
+		std::memory_order_relaxed);
+
+	worker->by_client_fd[conn.client_fd] = nullptr;
+	worker->dead_connections.push_back(&conn);
+}
 
-	worker->fd_to_owner.erase(conn.client_fd);
-	worker->fd_to_owner.erase(conn.server_fd);
-	worker->connections.erase(conn.client_fd);
+void ProxyServer::reapConnections(Worker *worker) {
+	for (ProxyConnection *conn : worker->dead_connections)
+		worker->connections.release(conn);
+	worker->dead_connections.clear();
 }
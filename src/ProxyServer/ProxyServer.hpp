@@ -1,113 +1,269 @@
 #pragma once
 #include <arpa/inet.h>
+#include <chrono>
 #include <cstring>
+#include <deque>
 #include <fcntl.h>
 #include <memory>
+#include <mutex>
 #include <netinet/in.h>
+#include <ostream>
 #include <queue>
 #include <string>
 #include <sys/epoll.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+#include "AuthFile.hpp"
+#include "Backends.hpp"
+#include "CancelSender.hpp"
+#include "ChunkBuffer.hpp"
+#include "HealthChecker.hpp"
+#include "Metrics.hpp"
+#include "MetricsServer.hpp"
 #include "Parser.hpp"
+#include "ProxyOptions.hpp"
+#include "Slab.hpp"
+#include "TimerWheel.hpp"
 
 #define BUFFER_SIZE 8192
 #define MAX_EVENTS 1024
 
-struct Buffer {
-	std::vector<char> data;
-	size_t offset = 0;
+// Маска, с которой сокеты соединения регистрируются в epoll один раз.
+// EPOLLOUT в режиме EPOLLET срабатывает только при освобождении места в
+// буфере сокета, поэтому держать его включенным постоянно ничего не стоит.
+constexpr uint32_t RELAY_EVENTS = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
 
-	bool empty() const { return offset >= data.size(); }
+// Канал для splice(): байты идут сокет -> pipe -> сокет без копирования в
+// пространство пользователя. bytes - сколько сейчас лежит в канале.
+struct SplicePipe {
+	int read_fd = -1;
+	int write_fd = -1;
+	size_t capacity = 0;
+	size_t bytes = 0;
+	bool source_eof = false;
 
-	size_t size() const { return data.size() - offset; }
+	bool active() const { return read_fd >= 0; }
+};
 
-	const char *ptr() const { return data.data() + offset; }
+using Clock = std::chrono::steady_clock;
 
-	void consume(size_t n) {
-		offset += n;
-		if (offset >= data.size()) {
-			clear();
-		}
-	}
+// Connecting: ждем завершения неблокирующего connect() к PostgreSQL,
+// данные клиента копятся в client_buf.
+// Relaying: обычная пересылка в обе стороны.
+// Closing: одна из сторон закрылась, досылаем оставшееся и закрываем.
+enum class ConnState { Connecting, Relaying, Closing };
 
-	void append(const char *src, size_t n) {
-		data.insert(data.end(), src, src + n);
-	}
+struct ProxyConnection;
 
-	void clear() {
-		data.clear();
-		offset = 0;
-	}
+// На что указывает epoll_event.data.ptr в epoll-цикле сессий: сторона
+// соединения или служебный fd воркера (тогда conn == nullptr)
+struct EpollEndpoint {
+	ProxyConnection *conn = nullptr;
+	bool client_side = false;
 };
 
+// Живет в Worker::connections, адрес не меняется до освобождения
 struct ProxyConnection {
 	int client_fd;
 	int server_fd;
-	Buffer client_buf;
-	Buffer server_buf;
+	EpollEndpoint client_end{this, true};
+	EpollEndpoint server_end{this, false};
+	// номер сервера в Backends
+	int backend = -1;
+	ConnState state = ConnState::Connecting;
+	Clock::time_point connect_started;
+	MessageFramer client_framer{true};
+	ParserSession parser_session;
+	// ответы сервера для parser_session.queries (--query-stats)
+	MessageFramer server_framer;
+	ChunkBuffer client_buf;
+	ChunkBuffer server_buf;
+	// чтение стороны остановлено (EPOLLIN снят): ее буфер дошел до
+	// --high-water-kb и возобновится ниже --low-water-kb
+	bool client_throttled = false;
+	bool server_throttled = false;
+	unsigned throttle_count = 0;
+	// активны только в режиме --splice; направление, идущее через pipe,
+	// не использует соответствующий ChunkBuffer
+	SplicePipe to_client;
+	SplicePipe to_server;
+	// маски, с которыми сокеты сейчас зарегистрированы в epoll (0 - нет)
+	uint32_t client_events = 0;
+	uint32_t server_events = 0;
+	// сокеты закрыты; место в слабе освобождается после пачки событий,
+	// в которой еще могут быть события этого соединения
+	bool dead = false;
+	// начало пачки событий, в которой было последнее событие соединения
+	Clock::time_point last_active;
+	// Один таймер на все сроки соединения. Активность только обновляет
+	// отметки времени, сроки пересчитываются при срабатывании.
+	Timer<ProxyConnection> timer{this};
+	// по разбору потоков (таймауты сессии): клиент что-то прислал после
+	// последнего ReadyForQuery, статус транзакции из него и BackendKeyData
+	// сервера для CancelRequest
+	bool query_running = false;
+	bool cancel_sent = false;
+	Clock::time_point query_started;
+	char tx_status = 'I';
+	uint32_t backend_pid = 0;
+	uint32_t backend_key = 0;
+};
+
+struct PendingConnection {
+	int client_fd;
+	int server_fd;
+	Clock::time_point connect_started;
+	int backend = -1;
 };
 
 struct Worker {
 	int epoll_fd;
+	// собственный SO_REUSEPORT сокет в режиме --reuseport, иначе -1
+	int listen_fd = -1;
+	// процессор из --cpu-list или -1
+	int cpu = -1;
+	// eventfd: общий поток приема будит воркер после постановки в очередь
+	int wake_fd = -1;
 	std::thread thread;
 	std::mutex mutex;
-	std::queue<std::pair<int, int>> new_connections; // (client_fd, server_fd)
-	std::condition_variable cv;
-	std::unordered_map<int, ProxyConnection> connections;
-	std::unordered_map<int, int> fd_to_owner;
+	std::queue<PendingConnection> new_connections;
+	// сессии, отданные другим воркером (--rebalance-ms), тоже под mutex
+	std::vector<std::unique_ptr<ProxyConnection>> migrated;
+	// запрос потока приема: отдать до migrate_count простаивающих сессий
+	// воркеру migrate_to
+	std::atomic<size_t> migrate_to{0};
+	std::atomic<unsigned> migrate_count{0};
+	// с какого client_fd продолжить поиск простаивающих сессий
+	size_t migrate_cursor = 0;
+	// момент пробуждения цикла, общий для всей пачки событий
+	Clock::time_point loop_now;
+	EpollEndpoint listen_end;
+	EpollEndpoint wake_end;
+	// объявлен раньше connections: буферы соединений возвращают куски в пул
+	ChunkPool chunk_pool;
+	Slab<ProxyConnection> connections;
+	// соединение по client_fd, nullptr - нет
+	std::vector<ProxyConnection *> by_client_fd;
+	// закрытые в текущей пачке событий
+	std::vector<ProxyConnection *> dead_connections;
+	// таймауты соединений epoll-цикла сессий
+	TimerWheel<ProxyConnection> timers;
+	WorkerMetrics metrics;
+	// только при --query-stats
+	std::unique_ptr<QueryStats> query_stats;
+
+	// epoll_ctl() только если маска действительно меняется. Без endpoint
+	// в data кладется сам fd (цикл пула ищет по нему).
+	void updateEvents(int socket, uint32_t &registered, uint32_t events,
+					  EpollEndpoint *endpoint = nullptr) {
+		if (registered == events)
+			return;
 
-	void updateEvents(int socket, const Buffer &out_buf) {
 		epoll_event ev{};
-		ev.events = EPOLLIN | EPOLLET;
-		if (!out_buf.empty())
-			ev.events |= EPOLLOUT;
-		ev.data.fd = socket;
-
-		if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, socket, &ev) < 0) {
-			if (errno == ENOENT) {
-				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket, &ev);
-			} else {
-				perror("epoll_ctl MOD failed");
-			}
+		ev.events = events;
+		if (endpoint)
+			ev.data.ptr = endpoint;
+		else
+			ev.data.fd = socket;
+		int op = registered == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+		metrics.epoll_ctl_calls.fetch_add(1, std::memory_order_relaxed);
+		if (epoll_ctl(epoll_fd, op, socket, &ev) < 0) {
+			perror("epoll_ctl() failed");
+			return;
 		}
+		registered = events;
 	}
 };
 
+// Загрузка воркера по последнему замеру потока приема
+struct WorkerLoad {
+	uint64_t busy_ns = 0;
+	uint64_t bytes = 0;
+	// доля времени цикла вне ожидания, 0..1000, сглаженная
+	uint32_t busy_permille = 0;
+	uint64_t bytes_per_sec = 0;
+	// соединений отдано после замера: active_connections их еще не видит
+	unsigned assigned = 0;
+};
+
 class ProxyServer {
   private:
-	int pg_port;
-	std::string pg_host;
+	ProxyOptions options;
 
-	int listen_port;
-	int listen_fd;
+	int listen_fd = -1;
+	int signal_fd = -1;
 
 	int epoll_fd;
 	epoll_event ev{};
 	epoll_event events[MAX_EVENTS];
 
-	std::unordered_map<int, ProxyConnection> connections;
-	std::unordered_map<int, int> fd_to_owner;
 	std::vector<std::unique_ptr<Worker>> workers;
-	int next_worker = 0;
-	int num_threads = 6;
+	// с какого воркера pickWorker() начинает перебор
+	size_t next_worker = 0;
+	// заполняются только потоком приема
+	std::vector<WorkerLoad> loads;
+	Clock::time_point loads_sampled;
+	// timerfd для --rebalance-ms
+	int rebalance_fd = -1;
 	Parser *parser = nullptr;
+	AuthFile auth_file;
+	// --metrics-port, обслуживается в цикле run()
+	std::unique_ptr<MetricsServer> metrics_server;
+	std::unique_ptr<Backends> backends;
+	// --health-interval-ms, тоже в цикле run()
+	std::unique_ptr<HealthChecker> health_checker;
+	// --query-timeout-ms: CancelRequest отправляются из цикла run()
+	std::unique_ptr<CancelSender> cancel_sender;
+	// epoll-цикл сессий следит за запросами и транзакциями для
+	// --client-idle-timeout-ms и других таймаутов сессии
+	bool session_timeouts = false;
 
   public:
 	ProxyServer(int argc, char *argv[]);
 
 	void run();
 	void attachParser(Parser *parser);
+	const ProxyOptions &getOptions() const { return options; }
+	void reportMetrics(std::ostream &out) const;
+	// те же метрики в текстовом формате Prometheus
+	void reportPrometheus(std::ostream &out) const;
+	void reportQueryStats(const std::string &path) const;
 
   private:
 	void workerLoop(Worker *worker);
 	void initializeServer(int argc, char *argv[]);
 	void setNonblocking(int fd);
+	int createListenSocket(bool reuseport);
 	void acceptNewConnections();
-	int connectToPg();
+	void acceptWorkerConnections(Worker *worker);
+	void drainNewConnections(Worker *worker);
+	void sampleLoads(bool force);
+	// воркер для нового соединения с наименьшей загрузкой
+	Worker *pickWorker();
+	void rebalance();
+	void migrateIdle(Worker *worker);
+	void adoptConnection(Worker *worker,
+						 std::unique_ptr<ProxyConnection> moved);
+	// connect() к наименее нагруженному основному серверу, его номер -
+	// в backend
+	int connectToPg(int &backend);
+	void registerConnection(Worker *worker, const PendingConnection &pending);
+	bool completeConnect(Worker *worker, ProxyConnection &conn);
+	// ставит таймер соединения на ближайший срок, если тот раньше
+	void armTimeouts(Worker *worker, ProxyConnection &conn);
+	void onTimer(Worker *worker, ProxyConnection &conn);
+	void closeTimedOut(Worker *worker, ProxyConnection &conn,
+					   std::string_view sqlstate, std::string_view message);
 	bool handleReadEvent(Worker *worker, int fd, ProxyConnection &conn);
 	bool handleWriteEvent(Worker *worker, int fd, ProxyConnection &conn);
+	void throttleRead(Worker *worker, ProxyConnection &conn, bool client_side);
+	void resumeRead(Worker *worker, ProxyConnection &conn, bool client_side);
+	bool openSplicePipe(SplicePipe &pipe);
+	bool spliceRelay(Worker *worker, int src_fd, int dst_fd, SplicePipe &pipe,
+					 std::atomic<uint64_t> &relayed_bytes);
 	void closeConnection(Worker *worker, ProxyConnection &conn);
+	void reapConnections(Worker *worker);
 };
\ No newline at end of file
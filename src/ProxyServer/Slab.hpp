@@ -0,0 +1,73 @@
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Объекты T одного воркера в блоках фиксированного размера. Адрес объекта
+// не меняется до release(), поэтому на него можно ссылаться из
+// epoll_event.data.ptr. Как и ChunkPool, память у кучи берется пачками и
+// обратно не отдается, освобожденные места идут в список свободных. Без
+// блокировок: пользуется только поток воркера.
+template <typename T, size_t SLOTS_PER_BLOCK = 64> class Slab {
+  public:
+	Slab() = default;
+	Slab(const Slab &) = delete;
+	Slab &operator=(const Slab &) = delete;
+
+	~Slab() {
+		for (auto &block : blocks) {
+			for (size_t i = 0; i < SLOTS_PER_BLOCK; ++i) {
+				if (block[i].live)
+					block[i].value()->~T();
+			}
+		}
+	}
+
+	template <typename... Args> T *acquire(Args &&...args) {
+		if (!free_list)
+			grow();
+		Slot *slot = free_list;
+		free_list = slot->next;
+		T *value = new (slot->storage) T(std::forward<Args>(args)...);
+		slot->live = true;
+		++live_count;
+		return value;
+	}
+
+	void release(T *value) {
+		// storage - первый член Slot, адреса совпадают
+		Slot *slot = reinterpret_cast<Slot *>(value);
+		value->~T();
+		slot->live = false;
+		slot->next = free_list;
+		free_list = slot;
+		--live_count;
+	}
+
+	size_t size() const { return live_count; }
+
+  private:
+	struct Slot {
+		alignas(T) unsigned char storage[sizeof(T)];
+		Slot *next = nullptr;
+		bool live = false;
+
+		T *value() { return std::launder(reinterpret_cast<T *>(storage)); }
+	};
+
+	void grow() {
+		blocks.emplace_back(new Slot[SLOTS_PER_BLOCK]);
+		Slot *block = blocks.back().get();
+		// в обратном порядке, чтобы места выдавались по возрастанию адресов
+		for (size_t i = SLOTS_PER_BLOCK; i > 0; --i) {
+			block[i - 1].next = free_list;
+			free_list = &block[i - 1];
+		}
+	}
+
+	std::vector<std::unique_ptr<Slot[]>> blocks;
+	Slot *free_list = nullptr;
+	size_t live_count = 0;
+};
@@ -0,0 +1,197 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+
+// Узел таймера, встроенный во владельца: постановка и снятие не выделяют
+// память. Владелец не должен освобождаться со стоящим таймером.
+template <typename Owner> struct Timer {
+	Owner *owner = nullptr;
+	Timer *prev = nullptr;
+	Timer *next = nullptr;
+	// срок в тиках колеса
+	uint64_t expires = 0;
+	// уровень * SLOTS + слот, -1 - не стоит
+	int slot = -1;
+
+	bool armed() const { return slot >= 0; }
+};
+
+// Иерархическое колесо таймеров одного воркера (Varghese, Lauck): LEVELS
+// уровней по SLOTS слотов, тик - 1 мс. Таймер лежит на уровне старшей
+// группы битов, в которой его срок отличается от текущего тика, и
+// спускается ниже, когда колесо доходит до его слота. Постановка и снятие -
+// O(1), ближайший срок находится по битовым маскам занятых слотов.
+template <typename Owner> class TimerWheel {
+  public:
+	using Clock = std::chrono::steady_clock;
+
+	TimerWheel() : start(Clock::now()) {}
+	TimerWheel(const TimerWheel &) = delete;
+	TimerWheel &operator=(const TimerWheel &) = delete;
+
+	// поставить таймер на when (уже стоящий переставляется); срок
+	// округляется вверх до тика, раньше when таймер не срабатывает
+	void schedule(Timer<Owner> &timer, Clock::time_point when) {
+		cancel(timer);
+		timer.expires = tickAt(when);
+		place(timer);
+	}
+
+	// переставить, только если when раньше текущего срока
+	void scheduleEarlier(Timer<Owner> &timer, Clock::time_point when) {
+		if (!timer.armed() || tickAt(when) < timer.expires)
+			schedule(timer, when);
+	}
+
+	void cancel(Timer<Owner> &timer) {
+		if (!timer.armed())
+			return;
+		Timer<Owner> *&head = slots[timer.slot];
+		if (timer.prev)
+			timer.prev->next = timer.next;
+		else
+			head = timer.next;
+		if (timer.next)
+			timer.next->prev = timer.prev;
+		if (!head)
+			masks[timer.slot / SLOTS] &= ~(1ULL << (timer.slot % SLOTS));
+		timer.prev = timer.next = nullptr;
+		timer.slot = -1;
+	}
+
+	// Вызывает on_expire(Owner &) для всех таймеров со сроком не позже
+	// now. Обработчик может ставить и снимать любые таймеры. Пустые тики
+	// пропускаются.
+	template <typename OnExpire>
+	void advance(Clock::time_point now, OnExpire on_expire) {
+		uint64_t target = tickFloor(now);
+		while (true) {
+			uint64_t next = nextTick();
+			if (next > target) {
+				current = std::max(current, target + 1);
+				return;
+			}
+			current = next;
+			// каскад сверху вниз: в слот текущего тика каждого уровня
+			for (unsigned level = LEVELS - 1; level > 0; --level) {
+				if (current & ((1ULL << (level * SLOT_BITS)) - 1))
+					continue;
+				unsigned index = level * SLOTS +
+								 ((current >> (level * SLOT_BITS)) & SLOT_MASK);
+				while (Timer<Owner> *timer = slots[index]) {
+					cancel(*timer);
+					place(*timer);
+				}
+			}
+			unsigned index = current & SLOT_MASK;
+			while (Timer<Owner> *timer = slots[index]) {
+				cancel(*timer);
+				// положен в верхний слот с урезанным сроком
+				if (timer->expires > current) {
+					place(*timer);
+					continue;
+				}
+				on_expire(*timer->owner);
+			}
+			++current;
+		}
+	}
+
+	// миллисекунды до ближайшего срабатывания или спуска уровня для
+	// epoll_wait(), -1 - таймеров нет
+	int timeoutMs(Clock::time_point now) const {
+		uint64_t next = nextTick();
+		if (next == UINT64_MAX)
+			return -1;
+		uint64_t now_tick = tickFloor(now);
+		if (next <= now_tick)
+			return 0;
+		return static_cast<int>(std::min<uint64_t>(next - now_tick, INT32_MAX));
+	}
+
+  private:
+	static constexpr unsigned SLOT_BITS = 6;
+	static constexpr unsigned SLOTS = 1 << SLOT_BITS;
+	static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+	static constexpr unsigned LEVELS = 4;
+	// 2^24 мс - около 4,6 часа
+	static constexpr unsigned SPAN_BITS = SLOT_BITS * LEVELS;
+	static constexpr uint64_t FAR =
+		(1ULL << SPAN_BITS) - (1ULL << (SPAN_BITS - SLOT_BITS));
+
+	uint64_t tickFloor(Clock::time_point t) const {
+		if (t <= start)
+			return 0;
+		return std::chrono::duration_cast<std::chrono::milliseconds>(t - start)
+			.count();
+	}
+
+	uint64_t tickAt(Clock::time_point t) const {
+		if (t <= start)
+			return 0;
+		auto us =
+			std::chrono::duration_cast<std::chrono::microseconds>(t - start)
+				.count();
+		return (us + 999) / 1000;
+	}
+
+	void place(Timer<Owner> &timer) {
+		uint64_t expires = std::max(timer.expires, current);
+		uint64_t diff = expires ^ current;
+		unsigned level = 0;
+		while (level + 1 < LEVELS && (diff >> ((level + 1) * SLOT_BITS)))
+			++level;
+		unsigned index =
+			level * SLOTS + ((expires >> (level * SLOT_BITS)) & SLOT_MASK);
+		// Срок в следующем обороте старшего уровня ложится в слот позади
+		// текущего. Дальше оборота - в самый дальний слот, откуда таймер
+		// переоценится.
+		if (expires - current >= FAR)
+			index = level * SLOTS +
+					((current >> (level * SLOT_BITS)) + SLOT_MASK) % SLOTS;
+
+		Timer<Owner> *&head = slots[index];
+		timer.prev = nullptr;
+		timer.next = head;
+		if (head)
+			head->prev = &timer;
+		head = &timer;
+		timer.slot = static_cast<int>(index);
+		masks[level] |= 1ULL << (index % SLOTS);
+	}
+
+	// тик, в который колесо должно обработать ближайший занятый слот
+	uint64_t nextTick() const {
+		uint64_t best = UINT64_MAX;
+		for (unsigned level = 0; level < LEVELS; ++level) {
+			unsigned shift = level * SLOT_BITS;
+			unsigned position = (current >> shift) & SLOT_MASK;
+			// текущий слот уровня выше нулевого уже спущен, если current
+			// не стоит ровно на его начале
+			bool pending = level == 0 || (current & ((1ULL << shift) - 1)) == 0;
+			unsigned from = pending ? position : position + 1;
+			unsigned above = shift + SLOT_BITS;
+			uint64_t base = (current >> above) << above;
+			uint64_t occupied =
+				from < SLOTS ? masks[level] & (~0ULL << from) : 0;
+			// слоты позади текущего бывают только у дальних таймеров
+			// старшего уровня и относятся к следующему обороту
+			if (!occupied && level == LEVELS - 1 && masks[level]) {
+				occupied = masks[level];
+				base += 1ULL << SPAN_BITS;
+			}
+			if (!occupied)
+				continue;
+			uint64_t slot = __builtin_ctzll(occupied);
+			best = std::min(best, base | (slot << shift));
+		}
+		return best;
+	}
+
+	Clock::time_point start;
+	// первый необработанный тик
+	uint64_t current = 0;
+	Timer<Owner> *slots[LEVELS * SLOTS] = {};
+	uint64_t masks[LEVELS] = {};
+};
@@ -0,0 +1,574 @@
+#include "UringLoop.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+constexpr unsigned URING_ENTRIES = 4096;
+constexpr unsigned URING_BUFFERS = 1024;
+constexpr uint16_t BUFFER_GROUP = 0;
+// сколько send связывать в одну цепочку IOSQE_IO_LINK
+constexpr size_t MAX_LINKED_SENDS = 16;
+// после стольких неотправленных кусков recv источника приостанавливается
+constexpr size_t MAX_QUEUED_CHUNKS = 64;
+// буферов должно освободиться хотя бы столько, чтобы перезапускать recv,
+// завершенные с -ENOBUFS
+constexpr unsigned MIN_FREE_BUFFERS = 16;
+
+UringLoop::UringLoop(Worker *worker, const ProxyOptions &options,
+					 Parser *const &parser, Backends &backends)
+	: worker(worker), options(options), parser(parser), backends(backends),
+	  ring(URING_ENTRIES) {
+	buffer_memory.resize(static_cast<size_t>(URING_BUFFERS) * BUFFER_SIZE);
+	recycled.reserve(URING_BUFFERS);
+
+	buf_ring = ring.registerBufferRing(BUFFER_GROUP, URING_BUFFERS);
+	if (buf_ring != nullptr && !probeBufferRing()) {
+		static std::atomic_flag reported = ATOMIC_FLAG_INIT;
+		if (!reported.test_and_set())
+			fprintf(stderr, "io_uring: recv from the registered buffer ring "
+							"failed, using IORING_OP_PROVIDE_BUFFERS\n");
+		ring.unregisterBufferRing(BUFFER_GROUP);
+		buf_ring = nullptr;
+		free_buffers = 0;
+		recycled.clear();
+	}
+	for (unsigned bid = 0; bid < URING_BUFFERS; ++bid)
+		recycled.push_back(static_cast<uint16_t>(bid));
+	tick.tv_nsec = 100 * 1000 * 1000;
+}
+
+void UringLoop::run() {
+	if (worker->listen_fd >= 0)
+		armAccept();
+	if (worker->wake_fd >= 0)
+		armWake();
+	armTimer();
+	provideBuffers();
+
+	while (true) {
+		if (ring.submit(1) < 0 && errno != EBUSY && errno != EAGAIN) {
+			perror("io_uring_enter() failed");
+			continue;
+		}
+		auto started = Clock::now();
+
+		bool woke = false;
+		while (io_uring_cqe *cqe = ring.peekCqe()) {
+			woke = true;
+			uint64_t user_data = cqe->user_data;
+			int res = cqe->res;
+			unsigned flags = cqe->flags;
+			ring.cqeSeen();
+			handleCqe(user_data, res, flags);
+		}
+		if (woke)
+			worker->metrics.wakeups.fetch_add(1, std::memory_order_relaxed);
+
+		provideBuffers();
+		rearmStarved();
+		worker->metrics.busy_ns.fetch_add(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+																 started)
+				.count(),
+			std::memory_order_relaxed);
+	}
+}
+
+void UringLoop::armAccept() {
+	io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = worker->listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	sqe->user_data = userData(nullptr, ACCEPT);
+}
+
+void UringLoop::armWake() {
+	io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = worker->wake_fd;
+	sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+	sqe->len = sizeof(wake_value);
+	sqe->user_data = userData(nullptr, WAKE);
+}
+
+void UringLoop::armTimer() {
+	io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = reinterpret_cast<uint64_t>(&tick);
+	sqe->len = 1;
+	sqe->user_data = userData(nullptr, TIMER);
+}
+
+bool UringLoop::probeBufferRing() {
+	// Регистрация кольца проходит и там, где recv из него не работает: на
+	// ядре 6.18.44 виртуальной машины, где писался этот цикл, recv из кольца
+	// с опубликованным tail завершался с -ENOBUFS, а head кольца по
+	// IORING_REGISTER_PBUF_STATUS оставался 0; PROVIDE_BUFFERS там работает.
+	recycleBuffer(0);
+	provideBuffers();
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+		return false;
+	bool ok = false;
+	char byte = 0;
+	if (write(fds[1], &byte, 1) == 1) {
+		io_uring_sqe *sqe = ring.getSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fds[0];
+		sqe->len = 1;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = BUFFER_GROUP;
+		// других операций еще нет, CQE разбирается здесь же
+		sqe->user_data = 0;
+		if (ring.submit(1) >= 0) {
+			if (io_uring_cqe *cqe = ring.peekCqe()) {
+				// буфер 0 остается у нас: его отдаст ядру конструктор
+				ok = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER);
+				if (ok)
+					--free_buffers;
+				ring.cqeSeen();
+			}
+		}
+	}
+	close(fds[0]);
+	close(fds[1]);
+	return ok;
+}
+
+void UringLoop::provideBuffers() {
+	if (recycled.empty())
+		return;
+
+	if (buf_ring != nullptr) {
+		// буферы возвращаются ядру записями в кольцо без SQE
+		for (uint16_t bid : recycled) {
+			io_uring_buf &entry =
+				buf_ring->bufs[buf_ring_tail & (URING_BUFFERS - 1)];
+			entry.addr = reinterpret_cast<uint64_t>(buffer(bid));
+			entry.len = BUFFER_SIZE;
+			entry.bid = bid;
+			++buf_ring_tail;
+		}
+		// tail лежит в поле resv записи 0 и публикуется после записей
+		__atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+		free_buffers += recycled.size();
+		recycled.clear();
+		return;
+	}
+
+	// Один PROVIDE_BUFFERS отдает ядру подряд идущие буферы с подряд
+	// идущими номерами.
+	std::sort(recycled.begin(), recycled.end());
+	size_t start = 0;
+	while (start < recycled.size()) {
+		size_t end = start + 1;
+		while (end < recycled.size() &&
+			   recycled[end] == recycled[end - 1] + 1)
+			++end;
+
+		io_uring_sqe *sqe = ring.getSqe();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = static_cast<int>(end - start);
+		sqe->addr = reinterpret_cast<uint64_t>(buffer(recycled[start]));
+		sqe->len = BUFFER_SIZE;
+		sqe->off = recycled[start];
+		sqe->buf_group = BUFFER_GROUP;
+		// CQE приходит только при ошибке, диапазон тогда берется из
+		// user_data
+		sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+		sqe->user_data = (static_cast<uint64_t>(recycled[start]) << 32 |
+						  (end - start) << 4) |
+						 PROVIDE;
+		free_buffers += end - start;
+		start = end;
+	}
+	recycled.clear();
+}
+
+void UringLoop::armRecv(UringConnection &conn, bool client_side) {
+	UringDirection &dir = client_side ? conn.to_server : conn.to_client;
+	if (free_buffers == 0) {
+		// перезапустится из rearmStarved(), когда буферы освободятся
+		starved.emplace_back(conn.client_fd, client_side);
+		return;
+	}
+
+	// один recv на все чтения сокета: каждое приходит отдельным CQE с
+	// IORING_CQE_F_MORE и номером выбранного ядром буфера
+	io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = client_side ? conn.client_fd : conn.server_fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->user_data = userData(&conn, client_side ? RECV_CLIENT : RECV_SERVER);
+	dir.recv_armed = true;
+	dir.recv_paused = false;
+	++conn.inflight;
+}
+
+void UringLoop::cancel(UringConnection &conn, uint64_t target) {
+	io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = target;
+	sqe->user_data = userData(&conn, CANCEL);
+	++conn.inflight;
+}
+
+void UringLoop::kickSends(UringConnection &conn, bool to_server) {
+	UringDirection &dir = to_server ? conn.to_server : conn.to_client;
+	if (dir.sends_inflight > 0 || dir.queue.empty() || conn.dead)
+		return;
+	if (to_server && conn.state == ConnState::Connecting)
+		return;
+
+	// send-ы одной цепочки выполняются строго по порядку. С MSG_WAITALL
+	// короткая отправка обрывает цепочку, и следующий кусок не уйдет раньше
+	// остатка предыдущего: остаток отправит новая цепочка из onSend()
+	size_t n = std::min(dir.queue.size(), MAX_LINKED_SENDS);
+	ring.reserveSqes(n);
+	for (size_t i = 0; i < n; ++i) {
+		const UringChunk &chunk = dir.queue[i];
+		io_uring_sqe *sqe = ring.getSqe();
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = to_server ? conn.server_fd : conn.client_fd;
+		sqe->addr = reinterpret_cast<uint64_t>(buffer(chunk.bid) + chunk.sent);
+		sqe->len = chunk.len - chunk.sent;
+		sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+		if (i + 1 < n)
+			sqe->flags = IOSQE_IO_LINK;
+		sqe->user_data = userData(&conn, to_server ? SEND_SERVER : SEND_CLIENT);
+		++dir.sends_inflight;
+		++conn.inflight;
+	}
+}
+
+void UringLoop::handleCqe(uint64_t user_data, int res, unsigned flags) {
+	Op op = static_cast<Op>(user_data & 0xF);
+	auto *conn = reinterpret_cast<UringConnection *>(user_data & ~0xFULL);
+
+	switch (op) {
+	case ACCEPT:
+		onAccept(res, flags);
+		return;
+	case WAKE:
+		onWake();
+		return;
+	case TIMER:
+		expireConnects();
+		armTimer();
+		return;
+	case PROVIDE: {
+		errno = -res;
+		perror("IORING_OP_PROVIDE_BUFFERS failed");
+		// буферы остались у нас, отдаем их еще раз
+		uint16_t first = user_data >> 32;
+		unsigned count = (user_data & 0xFFFFFFFFULL) >> 4;
+		free_buffers -= count;
+		for (unsigned i = 0; i < count; ++i)
+			recycleBuffer(static_cast<uint16_t>(first + i));
+		return;
+	}
+	default:
+		break;
+	}
+
+	// многоразовый recv остается в ядре, пока в CQE стоит IORING_CQE_F_MORE
+	bool recv = op == RECV_CLIENT || op == RECV_SERVER;
+	if (!recv || !(flags & IORING_CQE_F_MORE))
+		--conn->inflight;
+
+	switch (op) {
+	case RECV_CLIENT:
+	case RECV_SERVER:
+		onRecv(*conn, op == RECV_CLIENT, res, flags);
+		break;
+	case SEND_SERVER:
+	case SEND_CLIENT:
+		onSend(*conn, op == SEND_SERVER, res);
+		break;
+	case CONNECT:
+		onConnect(*conn, res);
+		break;
+	default:
+		break;
+	}
+
+	releaseIfDone(*conn);
+}
+
+void UringLoop::onAccept(int res, unsigned flags) {
+	if (!(flags & IORING_CQE_F_MORE))
+		armAccept();
+	if (res < 0) {
+		if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+			errno = -res;
+			perror("accept failed");
+		}
+		return;
+	}
+
+	worker->metrics.accepts.fetch_add(1, std::memory_order_relaxed);
+	PendingConnection pending{res, -1, Clock::now()};
+	pending.backend = backends.pickByConnections(BackendRole::Primary);
+	pending.server_fd = backends.connect(pending.backend);
+	if (pending.server_fd < 0) {
+		perror("connect() failed");
+		close(res);
+		return;
+	}
+	registerConnection(pending);
+}
+
+void UringLoop::onWake() {
+	std::lock_guard<std::mutex> lock(worker->mutex);
+	while (!worker->new_connections.empty()) {
+		registerConnection(worker->new_connections.front());
+		worker->new_connections.pop();
+	}
+	armWake();
+}
+
+void UringLoop::registerConnection(const PendingConnection &pending) {
+	auto [it, inserted] =
+		connections.try_emplace(pending.client_fd, pending.client_fd,
+								pending.server_fd);
+	UringConnection &conn = it->second;
+	conn.backend = pending.backend;
+	conn.connect_started = pending.connect_started;
+	conn.parser_session = ParserSession(parser, worker->query_stats.get());
+
+	armRecv(conn, true);
+
+	// завершение неблокирующего connect() ждем через poll на запись
+	io_uring_sqe *sqe = ring.getSqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = conn.server_fd;
+	sqe->poll32_events = POLLOUT;
+	sqe->user_data = userData(&conn, CONNECT);
+	++conn.inflight;
+
+	if (options.connect_timeout_ms > 0)
+		connect_deadlines.emplace_back(pending.connect_started,
+									   pending.client_fd);
+	worker->metrics.active_connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+void UringLoop::onConnect(UringConnection &conn, int res) {
+	if (conn.dead)
+		return;
+
+	int err = res < 0 ? -res : 0;
+	socklen_t err_len = sizeof(err);
+	if (err == 0 &&
+		getsockopt(conn.server_fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0)
+		err = errno;
+	if (err != 0) {
+		worker->metrics.connect_failures.fetch_add(1,
+												   std::memory_order_relaxed);
+		backends.connectFailed(conn.backend);
+		shutdownConnection(conn);
+		return;
+	}
+
+	auto elapsed = Clock::now() - conn.connect_started;
+	worker->metrics.connect_latency.record(
+		std::chrono::duration_cast<std::chrono::microseconds>(elapsed)
+			.count());
+
+	conn.state = ConnState::Relaying;
+	armRecv(conn, false);
+	kickSends(conn, true);
+}
+
+void UringLoop::onRecv(UringConnection &conn, bool client_side, int res,
+					   unsigned flags) {
+	UringDirection &dir = client_side ? conn.to_server : conn.to_client;
+	if (!(flags & IORING_CQE_F_MORE))
+		dir.recv_armed = false;
+
+	if (flags & IORING_CQE_F_BUFFER) {
+		uint16_t bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		--free_buffers;
+		if (res > 0 && !conn.dead && conn.state != ConnState::Closing) {
+			worker->metrics.relayed_chunks.fetch_add(
+				1, std::memory_order_relaxed);
+			if (client_side && parser)
+				conn.client_framer.feed(buffer(bid), res,
+										conn.parser_session);
+			else if (!client_side && conn.parser_session.queries.active())
+				conn.server_framer.feed(buffer(bid), res,
+										conn.parser_session.queries);
+			dir.queue.push_back({bid, static_cast<uint32_t>(res)});
+			dir.queued_bytes += res;
+			(client_side ? worker->metrics.client_bytes
+						 : worker->metrics.server_bytes)
+				.fetch_add(res, std::memory_order_relaxed);
+			worker->metrics.buffer_occupancy.record(dir.queued_bytes);
+			kickSends(conn, client_side);
+		} else {
+			recycleBuffer(bid);
+		}
+	}
+
+	if (conn.dead)
+		return;
+
+	if (res == 0) {
+		// сторона закрылась: досылаем накопленное другой стороне
+		if (dir.queue.empty() || conn.state != ConnState::Relaying)
+			shutdownConnection(conn);
+		else
+			conn.state = ConnState::Closing;
+		return;
+	}
+	if (res == -ENOBUFS) {
+		// свободные буферы у ядра кончились, recv снят
+		starved.emplace_back(conn.client_fd, client_side);
+		return;
+	}
+	// -ECANCELED - recv снят ради паузы
+	if (res < 0 && res != -EINTR && res != -EAGAIN && res != -ECANCELED) {
+		shutdownConnection(conn);
+		return;
+	}
+
+	if (dir.queue.size() >= MAX_QUEUED_CHUNKS) {
+		// многоразовый recv читал бы дальше, поэтому снимается; запустится
+		// снова из onSend(), когда очередь разгрузится
+		if (dir.recv_armed && !dir.recv_paused)
+			cancel(conn, userData(&conn, client_side ? RECV_CLIENT
+													 : RECV_SERVER));
+		dir.recv_paused = true;
+	} else if (!dir.recv_armed && conn.state != ConnState::Closing &&
+			   (!dir.recv_paused ||
+				dir.queue.size() < MAX_QUEUED_CHUNKS / 2)) {
+		armRecv(conn, client_side);
+	}
+}
+
+void UringLoop::onSend(UringConnection &conn, bool to_server, int res) {
+	UringDirection &dir = to_server ? conn.to_server : conn.to_client;
+	--dir.sends_inflight;
+
+	// буферы очереди мертвого соединения вернет releaseIfDone()
+	if (conn.dead)
+		return;
+	if (dir.chain_broken) {
+		// send после короткого: его кусок остался в очереди
+		if (dir.sends_inflight == 0) {
+			dir.chain_broken = false;
+			kickSends(conn, to_server);
+		}
+		return;
+	}
+
+	// завершения цепочки приходят по порядку: это всегда голова очереди
+	UringChunk &chunk = dir.queue.front();
+	if (res <= 0) {
+		shutdownConnection(conn);
+		return;
+	}
+	chunk.sent += res;
+	if (chunk.sent < chunk.len) {
+		// приемник не принял все: остаток уйдет новой цепочкой
+		dir.chain_broken = dir.sends_inflight > 0;
+		kickSends(conn, to_server);
+		return;
+	}
+	dir.queued_bytes -= chunk.len;
+	recycleBuffer(chunk.bid);
+	dir.queue.pop_front();
+
+	kickSends(conn, to_server);
+
+	if (dir.recv_paused && !dir.recv_armed &&
+		dir.queue.size() < MAX_QUEUED_CHUNKS / 2 &&
+		conn.state == ConnState::Relaying)
+		armRecv(conn, to_server);
+
+	if (conn.state == ConnState::Closing && conn.to_server.queue.empty() &&
+		conn.to_client.queue.empty())
+		shutdownConnection(conn);
+}
+
+void UringLoop::shutdownConnection(UringConnection &conn) {
+	if (conn.dead)
+		return;
+	conn.dead = true;
+
+	// shutdown() завершает висящие recv/send; fd закрываются в
+	// releaseIfDone(), когда ядро отдаст все CQE этого соединения
+	if (conn.state == ConnState::Connecting)
+		cancel(conn, userData(&conn, CONNECT));
+	conn.state = ConnState::Closing;
+	shutdown(conn.client_fd, SHUT_RDWR);
+	shutdown(conn.server_fd, SHUT_RDWR);
+}
+
+void UringLoop::releaseIfDone(UringConnection &conn) {
+	if (!conn.dead || conn.inflight > 0)
+		return;
+
+	for (UringDirection *dir : {&conn.to_server, &conn.to_client}) {
+		for (const UringChunk &chunk : dir->queue)
+			recycleBuffer(chunk.bid);
+	}
+	close(conn.client_fd);
+	close(conn.server_fd);
+	backends.release(conn.backend);
+	worker->metrics.active_connections.fetch_sub(1, std::memory_order_relaxed);
+	connections.erase(conn.client_fd);
+}
+
+void UringLoop::expireConnects() {
+	auto timeout = std::chrono::milliseconds(options.connect_timeout_ms);
+	auto now = Clock::now();
+
+	while (!connect_deadlines.empty()) {
+		auto [started, client_fd] = connect_deadlines.front();
+		if (started + timeout > now)
+			break;
+		connect_deadlines.pop_front();
+
+		auto it = connections.find(client_fd);
+		if (it == connections.end())
+			continue;
+		UringConnection &conn = it->second;
+		if (conn.state != ConnState::Connecting ||
+			conn.connect_started != started)
+			continue;
+
+		worker->metrics.connect_timeouts.fetch_add(1,
+												   std::memory_order_relaxed);
+		backends.connectFailed(conn.backend);
+		shutdownConnection(conn);
+	}
+}
+
+void UringLoop::rearmStarved() {
+	if (starved.empty() || free_buffers < MIN_FREE_BUFFERS)
+		return;
+
+	// armRecv() может снова пополнить starved
+	std::vector<std::pair<int, bool>> pending;
+	pending.swap(starved);
+	for (auto [client_fd, client_side] : pending) {
+		auto it = connections.find(client_fd);
+		if (it == connections.end())
+			continue;
+		UringConnection &conn = it->second;
+		UringDirection &dir = client_side ? conn.to_server : conn.to_client;
+		if (!conn.dead && !dir.recv_armed && !dir.recv_paused &&
+			conn.state != ConnState::Closing)
+			armRecv(conn, client_side);
+	}
+}
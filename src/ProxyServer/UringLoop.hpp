@@ -0,0 +1,133 @@
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#include "IoUring.hpp"
+#include "ProxyServer.hpp"
+
+// Принятый recv-ом кусок, лежащий в буфере bid пула воркера
+struct UringChunk {
+	uint16_t bid;
+	uint32_t len;
+	// сколько из него уже отправлено: короткий send дошлется следующим
+	uint32_t sent = 0;
+};
+
+// Одно направление пересылки: куски, принятые из сокета-источника и еще не
+// подтвержденные send-ом в сокет-приемник
+struct UringDirection {
+	std::deque<UringChunk> queue;
+	// сумма len кусков очереди
+	size_t queued_bytes = 0;
+	unsigned sends_inflight = 0;
+	// send цепочки завершился коротким, остальные ее send придут с
+	// -ECANCELED и ничего не отправят
+	bool chain_broken = false;
+	// висит многоразовый recv
+	bool recv_armed = false;
+	// recv отменен, потому что приемник не успевает разбирать очередь
+	bool recv_paused = false;
+};
+
+struct alignas(16) UringConnection {
+	int client_fd;
+	int server_fd;
+	int backend = -1;
+	ConnState state = ConnState::Connecting;
+	Clock::time_point connect_started;
+	MessageFramer client_framer{true};
+	ParserSession parser_session;
+	MessageFramer server_framer;
+	UringDirection to_server;
+	UringDirection to_client;
+	// все отправленные в ядро и еще не завершенные операции
+	unsigned inflight = 0;
+	// сокеты закрыты shutdown(), ждем завершения inflight операций
+	bool dead = false;
+};
+
+// Цикл воркера на io_uring: многоразовый recv каждого сокета берет буферы
+// из кольца, зарегистрированного в ядре (IORING_REGISTER_PBUF_RING), а если
+// ядро его не поддерживает или recv из него не получает данных (проверка при
+// запуске), - из группы, переданной IORING_OP_PROVIDE_BUFFERS. Отправка -
+// цепочками связанных send прямо из этих буферов, одна io_uring_enter() на
+// пачку событий. Семантика пересылки та же, что у
+// epoll-цикла ProxyServer::workerLoop.
+class UringLoop {
+  public:
+	UringLoop(Worker *worker, const ProxyOptions &options,
+			  Parser *const &parser, Backends &backends);
+
+	void run();
+
+  private:
+	enum Op : uint64_t {
+		RECV_CLIENT,
+		RECV_SERVER,
+		SEND_SERVER,
+		SEND_CLIENT,
+		CONNECT,
+		CANCEL,
+		ACCEPT,
+		WAKE,
+		TIMER,
+		PROVIDE,
+	};
+
+	static uint64_t userData(UringConnection *conn, Op op) {
+		return reinterpret_cast<uint64_t>(conn) | op;
+	}
+
+	void armAccept();
+	void armWake();
+	void armTimer();
+	void armRecv(UringConnection &conn, bool client_side);
+	void cancel(UringConnection &conn, uint64_t target);
+	// буфер вернется ядру в provideBuffers()
+	void recycleBuffer(uint16_t bid) { recycled.push_back(bid); }
+	void provideBuffers();
+	// recv одного байта из socketpair в буфер кольца
+	bool probeBufferRing();
+	char *buffer(uint16_t bid) {
+		return buffer_memory.data() + static_cast<size_t>(bid) * BUFFER_SIZE;
+	}
+	void kickSends(UringConnection &conn, bool to_server);
+
+	void handleCqe(uint64_t user_data, int res, unsigned flags);
+	void onAccept(int res, unsigned flags);
+	void onWake();
+	void onConnect(UringConnection &conn, int res);
+	void onRecv(UringConnection &conn, bool client_side, int res,
+				unsigned flags);
+	void onSend(UringConnection &conn, bool to_server, int res);
+
+	void registerConnection(const PendingConnection &pending);
+	void shutdownConnection(UringConnection &conn);
+	void releaseIfDone(UringConnection &conn);
+	void expireConnects();
+	void rearmStarved();
+
+	Worker *worker;
+	const ProxyOptions &options;
+	Parser *const &parser;
+	Backends &backends;
+
+	IoUring ring;
+	std::unordered_map<int, UringConnection> connections;
+	std::deque<std::pair<Clock::time_point, int>> connect_deadlines;
+	std::vector<char> buffer_memory;
+	// nullptr - буферы отдаются ядру IORING_OP_PROVIDE_BUFFERS
+	io_uring_buf_ring *buf_ring = nullptr;
+	uint16_t buf_ring_tail = 0;
+	// освободившиеся буферы, еще не возвращенные ядру
+	std::vector<uint16_t> recycled;
+	// буферов у ядра, еще не занятых recv
+	unsigned free_buffers = 0;
+	// (client_fd, сторона), чей recv завершился с -ENOBUFS
+	std::vector<std::pair<int, bool>> starved;
+
+	__kernel_timespec tick{};
+	uint64_t wake_value = 0;
+};
@@ -0,0 +1,428 @@
+#include "QueryStats.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+static bool isWordStart(unsigned char c) {
+	return isalpha(c) || c == '_' || c >= 0x80;
+}
+
+static bool isWordChar(unsigned char c) {
+	return isalnum(c) || c == '_' || c == '$' || c >= 0x80;
+}
+
+static bool isOperatorChar(char c) {
+	return std::strchr("+-*/<>=~!@#%^&|`:", c) != nullptr && c != '\0';
+}
+
+// Токены добавляются в out через add(): пробел ставится между словами и
+// литералами, но не после открывающих скобок и не перед запятыми,
+// закрывающими скобками и точками - так форматирование исходного текста
+// не влияет на результат.
+namespace {
+class Normalizer {
+  public:
+	explicit Normalizer(std::string &out) : out(out) { out.clear(); }
+
+	void add(std::string_view token) {
+		if (!out.empty() && needsSpace(token))
+			out.push_back(' ');
+		out.append(token);
+		if (token == ")")
+			collapseInList();
+	}
+
+	void literal() { add("?"); }
+
+	// ';' в конце текста не меняет запроса
+	void finish() {
+		while (!out.empty() && (out.back() == ';' || out.back() == ' '))
+			out.pop_back();
+	}
+
+  private:
+	bool needsSpace(std::string_view token) const {
+		char prev = out.back();
+		char next = token[0];
+		if (prev == '(' || prev == '[' || prev == '.')
+			return false;
+		if (next == ',' || next == ')' || next == ']' || next == ';' ||
+			next == '.' || next == '[')
+			return false;
+		// приведение типа x::int
+		if (token == "::" || (out.size() >= 2 && out.back() == ':' &&
+							  out[out.size() - 2] == ':'))
+			return false;
+		return true;
+	}
+
+	// "in (?, ?, ?)" -> "in (...)": запросы, отличающиеся только длиной
+	// списка, получают один отпечаток
+	void collapseInList() {
+		size_t open = out.rfind('(');
+		if (open == std::string::npos || open < 3)
+			return;
+		std::string_view inner(out.data() + open + 1, out.size() - open - 2);
+		if (inner.find('?') == std::string_view::npos ||
+			inner.find_first_not_of("?, ") != std::string_view::npos)
+			return;
+		if (out.compare(open - 3, 3, "in ") != 0 ||
+			(open > 3 && isWordChar(out[open - 4])))
+			return;
+		out.resize(open + 1);
+		out.append("...)");
+	}
+
+	std::string &out;
+};
+} // namespace
+
+uint64_t fingerprintQuery(std::string_view query, std::string &normalized) {
+	Normalizer norm(normalized);
+	const size_t n = query.size();
+	size_t i = 0;
+
+	while (i < n) {
+		unsigned char c = query[i];
+
+		if (isspace(c)) {
+			++i;
+		} else if (c == '-' && i + 1 < n && query[i + 1] == '-') {
+			while (i < n && query[i] != '\n')
+				++i;
+		} else if (c == '/' && i + 1 < n && query[i + 1] == '*') {
+			// комментарии /* */ в PostgreSQL вложенные
+			int depth = 0;
+			while (i < n) {
+				if (query[i] == '/' && i + 1 < n && query[i + 1] == '*') {
+					++depth;
+					i += 2;
+				} else if (query[i] == '*' && i + 1 < n &&
+						   query[i + 1] == '/') {
+					i += 2;
+					if (--depth == 0)
+						break;
+				} else {
+					++i;
+				}
+			}
+		} else if (c == '\'') {
+			++i;
+			while (i < n) {
+				if (query[i] == '\'') {
+					if (i + 1 < n && query[i + 1] == '\'') {
+						i += 2;
+						continue;
+					}
+					++i;
+					break;
+				}
+				++i;
+			}
+			norm.literal();
+		} else if (c == '"') {
+			size_t start = i++;
+			while (i < n) {
+				if (query[i] == '"') {
+					if (i + 1 < n && query[i + 1] == '"') {
+						i += 2;
+						continue;
+					}
+					++i;
+					break;
+				}
+				++i;
+			}
+			norm.add(query.substr(start, i - start));
+		} else if (c == '$' && i + 1 < n && isdigit(query[i + 1])) {
+			// параметр $N
+			++i;
+			while (i < n && isdigit(query[i]))
+				++i;
+			norm.literal();
+		} else if (c == '$') {
+			// $tag$ ... $tag$
+			size_t tag_end = i + 1;
+			while (tag_end < n && isWordChar(query[tag_end]) &&
+				   query[tag_end] != '$')
+				++tag_end;
+			if (tag_end < n && query[tag_end] == '$' &&
+				(tag_end == i + 1 || !isdigit(query[i + 1]))) {
+				std::string_view tag = query.substr(i, tag_end + 1 - i);
+				size_t close = query.find(tag, tag_end + 1);
+				i = close == std::string_view::npos ? n : close + tag.size();
+				norm.literal();
+			} else {
+				norm.add("$");
+				++i;
+			}
+		} else if (isdigit(c) ||
+				   (c == '.' && i + 1 < n && isdigit(query[i + 1]))) {
+			while (i < n && (isdigit(query[i]) || query[i] == '.'))
+				++i;
+			if (i < n && (query[i] == 'e' || query[i] == 'E')) {
+				size_t exp = i + 1;
+				if (exp < n && (query[exp] == '+' || query[exp] == '-'))
+					++exp;
+				if (exp < n && isdigit(query[exp])) {
+					i = exp;
+					while (i < n && isdigit(query[i]))
+						++i;
+				}
+			}
+			norm.literal();
+		} else if (isWordStart(c)) {
+			size_t start = i;
+			while (i < n && isWordChar(query[i]))
+				++i;
+			// E'...', B'...', X'...', N'...': префикс - часть литерала
+			if (i - start == 1 && i < n && query[i] == '\'' &&
+				std::strchr("eEbBxXnN", c) != nullptr) {
+				bool escapes = c == 'e' || c == 'E';
+				++i;
+				while (i < n) {
+					if (escapes && query[i] == '\\' && i + 1 < n) {
+						i += 2;
+						continue;
+					}
+					if (query[i] == '\'') {
+						if (i + 1 < n && query[i + 1] == '\'') {
+							i += 2;
+							continue;
+						}
+						++i;
+						break;
+					}
+					++i;
+				}
+				norm.literal();
+				continue;
+			}
+			std::string word(query.substr(start, i - start));
+			for (char &ch : word)
+				ch = static_cast<char>(tolower(static_cast<unsigned char>(ch)));
+			norm.add(word);
+		} else if (isOperatorChar(c)) {
+			size_t start = i;
+			while (i < n && isOperatorChar(query[i]) &&
+				   !(query[i] == '-' && i + 1 < n && query[i + 1] == '-') &&
+				   !(query[i] == '/' && i + 1 < n && query[i + 1] == '*'))
+				++i;
+			norm.add(query.substr(start, i - start));
+		} else {
+			norm.add(query.substr(i, 1));
+			++i;
+		}
+	}
+	norm.finish();
+
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (unsigned char ch : normalized) {
+		hash ^= ch;
+		hash *= 1099511628211ULL;
+	}
+	return hash == 0 ? 1 : hash;
+}
+
+void QueryStatsSummary::add(const QueryStatsEntry &entry) {
+	uint64_t entry_calls = entry.calls.load(std::memory_order_relaxed);
+	if (entry_calls == 0)
+		return;
+	if (text.empty())
+		text.assign(entry.text, entry.text_len);
+
+	uint64_t entry_min = entry.min_us.load(std::memory_order_relaxed);
+	if (calls == 0 || entry_min < min_us)
+		min_us = entry_min;
+	max_us = std::max<uint64_t>(
+		max_us, entry.latency.max_us.load(std::memory_order_relaxed));
+	calls += entry_calls;
+	errors += entry.errors.load(std::memory_order_relaxed);
+	rows += entry.rows.load(std::memory_order_relaxed);
+	total_us += entry.latency.total_us.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i)
+		buckets[i] += entry.latency.buckets[i].load(std::memory_order_relaxed);
+}
+
+uint64_t QueryStatsSummary::percentile(double p) const {
+	uint64_t total = 0;
+	for (uint64_t count : buckets)
+		total += count;
+	if (total == 0)
+		return 0;
+	uint64_t rank = static_cast<uint64_t>(p * total);
+	uint64_t seen = 0;
+	for (size_t i = 0; i < LatencyHistogram::BUCKETS; ++i) {
+		seen += buckets[i];
+		if (seen > rank)
+			return std::min<uint64_t>(1ULL << i, max_us);
+	}
+	return max_us;
+}
+
+QueryStats::QueryStats() : entries(new QueryStatsEntry[CAPACITY + 1]) {
+	QueryStatsEntry &other = entries[OTHER];
+	std::string_view text = "<other>";
+	std::memcpy(other.text, text.data(), text.size());
+	other.text_len = text.size();
+}
+
+uint32_t QueryStats::slot(uint64_t fingerprint, std::string_view normalized) {
+	const size_t mask = CAPACITY - 1;
+	for (size_t i = fingerprint & mask;; i = (i + 1) & mask) {
+		QueryStatsEntry &entry = entries[i];
+		uint64_t current = entry.fingerprint.load(std::memory_order_relaxed);
+		if (current == fingerprint)
+			return i;
+		if (current != 0)
+			continue;
+
+		// таблица заполнена на 3/4: длинные цепочки дороже, чем точность
+		// по редким запросам
+		if (used >= CAPACITY / 4 * 3)
+			return OTHER;
+		entry.text_len = std::min(normalized.size(), QueryStatsEntry::MAX_TEXT);
+		std::memcpy(entry.text, normalized.data(), entry.text_len);
+		entry.fingerprint.store(fingerprint, std::memory_order_release);
+		++used;
+		return i;
+	}
+}
+
+void QueryStats::record(uint32_t slot, uint64_t us, uint64_t rows,
+						bool error) {
+	QueryStatsEntry &entry = entries[slot];
+	uint64_t calls = entry.calls.load(std::memory_order_relaxed);
+	if (calls == 0 || us < entry.min_us.load(std::memory_order_relaxed))
+		entry.min_us.store(us, std::memory_order_relaxed);
+	entry.calls.store(calls + 1, std::memory_order_relaxed);
+	if (error)
+		entry.errors.fetch_add(1, std::memory_order_relaxed);
+	entry.rows.fetch_add(rows, std::memory_order_relaxed);
+	entry.latency.record(us);
+}
+
+void QueryStats::collect(
+	std::unordered_map<uint64_t, QueryStatsSummary> &out) const {
+	for (size_t i = 0; i < CAPACITY; ++i) {
+		uint64_t fingerprint =
+			entries[i].fingerprint.load(std::memory_order_acquire);
+		if (fingerprint != 0)
+			out[fingerprint].add(entries[i]);
+	}
+	// у "<other>" нет отпечатка, в снимке она под ключом 0
+	if (entries[OTHER].calls.load(std::memory_order_relaxed) > 0)
+		out[0].add(entries[OTHER]);
+}
+
+void QueryTracker::onQuery(std::string_view query) {
+	pending.push_back({Kind::Query, prepare(query), Clock::now()});
+}
+
+uint32_t QueryTracker::prepare(std::string_view query) {
+	thread_local std::string normalized;
+	uint64_t fingerprint = fingerprintQuery(query, normalized);
+	return stats->slot(fingerprint, normalized);
+}
+
+void QueryTracker::onExecute(uint32_t slot) {
+	pending.push_back({Kind::Execute, slot, Clock::now()});
+}
+
+void QueryTracker::onSync() {
+	pending.push_back({Kind::Sync, 0, Clock::now()});
+}
+
+bool QueryTracker::wantsResponse(char type) {
+	switch (type) {
+	case 'C':
+	case 'E':
+	case 'I':
+	case 's':
+	case 'Z':
+		return true;
+	default:
+		return false;
+	}
+}
+
+// "SELECT 5", "INSERT 0 5", "UPDATE 5": число строк - последнее слово тега
+static uint64_t commandRows(const char *body, size_t len) {
+	std::string_view tag(body, strnlen(body, len));
+	size_t space = tag.rfind(' ');
+	if (space == std::string_view::npos || space + 1 == tag.size())
+		return 0;
+	uint64_t rows = 0;
+	for (char c : tag.substr(space + 1)) {
+		if (!isdigit(static_cast<unsigned char>(c)))
+			return 0;
+		rows = rows * 10 + (c - '0');
+	}
+	return rows;
+}
+
+void QueryTracker::pop() {
+	// очередь опустевает после каждого ReadyForQuery: вектор сбрасывается,
+	// сохраняя емкость. Если клиент не дает ей опустеть (длинный конвейер),
+	// снятая половина сдвигается, чтобы не копить память
+	if (++head == pending.size()) {
+		pending.clear();
+		head = 0;
+	} else if (head >= 1024 && head * 2 >= pending.size()) {
+		pending.erase(pending.begin(), pending.begin() + head);
+		head = 0;
+	}
+}
+
+void QueryTracker::onMessage(char type, const char *body, size_t len) {
+	if (head == pending.size())
+		return;
+	Pending &front = pending[head];
+
+	switch (type) {
+	case 'C':
+		front.rows += commandRows(body, len);
+		if (front.kind == Kind::Execute) {
+			finish(front);
+			pop();
+		}
+		break;
+	case 'I':
+	case 's':
+		if (front.kind == Kind::Execute) {
+			finish(front);
+			pop();
+		}
+		break;
+	case 'E':
+		front.error = true;
+		if (front.kind == Kind::Execute) {
+			finish(front);
+			pop();
+		}
+		break;
+	case 'Z':
+		// после ошибки сервер пропускает сообщения до Sync: оставшиеся
+		// Execute до него не выполнялись
+		while (head < pending.size()) {
+			Pending done = pending[head];
+			pop();
+			if (done.kind == Kind::Query)
+				finish(done);
+			if (done.kind != Kind::Execute)
+				break;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+void QueryTracker::finish(const Pending &done) {
+	auto elapsed = Clock::now() - done.started;
+	stats->record(
+		done.slot,
+		std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count(),
+		done.rows, done.error);
+}
@@ -0,0 +1,120 @@
+#pragma once
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "MessageFramer.hpp"
+#include "Metrics.hpp"
+
+// Нормализация текста запроса: литералы и параметры $N заменяются на ?,
+// списки IN (?, ?, ...) сворачиваются в IN (...), комментарии убираются,
+// слова вне кавычек приводятся к нижнему регистру, пробелы расставляются
+// заново. Возвращает 64-битный отпечаток нормализованного текста (не 0).
+uint64_t fingerprintQuery(std::string_view query, std::string &normalized);
+
+// Статистика одного отпечатка. Пишет только воркер-владелец, читать можно
+// из любого потока: text заполняется до публикации fingerprint.
+struct QueryStatsEntry {
+	static constexpr size_t MAX_TEXT = 256;
+
+	std::atomic<uint64_t> fingerprint{0};
+	uint32_t text_len = 0;
+	char text[MAX_TEXT];
+	std::atomic<uint64_t> calls{0};
+	std::atomic<uint64_t> errors{0};
+	std::atomic<uint64_t> rows{0};
+	std::atomic<uint64_t> min_us{0};
+	LatencyHistogram latency;
+};
+
+// Снимок статистики отпечатка, сложенный по всем воркерам
+struct QueryStatsSummary {
+	std::string text;
+	uint64_t calls = 0;
+	uint64_t errors = 0;
+	uint64_t rows = 0;
+	uint64_t total_us = 0;
+	uint64_t min_us = 0;
+	uint64_t max_us = 0;
+	std::array<uint64_t, LatencyHistogram::BUCKETS> buckets{};
+
+	void add(const QueryStatsEntry &entry);
+	uint64_t percentile(double p) const;
+};
+
+// Таблица отпечатков воркера фиксированного размера с открытой адресацией:
+// записи не перемещаются, поэтому читатель обходит их без блокировок.
+// Отпечатки сверх емкости учитываются в общей записи "<other>".
+class QueryStats {
+  public:
+	static constexpr size_t CAPACITY = 1024;
+	static constexpr uint32_t OTHER = CAPACITY;
+
+	QueryStats();
+
+	uint32_t slot(uint64_t fingerprint, std::string_view normalized);
+	void record(uint32_t slot, uint64_t us, uint64_t rows, bool error);
+
+	// добавить опубликованные записи в снимок по отпечаткам
+	void collect(std::unordered_map<uint64_t, QueryStatsSummary> &out) const;
+
+  private:
+	std::unique_ptr<QueryStatsEntry[]> entries;
+	size_t used = 0;
+};
+
+// Сопоставление запросов клиента с ответами сервера одного соединения.
+// Клиентские Query, Execute, Sync и FunctionCall ставятся в очередь в
+// порядке отправки; ответы сервера снимают их в том же порядке:
+// CommandComplete/EmptyQueryResponse/PortalSuspended/ErrorResponse
+// завершают Execute, ReadyForQuery - Query и все до ближайшего Sync.
+class QueryTracker : public MessageSink {
+  public:
+	QueryTracker() = default;
+	explicit QueryTracker(QueryStats *stats) : stats(stats) {}
+
+	bool enabled() const { return stats != nullptr; }
+	// ответы сервера разбираются после StartupMessage: до него сервер
+	// шлет только однобайтовые ответы на SSLRequest/GSSENCRequest
+	bool active() const { return stats != nullptr && started; }
+	void start() { started = true; }
+
+	void onQuery(std::string_view query);
+	uint32_t prepare(std::string_view query);
+	void onExecute(uint32_t slot);
+	void onSync();
+
+	// сообщения сервера, которые разбирает трекер
+	static bool wantsResponse(char type);
+
+	bool wantsBody(char type) const override { return wantsResponse(type); }
+	void onMessage(char type, const char *body, size_t len) override;
+
+  private:
+	using Clock = std::chrono::steady_clock;
+
+	enum class Kind { Query, Execute, Sync };
+	struct Pending {
+		Kind kind;
+		uint32_t slot;
+		Clock::time_point started;
+		uint64_t rows = 0;
+		bool error = false;
+	};
+
+	void finish(const Pending &pending);
+	void pop();
+
+	QueryStats *stats = nullptr;
+	bool started = false;
+	// очередь: pending[head] - самый старый запрос
+	std::vector<Pending> pending;
+	size_t head = 0;
+};
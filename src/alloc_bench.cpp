@@ -0,0 +1,152 @@
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <new>
+#include <string>
+
+#include "AsyncLogger.hpp"
+#include "MessageFramer.hpp"
+#include "Parser.hpp"
+#include "QueryStats.hpp"
+
+// Число выделений памяти на клиентское сообщение в установившемся режиме
+// разбора: конвейер Bind/Execute/Sync по заранее подготовленным операторам
+// (как prepared statements sysbench) и простые Query. Считаются только
+// выделения потока разбора; поток записи логгера не учитывается. Ответы
+// сервера (CommandComplete, ReadyForQuery) подаются в трекер запросов, чтобы
+// его очередь тоже работала в установившемся режиме.
+// ./pg_proxy_alloc_bench [iterations]
+
+static thread_local bool counting = false;
+static thread_local size_t allocations = 0;
+
+void *operator new(size_t size) {
+	if (counting)
+		++allocations;
+	if (void *ptr = std::malloc(size ? size : 1))
+		return ptr;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+
+static void message(std::string &out, char type, const std::string &body) {
+	uint32_t len = htonl(static_cast<uint32_t>(body.size() + 4));
+	out.push_back(type);
+	out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+	out.append(body);
+}
+
+static std::string cstr(const std::string &s) { return s + '\0'; }
+
+static const char *QUERY = "SELECT c FROM sbtest1 WHERE id=$1";
+
+// имена длиннее 15 символов не помещаются во встроенный буфер std::string
+static std::string statementName(int i) {
+	return "sbtest_point_select_" + std::to_string(i);
+}
+
+struct Workload {
+	const char *name;
+	// подготовка: Parse всех операторов
+	std::string setup;
+	std::string batch;
+	std::string responses;
+	size_t messages = 0;
+};
+
+static Workload preparedWorkload() {
+	Workload w{"bind/execute/sync", {}, {}, {}, 0};
+	for (int i = 0; i < 8; ++i)
+		message(w.setup, 'P',
+				cstr(statementName(i)) + cstr(QUERY) +
+					std::string(2, '\0'));
+	for (int i = 0; i < 64; ++i) {
+		std::string bind = cstr("") + cstr(statementName(i % 8));
+		bind += std::string("\0\0\0\1", 4);
+		bind += std::string("\0\0\0\4", 4) + std::to_string(1000 + i);
+		bind += std::string(2, '\0');
+		message(w.batch, 'B', bind);
+		message(w.batch, 'E', cstr("") + std::string(4, '\0'));
+		message(w.batch, 'S', "");
+		w.messages += 3;
+		message(w.responses, '2', "");
+		message(w.responses, 'C', cstr("SELECT 1"));
+		message(w.responses, 'Z', "I");
+	}
+	return w;
+}
+
+static Workload simpleWorkload() {
+	Workload w{"simple query", {}, {}, {}, 0};
+	for (int i = 0; i < 64; ++i) {
+		message(w.batch, 'Q',
+				cstr("SELECT c FROM sbtest1 WHERE id=" +
+					 std::to_string(1000 + i % 8)));
+		w.messages += 1;
+		message(w.responses, 'C', cstr("SELECT 1"));
+		message(w.responses, 'Z', "I");
+	}
+	return w;
+}
+
+static void run(const Workload &w, AsyncLogger &logger, bool query_stats,
+				size_t iterations) {
+	bool binary = logger.logFormat() == LogFormat::Binary;
+	Parser parser(&logger);
+	QueryStats stats;
+	ParserSession session(&parser, query_stats ? &stats : nullptr);
+	session.queries.start();
+	MessageFramer client;
+	MessageFramer server;
+	client.feed(w.setup.data(), w.setup.size(), session);
+
+	// первые итерации заводят имена порталов и буферы
+	for (int i = 0; i < 16; ++i) {
+		client.feed(w.batch.data(), w.batch.size(), session);
+		server.feed(w.responses.data(), w.responses.size(), session.queries);
+	}
+
+	allocations = 0;
+	counting = true;
+	for (size_t i = 0; i < iterations; ++i) {
+		client.feed(w.batch.data(), w.batch.size(), session);
+		server.feed(w.responses.data(), w.responses.size(), session.queries);
+	}
+	counting = false;
+
+	printf("%-20s %-6s %-12s %8.3f allocations/message\n", w.name,
+		   binary ? "binary" : "text", query_stats ? "query-stats" : "",
+		   static_cast<double>(allocations) /
+			   static_cast<double>(iterations * w.messages));
+}
+
+int main(int argc, char *argv[]) {
+	size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 1000;
+	std::filesystem::path dir =
+		std::filesystem::temp_directory_path() / "pg_proxy_alloc_bench";
+	std::filesystem::create_directories(dir);
+
+	{
+		// кольцо потока запоминается за логгером, поэтому логгеры живут
+		// все время замера, как в прокси. При переполнении записи
+		// отбрасываются: поток записи не должен тормозить разбор, а на
+		// выделения это не влияет
+		LogQueueOptions queue;
+		queue.overflow = LogOverflow::Drop;
+		AsyncLogger text((dir / "logs.txt").string(), LogFormat::Text, {},
+						 queue);
+		AsyncLogger binary((dir / "logs.bin").string(), LogFormat::Binary, {},
+						   queue);
+		for (const Workload &w : {preparedWorkload(), simpleWorkload()}) {
+			for (AsyncLogger *logger : {&text, &binary}) {
+				run(w, *logger, false, iterations);
+				run(w, *logger, true, iterations);
+			}
+		}
+	}
+	std::filesystem::remove_all(dir);
+	return 0;
+}
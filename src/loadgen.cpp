@@ -0,0 +1,440 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "Crypto.hpp"
+#include "MessageFramer.hpp"
+#include "PgWire.hpp"
+
+// Генератор нагрузки по протоколу PostgreSQL: clients потоков, у каждого
+// свое соединение, запрос - ответ до ReadyForQuery без пауз (закрытый
+// цикл). Режимы: simple - Query, extended - Parse/Bind/Execute/Sync на
+// каждый запрос, prepared - Parse один раз, дальше Bind/Execute/Sync.
+// Печатает пропускную способность, p50/p99/p999 и, с --cpu-pid, время CPU
+// процесса (прокси) на запрос. --min-qps и --max-p99-us задают порог, ниже
+// которого программа завершается с кодом 2, чтобы замер можно было
+// использовать как проверку на регрессию.
+// ./pg_proxy_loadgen <host> <port> [options]
+
+static const char *USAGE =
+	"Usage: ./pg_proxy_loadgen <host> <port> [options]\n"
+	"Options:\n"
+	"  --clients=N          соединений, по потоку на каждое (8)\n"
+	"  --seconds=N          длительность замера (10)\n"
+	"  --warmup-seconds=N   прогрев до замера (1)\n"
+	"  --mode=MODE          simple | extended | prepared (prepared)\n"
+	"  --user=NAME          пользователь (sbuser)\n"
+	"  --database=NAME      база (sbtest)\n"
+	"  --password=PW        пароль для cleartext/md5\n"
+	"  --cpu-pid=PID        считать CPU этого процесса на запрос\n"
+	"  --min-qps=N          код 2, если запросов в секунду меньше\n"
+	"  --max-p99-us=N       код 2, если p99 больше\n";
+
+enum class Mode { Simple, Extended, Prepared };
+
+struct LoadOptions {
+	std::string host;
+	int port = 0;
+	int clients = 8;
+	int seconds = 10;
+	int warmup_seconds = 1;
+	Mode mode = Mode::Prepared;
+	std::string user = "sbuser";
+	std::string database = "sbtest";
+	std::string password;
+	int cpu_pid = 0;
+	long min_qps = 0;
+	long max_p99_us = 0;
+};
+
+using Clock = std::chrono::steady_clock;
+
+// Разбор ответов сервера: считает ReadyForQuery и ошибки, отвечает на
+// запрос пароля
+struct ResponseSink : MessageSink {
+	const LoadOptions *options = nullptr;
+	int fd = -1;
+	uint64_t ready = 0;
+	uint64_t errors = 0;
+	std::string error;
+
+	// ненужные тела framer пропускает вместе с onMessage
+	bool wantsBody(char type) const override {
+		return type == 'Z' || type == 'R' || type == 'E';
+	}
+
+	void onMessage(char type, const char *body, size_t len) override {
+		if (type == 'Z') {
+			++ready;
+		} else if (type == 'E') {
+			++errors;
+			PgReader reader(body, len);
+			// поля: код + строка, нас интересует M
+			while (reader.ok()) {
+				std::string_view field = reader.str();
+				if (field.empty())
+					break;
+				if (field[0] == 'M')
+					error = std::string(field.substr(1));
+			}
+		} else if (type == 'R') {
+			authenticate(body, len);
+		}
+	}
+
+	void authenticate(const char *body, size_t len) {
+		PgReader reader(body, len);
+		uint32_t code = reader.int32();
+		std::string response;
+		if (code == 0)
+			return;
+		if (code == 3) {
+			response = options->password;
+		} else if (code == 5) {
+			std::string_view salt = reader.rest();
+			response = "md5" + md5Hex(md5Hex(options->password + options->user) +
+									  std::string(salt.substr(0, 4)));
+		} else {
+			++errors;
+			error = "unsupported authentication method " + std::to_string(code);
+			return;
+		}
+		std::string msg = PgMessage('p').str(response).finish();
+		send(fd, msg.data(), msg.size(), MSG_NOSIGNAL);
+	}
+};
+
+struct ClientResult {
+	uint64_t queries = 0;
+	uint64_t errors = 0;
+	std::vector<uint64_t> latencies_ns;
+	std::string error;
+};
+
+static int connectTo(const LoadOptions &options) {
+	addrinfo hints{};
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo *res = nullptr;
+	std::string port = std::to_string(options.port);
+	if (getaddrinfo(options.host.c_str(), port.c_str(), &hints, &res) != 0)
+		return -1;
+	int fd = socket(res->ai_family, res->ai_socktype, 0);
+	if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	return fd;
+}
+
+// отправить и читать ответы, пока не придет еще один ReadyForQuery
+static bool roundTrip(int fd, const std::string &request, MessageFramer &framer,
+					  ResponseSink &sink) {
+	if (!request.empty() &&
+		send(fd, request.data(), request.size(), MSG_NOSIGNAL) !=
+			static_cast<ssize_t>(request.size()))
+		return false;
+	uint64_t target = sink.ready + 1;
+	char data[65536];
+	while (sink.ready < target) {
+		ssize_t len = recv(fd, data, sizeof(data), 0);
+		if (len <= 0)
+			return false;
+		framer.feed(data, len, sink);
+	}
+	return true;
+}
+
+static void runClient(const LoadOptions &options, int index,
+					  Clock::time_point measure_start, Clock::time_point end,
+					  ClientResult &result) {
+	int fd = connectTo(options);
+	if (fd < 0) {
+		result.error = std::string("connect() failed: ") + strerror(errno);
+		++result.errors;
+		return;
+	}
+
+	MessageFramer framer;
+	ResponseSink sink;
+	sink.options = &options;
+	sink.fd = fd;
+
+	PgMessage startup(0);
+	startup.int32(PROTOCOL_V3)
+		.str("user")
+		.str(options.user)
+		.str("database")
+		.str(options.database)
+		.str("application_name")
+		.str("pg_proxy_loadgen")
+		.byte(0);
+	if (!roundTrip(fd, startup.finish(), framer, sink) || sink.errors > 0) {
+		result.error = sink.error.empty() ? "startup failed" : sink.error;
+		++result.errors;
+		close(fd);
+		return;
+	}
+
+	const char *query = "SELECT c FROM sbtest1 WHERE id=$1";
+	const char *statement = options.mode == Mode::Prepared ? "loadgen" : "";
+	if (options.mode == Mode::Prepared) {
+		std::string prepare = PgMessage('P').str(statement).str(query).int16(0)
+								  .finish();
+		prepare += PgMessage('S').finish();
+		if (!roundTrip(fd, prepare, framer, sink)) {
+			result.error = "prepare failed";
+			++result.errors;
+			close(fd);
+			return;
+		}
+	}
+
+	result.latencies_ns.reserve(1 << 16);
+	uint64_t id = static_cast<uint64_t>(index) * 7919;
+	std::string request;
+	while (true) {
+		id = id % 100000 + 1;
+		std::string value = std::to_string(id);
+		request.clear();
+		if (options.mode == Mode::Simple) {
+			request = PgMessage('Q')
+						  .str("SELECT c FROM sbtest1 WHERE id=" + value)
+						  .finish();
+		} else {
+			if (options.mode == Mode::Extended)
+				request = PgMessage('P').str("").str(query).int16(0).finish();
+			request += PgMessage('B')
+						   .str("")
+						   .str(statement)
+						   .int16(0)
+						   .int16(1)
+						   .int32(value.size())
+						   .bytes(value)
+						   .int16(0)
+						   .finish();
+			request += PgMessage('E').str("").int32(0).finish();
+			request += PgMessage('S').finish();
+		}
+
+		Clock::time_point started = Clock::now();
+		if (started >= end)
+			break;
+		uint64_t errors_before = sink.errors;
+		if (!roundTrip(fd, request, framer, sink)) {
+			result.error = "connection closed";
+			++result.errors;
+			break;
+		}
+		Clock::time_point finished = Clock::now();
+		if (started < measure_start)
+			continue;
+		++result.queries;
+		if (sink.errors != errors_before)
+			++result.errors;
+		result.latencies_ns.push_back(
+			std::chrono::duration_cast<std::chrono::nanoseconds>(finished -
+																 started)
+				.count());
+	}
+	if (!sink.error.empty())
+		result.error = sink.error;
+
+	std::string terminate = PgMessage('X').finish();
+	send(fd, terminate.data(), terminate.size(), MSG_NOSIGNAL);
+	close(fd);
+}
+
+// utime + stime процесса в тиках
+static long processTicks(int pid) {
+	std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+	std::string stat((std::istreambuf_iterator<char>(in)),
+					 std::istreambuf_iterator<char>());
+	// имя процесса в скобках может содержать пробелы
+	size_t pos = stat.rfind(')');
+	if (pos == std::string::npos)
+		return -1;
+	const char *p = stat.c_str() + pos + 2;
+	// после ")" поле 3 (state); utime и stime - поля 14 и 15
+	for (int field = 3; field < 14; ++field) {
+		p = strchr(p, ' ');
+		if (p == nullptr)
+			return -1;
+		++p;
+	}
+	char *end;
+	long utime = strtol(p, &end, 10);
+	long stime = strtol(end, nullptr, 10);
+	return utime + stime;
+}
+
+static long parseNumber(std::string_view name, const std::string &value) {
+	char *end = nullptr;
+	long result = strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || result < 0) {
+		throw std::invalid_argument("Invalid value for " + std::string(name) +
+									": " + value);
+	}
+	return result;
+}
+
+static LoadOptions parseArgs(int argc, char *argv[]) {
+	if (argc < 3)
+		throw std::invalid_argument(USAGE);
+	LoadOptions options;
+	options.host = argv[1];
+	options.port = atoi(argv[2]);
+	for (int i = 3; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		size_t eq = arg.find('=');
+		std::string_view name = arg.substr(0, eq);
+		std::string value =
+			eq == std::string_view::npos ? "" : std::string(arg.substr(eq + 1));
+		if (name == "--clients") {
+			options.clients = parseNumber(name, value);
+		} else if (name == "--seconds") {
+			options.seconds = parseNumber(name, value);
+		} else if (name == "--warmup-seconds") {
+			options.warmup_seconds = parseNumber(name, value);
+		} else if (name == "--mode") {
+			if (value == "simple")
+				options.mode = Mode::Simple;
+			else if (value == "extended")
+				options.mode = Mode::Extended;
+			else if (value == "prepared")
+				options.mode = Mode::Prepared;
+			else
+				throw std::invalid_argument("Invalid value for --mode: " +
+											value);
+		} else if (name == "--user") {
+			options.user = value;
+		} else if (name == "--database") {
+			options.database = value;
+		} else if (name == "--password") {
+			options.password = value;
+		} else if (name == "--cpu-pid") {
+			options.cpu_pid = parseNumber(name, value);
+		} else if (name == "--min-qps") {
+			options.min_qps = parseNumber(name, value);
+		} else if (name == "--max-p99-us") {
+			options.max_p99_us = parseNumber(name, value);
+		} else {
+			throw std::invalid_argument("Unknown option " + std::string(arg) +
+										"\n" + USAGE);
+		}
+	}
+	if (options.clients == 0 || options.seconds == 0)
+		throw std::invalid_argument("--clients and --seconds must be positive");
+	return options;
+}
+
+static const char *modeName(Mode mode) {
+	switch (mode) {
+	case Mode::Simple:
+		return "simple";
+	case Mode::Extended:
+		return "extended";
+	default:
+		return "prepared";
+	}
+}
+
+int main(int argc, char *argv[]) {
+	LoadOptions options;
+	try {
+		options = parseArgs(argc, argv);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "Ошибка: %s\n", e.what());
+		return 1;
+	}
+
+	Clock::time_point measure_start =
+		Clock::now() + std::chrono::seconds(options.warmup_seconds);
+	Clock::time_point end = measure_start + std::chrono::seconds(options.seconds);
+
+	std::vector<ClientResult> results(options.clients);
+	std::vector<std::thread> threads;
+	for (int i = 0; i < options.clients; ++i)
+		threads.emplace_back(runClient, std::cref(options), i, measure_start,
+							 end, std::ref(results[i]));
+
+	long ticks_start = -1;
+	long ticks_end = -1;
+	if (options.cpu_pid > 0) {
+		std::this_thread::sleep_until(measure_start);
+		ticks_start = processTicks(options.cpu_pid);
+		std::this_thread::sleep_until(end);
+		ticks_end = processTicks(options.cpu_pid);
+	}
+	for (std::thread &thread : threads)
+		thread.join();
+
+	uint64_t queries = 0;
+	uint64_t errors = 0;
+	std::vector<uint64_t> latencies;
+	for (ClientResult &result : results) {
+		queries += result.queries;
+		errors += result.errors;
+		latencies.insert(latencies.end(), result.latencies_ns.begin(),
+						 result.latencies_ns.end());
+		if (!result.error.empty())
+			fprintf(stderr, "client error: %s\n", result.error.c_str());
+	}
+
+	auto percentile = [&](double p) -> double {
+		if (latencies.empty())
+			return 0;
+		size_t rank = std::min(latencies.size() - 1,
+							   static_cast<size_t>(p * latencies.size()));
+		std::nth_element(latencies.begin(), latencies.begin() + rank,
+						 latencies.end());
+		return latencies[rank] / 1000.0;
+	};
+	double qps = static_cast<double>(queries) / options.seconds;
+	double p50 = percentile(0.5);
+	double p99 = percentile(0.99);
+	double p999 = percentile(0.999);
+
+	printf("%s:%d mode=%s clients=%d queries=%llu qps=%.0f p50=%.1fus "
+		   "p99=%.1fus p999=%.1fus errors=%llu",
+		   options.host.c_str(), options.port, modeName(options.mode),
+		   options.clients, static_cast<unsigned long long>(queries), qps, p50,
+		   p99, p999, static_cast<unsigned long long>(errors));
+	if (ticks_start >= 0 && ticks_end >= 0 && queries > 0) {
+		double cpu_us = static_cast<double>(ticks_end - ticks_start) * 1e6 /
+						sysconf(_SC_CLK_TCK);
+		printf(" cpu_us_per_query=%.2f", cpu_us / queries);
+	}
+	printf("\n");
+
+	if (errors > 0 || queries == 0)
+		return 1;
+	if ((options.min_qps > 0 && qps < options.min_qps) ||
+		(options.max_p99_us > 0 && p99 > options.max_p99_us)) {
+		fprintf(stderr, "threshold not met: min_qps=%ld max_p99_us=%ld\n",
+				options.min_qps, options.max_p99_us);
+		return 2;
+	}
+	return 0;
+}
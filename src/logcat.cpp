@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+#include "LogRecord.hpp"
+#include "LogSegment.hpp"
+
+// Вывод сегментов лога в текстовом формате: бинарные записи
+// (--log-format=binary) декодируются, текстовые сегменты выводятся как есть.
+// Читается только подтвержденная заголовком часть сегмента.
+// ./pg_proxy_logcat [-v] <segment> [<segment> ...]
+//   -v  префикс с временем записи и номером соединения (бинарный формат)
+
+static const char *USAGE = "Usage: ./pg_proxy_logcat [-v] <file> [...]\n";
+
+class LogDecoder {
+  public:
+	explicit LogDecoder(bool verbose) : verbose(verbose) {}
+
+	bool decodeFile(const char *path);
+
+  private:
+	bool decodeRecord(const LogRecordHeader &header, const char *fields);
+	void prefix(const LogRecordHeader &header);
+	void flush();
+
+	bool verbose;
+	// определения интернированных текстов из всех прочитанных файлов
+	std::unordered_map<uint32_t, std::string> statements;
+	std::string out;
+};
+
+bool LogDecoder::decodeFile(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 ||
+		st.st_size < static_cast<off_t>(LOG_SEGMENT_HEADER_SIZE)) {
+		fprintf(stderr, "%s: not a pg_proxy log segment\n", path);
+		close(fd);
+		return false;
+	}
+
+	size_t mapped = st.st_size;
+	void *map = mmap(nullptr, mapped, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+	madvise(map, mapped, MADV_SEQUENTIAL);
+
+	// дальше size - только подтвержденная часть отображения
+	size_t size = mapped;
+	const char *data = static_cast<const char *>(map);
+	LogFormat format;
+	uint64_t sequence, committed;
+	bool ok = parseSegmentHeader(data, size, format, sequence, committed);
+	if (!ok)
+		fprintf(stderr, "%s: not a pg_proxy log segment\n", path);
+	else
+		size = std::min<uint64_t>(size, LOG_SEGMENT_HEADER_SIZE + committed);
+
+	size_t offset = LOG_SEGMENT_HEADER_SIZE;
+	if (ok && format == LogFormat::Text) {
+		fwrite(data + offset, 1, size - offset, stdout);
+		offset = size;
+	}
+	while (ok && offset + sizeof(LogRecordHeader) <= size) {
+		LogRecordHeader header;
+		std::memcpy(&header, data + offset, sizeof(header));
+		offset += sizeof(header);
+		if (header.length > size - offset ||
+			!decodeRecord(header, data + offset)) {
+			fprintf(stderr, "%s: corrupted record at offset %zu\n", path,
+					offset - sizeof(header));
+			ok = false;
+			break;
+		}
+		offset += header.length;
+		if (out.size() >= 1 << 20)
+			flush();
+	}
+
+	flush();
+	munmap(map, mapped);
+	return ok;
+}
+
+bool LogDecoder::decodeRecord(const LogRecordHeader &header,
+							  const char *fields) {
+	constexpr size_t MAX_FIELDS = 8;
+	std::string_view field[MAX_FIELDS];
+	size_t count = 0;
+
+	size_t offset = 0;
+	while (offset < header.length) {
+		uint32_t len;
+		if (count == MAX_FIELDS || header.length - offset < sizeof(len))
+			return false;
+		std::memcpy(&len, fields + offset, sizeof(len));
+		offset += sizeof(len);
+		if (len > header.length - offset)
+			return false;
+		field[count++] = std::string_view(fields + offset, len);
+		offset += len;
+	}
+
+	auto statement = [&]() -> std::string_view {
+		auto it = statements.find(header.statement_id);
+		return it == statements.end() ? std::string_view("<unknown statement>")
+									  : std::string_view(it->second);
+	};
+
+	switch (header.type) {
+	case LogRecordType::Statement:
+		if (count < 1)
+			return false;
+		statements[header.statement_id] = field[0];
+		return true;
+	case LogRecordType::Startup:
+		if (count < 2)
+			return false;
+		prefix(header);
+		out.append("[STARTUP] user=").append(field[0]);
+		out.append(" database=").append(field[1]);
+		break;
+	case LogRecordType::Query:
+		if (count < 1)
+			return false;
+		prefix(header);
+		out.append("[QUERY] ").append(field[0]);
+		break;
+	case LogRecordType::Prepare:
+		if (count < 1)
+			return false;
+		prefix(header);
+		out.append("[PREPARE] ").append(field[0]).append(": ");
+		out.append(statement());
+		break;
+	case LogRecordType::Bind: {
+		if (count < 3)
+			return false;
+		prefix(header);
+		out.append("[BIND] ").append(field[0]).append(" → ").append(field[1]);
+		size_t mark = out.size();
+		out.append(" (");
+		formatBindParameters(out, field[2].data(), field[2].size());
+		if (out.size() == mark + 2)
+			out.resize(mark);
+		else
+			out.append(")");
+		break;
+	}
+	case LogRecordType::Execute:
+		if (count < 2)
+			return false;
+		prefix(header);
+		out.append("[EXECUTE] ").append(field[0]).append(" → ");
+		out.append(field[1]).append(": ").append(statement());
+		break;
+	case LogRecordType::ExecuteUnknownStatement:
+		if (count < 2)
+			return false;
+		prefix(header);
+		out.append("[EXECUTE] ").append(field[0]);
+		out.append(" → unknown statement: '").append(field[1]).append("'");
+		break;
+	case LogRecordType::ExecuteUnknownPortal:
+		if (count < 1)
+			return false;
+		prefix(header);
+		out.append("[EXECUTE] unknown portal: '").append(field[0]).append("'");
+		break;
+	default:
+		// записи новых типов пропускаются
+		return true;
+	}
+	out.push_back('\n');
+	return true;
+}
+
+void LogDecoder::prefix(const LogRecordHeader &header) {
+	if (!verbose)
+		return;
+
+	time_t seconds = header.timestamp_ns / 1'000'000'000;
+	unsigned micros = (header.timestamp_ns % 1'000'000'000) / 1000;
+	tm local;
+	localtime_r(&seconds, &local);
+	char buf[64];
+	size_t n = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &local);
+	snprintf(buf + n, sizeof(buf) - n, ".%06u ", micros);
+	out.append(buf);
+	out.append("conn=").append(std::to_string(header.connection_id));
+	out.push_back(' ');
+}
+
+void LogDecoder::flush() {
+	fwrite(out.data(), 1, out.size(), stdout);
+	out.clear();
+}
+
+int main(int argc, char *argv[]) {
+	bool verbose = false;
+	int first = 1;
+	if (first < argc && std::strcmp(argv[first], "-v") == 0) {
+		verbose = true;
+		++first;
+	}
+	if (first >= argc) {
+		fputs(USAGE, stderr);
+		return 2;
+	}
+
+	LogDecoder decoder(verbose);
+	bool ok = true;
+	for (int i = first; i < argc; ++i)
+		ok &= decoder.decodeFile(argv[i]);
+	return ok ? 0 : 1;
+}
@@ -5,7 +5,12 @@
 int main(int argc, char *argv[]) {
 	try {
 		ProxyServer proxy_server(argc, argv);
-		AsyncLogger logger("resources/logs.txt");
+		const ProxyOptions &options = proxy_server.getOptions();
+		AsyncLogger logger(options.log_format == LogFormat::Binary
+							   ? "resources/logs.bin"
+							   : "resources/logs.txt",
+						   options.log_format, options.log_segments,
+						   options.log_queue);
 		Parser parser(&logger);
 		proxy_server.attachParser(&parser);
 		proxy_server.run();
@@ -0,0 +1,234 @@
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#include "MessageScan.hpp"
+
+// Микробенчмарк разбора клиентских пачек: конвейер Bind/Execute/Sync с
+// короткими именами и Parse с длинным текстом запроса. Сравниваются
+// прежний путь Parser (длина через reinterpret_cast, strnlen на каждое
+// поле), текущий (scanNul), разметка всей пачки в массив дескрипторов до
+// разбора и собственные циклы поиска NUL на SSE2/AVX2 (только на x86,
+// как и векторный scanNul).
+// ./pg_proxy_scan_bench [iterations]
+
+static void message(std::string &out, char type, const std::string &body) {
+	uint32_t len = htonl(static_cast<uint32_t>(body.size() + 4));
+	out.push_back(type);
+	out.append(reinterpret_cast<const char *>(&len), sizeof(len));
+	out.append(body);
+}
+
+static std::string cstr(const std::string &s) { return s + '\0'; }
+
+static std::string makeBatch(size_t pipelines) {
+	std::string query = "SELECT c.id, c.name, c.balance, o.total FROM "
+						"customers c JOIN orders o ON o.customer_id = c.id "
+						"WHERE c.region = $1 AND o.created_at > $2 AND "
+						"o.status IN ('new', 'paid', 'shipped') ORDER BY "
+						"o.created_at DESC LIMIT 50";
+	std::string batch;
+	for (size_t i = 0; i < pipelines; ++i) {
+		std::string stmt = "s" + std::to_string(i % 8);
+		if (i % 8 == 0)
+			message(batch, 'P',
+					cstr(stmt) + cstr(query) + std::string(2, '\0'));
+		std::string bind = cstr("") + cstr(stmt);
+		bind += std::string("\0\0\0\2", 4);
+		bind += std::string("\0\0\0\5east1", 9);
+		bind += std::string("\0\0\0\x0a", 4) + "2024-01-01";
+		bind += std::string(2, '\0');
+		message(batch, 'B', bind);
+		message(batch, 'E', cstr("") + std::string(4, '\0'));
+		message(batch, 'S', "");
+	}
+	return batch;
+}
+
+static size_t scanScalar(const char *data, size_t len) {
+	for (size_t i = 0; i < len; ++i) {
+		if (data[i] == '\0')
+			return i;
+	}
+	return len;
+}
+
+#ifdef __SSE2__
+static size_t scanSse2(const char *data, size_t len) {
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= len; i += 16) {
+		__m128i block =
+			_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, zero));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scanScalar(data + i, len - i);
+}
+
+__attribute__((target("avx2"))) static size_t scanAvx2(const char *data,
+													   size_t len) {
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32) {
+		__m256i block =
+			_mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		unsigned mask = static_cast<unsigned>(
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, zero)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return i + scanSse2(data + i, len - i);
+}
+#endif
+
+// поля, которые достают обработчики Parser по типам сообщений
+template <typename Nul>
+static size_t fields(char type, const char *body, size_t len, Nul nul) {
+	switch (type) {
+	case 'P':
+	case 'B': {
+		size_t first = nul(body, len);
+		if (first >= len)
+			return first;
+		return first + nul(body + first + 1, len - first - 1);
+	}
+	case 'E':
+		return nul(body, len);
+	default:
+		return 0;
+	}
+}
+
+static size_t legacyPass(const std::string &batch) {
+	const char *data = batch.data();
+	size_t len = batch.size();
+	size_t offset = 0;
+	size_t sink = 0;
+	while (offset + 5 <= len) {
+		char type = data[offset];
+		uint32_t msg_len =
+			ntohl(*reinterpret_cast<const uint32_t *>(&data[offset + 1]));
+		if (offset + 1 + msg_len > len)
+			break;
+		sink += fields(type, data + offset + 5, msg_len - 4, strnlen);
+		offset += 1 + msg_len;
+	}
+	return sink;
+}
+
+template <typename Nul>
+static size_t walkPass(const std::string &batch, Nul nul) {
+	const char *data = batch.data();
+	size_t len = batch.size();
+	size_t offset = 0;
+	size_t sink = 0;
+	while (offset + 5 <= len) {
+		char type = data[offset];
+		uint32_t msg_len;
+		std::memcpy(&msg_len, data + offset + 1, sizeof(msg_len));
+		msg_len = ntohl(msg_len);
+		if (msg_len < 4 || offset + 1 + msg_len > len)
+			break;
+		sink += fields(type, data + offset + 5, msg_len - 4, nul);
+		offset += 1 + msg_len;
+	}
+	return sink;
+}
+
+struct MessageDescriptor {
+	char type;
+	uint32_t offset;
+	uint32_t length;
+};
+
+template <typename Nul>
+static size_t descriptorPass(const std::string &batch,
+							 std::vector<MessageDescriptor> &messages,
+							 Nul nul) {
+	const char *data = batch.data();
+	size_t len = batch.size();
+	size_t offset = 0;
+	messages.clear();
+	while (len - offset >= 5) {
+		uint32_t msg_len;
+		std::memcpy(&msg_len, data + offset + 1, sizeof(msg_len));
+		msg_len = ntohl(msg_len);
+		if (msg_len < 4 || msg_len > len - offset - 1)
+			break;
+		messages.push_back({data[offset], static_cast<uint32_t>(offset + 5),
+							msg_len - 4});
+		offset += 1 + msg_len;
+	}
+
+	size_t sink = 0;
+	for (const MessageDescriptor &msg : messages)
+		sink += fields(msg.type, data + msg.offset, msg.length, nul);
+	return sink;
+}
+
+template <typename Pass>
+static void run(const char *name, size_t iterations, size_t messages,
+				Pass pass) {
+	size_t sink = 0;
+	pass(sink);
+	auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i < iterations; ++i) {
+		// пачка "меняется" на каждой итерации: без этого компилятор выносит
+		// разбор из цикла
+		asm volatile("" : : : "memory");
+		pass(sink);
+	}
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	double ns = std::chrono::duration<double, std::nano>(elapsed).count() /
+				(static_cast<double>(iterations) * messages);
+	printf("%-32s %8.2f ns/message  (checksum %zu)\n", name, ns, sink);
+}
+
+int main(int argc, char *argv[]) {
+	size_t iterations = argc > 1 ? strtoull(argv[1], nullptr, 10) : 2000;
+	std::string batch = makeBatch(1024);
+	std::vector<MessageDescriptor> messages;
+	auto nul = [](const char *data, size_t len) { return scanNul(data, len); };
+
+	size_t count = 0;
+	for (size_t offset = 0; offset < batch.size(); ++count) {
+		uint32_t msg_len;
+		std::memcpy(&msg_len, batch.data() + offset + 1, sizeof(msg_len));
+		offset += 1 + ntohl(msg_len);
+	}
+#ifdef __SSE2__
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2");
+#else
+	bool avx2 = false;
+#endif
+	printf("batch: %zu bytes, %zu messages, avx2: %s\n", batch.size(), count,
+		   avx2 ? "yes" : "no");
+
+	run("legacy: strnlen", iterations, count,
+		[&](size_t &sink) { sink += legacyPass(batch); });
+	run("walk + scanNul", iterations, count,
+		[&](size_t &sink) { sink += walkPass(batch, nul); });
+	run("descriptors + scanNul", iterations, count,
+		[&](size_t &sink) { sink += descriptorPass(batch, messages, nul); });
+	run("walk + scalar loop", iterations, count,
+		[&](size_t &sink) { sink += walkPass(batch, scanScalar); });
+#ifdef __SSE2__
+	run("walk + sse2 loop", iterations, count,
+		[&](size_t &sink) { sink += walkPass(batch, scanSse2); });
+	if (avx2)
+		run("walk + avx2 loop", iterations, count,
+			[&](size_t &sink) { sink += walkPass(batch, scanAvx2); });
+#endif
+	return 0;
+}
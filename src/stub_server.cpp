@@ -0,0 +1,354 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <system_error>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "MessageFramer.hpp"
+#include "PgWire.hpp"
+
+// Заглушка PostgreSQL для нагрузочных замеров без базы (make bench).
+// Принимает любого пользователя без пароля (trust), отвечает на простой и
+// расширенный протокол заранее собранными результатами: rows строк из
+// одного текстового столбца длиной row_bytes. BEGIN/COMMIT/ROLLBACK меняют
+// статус транзакции в ReadyForQuery, чтобы работал --pool-mode=transaction.
+// ./pg_proxy_stub_server <port> [--threads=N] [--rows=N] [--row-bytes=N]
+
+struct StubOptions {
+	int port = 0;
+	int threads = 1;
+	int rows = 1;
+	int row_bytes = 16;
+};
+
+// Ответы, собранные один раз: сама заглушка не должна быть узким местом
+struct CannedResponses {
+	std::string startup;
+	std::string row_description;
+	// DataRow... CommandComplete
+	std::string rows;
+	std::string parse_complete;
+	std::string bind_complete;
+	std::string close_complete;
+	std::string no_data;
+	std::string parameter_description;
+	std::string ready[3];
+};
+
+static CannedResponses makeResponses(const StubOptions &options) {
+	CannedResponses r;
+	r.startup = PgMessage('R').int32(0).finish();
+	r.startup += PgMessage('S').str("server_version").str("16.0").finish();
+	r.startup += PgMessage('S').str("client_encoding").str("UTF8").finish();
+	r.startup += PgMessage('S').str("integer_datetimes").str("on").finish();
+
+	// text, формат text
+	r.row_description = PgMessage('T')
+							.int16(1)
+							.str("c")
+							.int32(0)
+							.int16(0)
+							.int32(25)
+							.int16(static_cast<uint16_t>(-1))
+							.int32(static_cast<uint32_t>(-1))
+							.int16(0)
+							.finish();
+	std::string value(options.row_bytes, 'x');
+	for (int i = 0; i < options.rows; ++i)
+		r.rows += PgMessage('D').int16(1).int32(value.size()).bytes(value).finish();
+	r.rows += PgMessage('C')
+				  .str("SELECT " + std::to_string(options.rows))
+				  .finish();
+
+	r.parse_complete = PgMessage('1').finish();
+	r.bind_complete = PgMessage('2').finish();
+	r.close_complete = PgMessage('3').finish();
+	r.no_data = PgMessage('n').finish();
+	r.parameter_description = PgMessage('t').int16(0).finish();
+	r.ready[0] = PgMessage('Z').byte('I').finish();
+	r.ready[1] = PgMessage('Z').byte('T').finish();
+	r.ready[2] = PgMessage('Z').byte('E').finish();
+	return r;
+}
+
+struct StubConnection : MessageSink {
+	int fd = -1;
+	const CannedResponses *canned = nullptr;
+	uint32_t backend_pid = 0;
+	MessageFramer framer{true};
+	std::string out;
+	size_t sent = 0;
+	// 'I', 'T' или 'E' - статус для ReadyForQuery
+	char status = 'I';
+	bool close = false;
+
+	bool wantsBody(char type) const override { return true; }
+
+	void onStartupMessage(const char *body, size_t len) override {
+		uint32_t code;
+		std::memcpy(&code, body, sizeof(code));
+		code = ntohl(code);
+		switch (code) {
+		case SSL_REQUEST_CODE:
+		case GSSENC_REQUEST_CODE:
+			out.push_back('N');
+			break;
+		case PROTOCOL_V3:
+			out += canned->startup;
+			out += PgMessage('K').int32(backend_pid).int32(backend_pid).finish();
+			ready();
+			break;
+		default:
+			close = true;
+			break;
+		}
+	}
+
+	void onMessage(char type, const char *body, size_t len) override {
+		switch (type) {
+		case 'Q':
+			query(std::string_view(body, strnlen(body, len)));
+			break;
+		case 'P':
+			out += canned->parse_complete;
+			break;
+		case 'B':
+			out += canned->bind_complete;
+			break;
+		case 'D':
+			if (len > 0 && body[0] == 'S')
+				out += canned->parameter_description;
+			out += canned->row_description;
+			break;
+		case 'E':
+			out += canned->rows;
+			break;
+		case 'C':
+			out += canned->close_complete;
+			break;
+		case 'S':
+			ready();
+			break;
+		case 'X':
+			close = true;
+			break;
+		default:
+			break;
+		}
+	}
+
+	void query(std::string_view text) {
+		auto starts = [&](std::string_view word) {
+			return text.size() >= word.size() &&
+				   strncasecmp(text.data(), word.data(), word.size()) == 0;
+		};
+		if (starts("BEGIN")) {
+			status = 'T';
+			out += PgMessage('C').str("BEGIN").finish();
+		} else if (starts("COMMIT") || starts("ROLLBACK")) {
+			status = 'I';
+			out += PgMessage('C').str(starts("COMMIT") ? "COMMIT" : "ROLLBACK")
+					   .finish();
+		} else if (text.empty()) {
+			out += PgMessage('I').finish();
+		} else {
+			out += canned->row_description;
+			out += canned->rows;
+		}
+		ready();
+	}
+
+	void ready() {
+		out += canned->ready[status == 'I' ? 0 : status == 'T' ? 1 : 2];
+	}
+};
+
+static int listenSocket(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+
+	sockaddr_in addr{};
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = INADDR_ANY;
+	addr.sin_port = htons(port);
+	if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0) {
+		throw std::system_error(errno, std::system_category(), "bind() failed");
+	}
+	if (listen(fd, SOMAXCONN) < 0) {
+		throw std::system_error(errno, std::system_category(),
+								"listen() failed");
+	}
+	return fd;
+}
+
+// true - соединение нужно закрыть
+static bool flush(StubConnection &conn) {
+	while (conn.sent < conn.out.size()) {
+		ssize_t n = send(conn.fd, conn.out.data() + conn.sent,
+						 conn.out.size() - conn.sent, MSG_NOSIGNAL);
+		if (n < 0)
+			return errno != EAGAIN && errno != EWOULDBLOCK;
+		conn.sent += n;
+	}
+	conn.out.clear();
+	conn.sent = 0;
+	return conn.close;
+}
+
+// Цикл потока: свой SO_REUSEPORT сокет и epoll, соединения не делятся
+static void serve(const StubOptions &options, const CannedResponses &canned,
+				  uint32_t first_pid) {
+	int listen_fd = listenSocket(options.port);
+	int epoll_fd = epoll_create1(0);
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+
+	std::unordered_map<int, StubConnection> connections;
+	uint32_t next_pid = first_pid;
+	epoll_event events[256];
+	char data[65536];
+
+	auto closeConnection = [&](int fd) {
+		close(fd);
+		connections.erase(fd);
+	};
+
+	while (true) {
+		int nfds = epoll_wait(epoll_fd, events, 256, -1);
+		for (int i = 0; i < nfds; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == listen_fd) {
+				int client;
+				while ((client = accept4(listen_fd, nullptr, nullptr,
+										 SOCK_NONBLOCK)) >= 0) {
+					int one = 1;
+					setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one,
+							   sizeof(one));
+					StubConnection &conn = connections[client];
+					conn.fd = client;
+					conn.canned = &canned;
+					conn.backend_pid = next_pid++;
+					epoll_event cev{};
+					cev.events = EPOLLIN | EPOLLRDHUP;
+					cev.data.fd = client;
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client, &cev);
+				}
+				continue;
+			}
+
+			auto it = connections.find(fd);
+			if (it == connections.end())
+				continue;
+			StubConnection &conn = it->second;
+
+			if (events[i].events & EPOLLOUT) {
+				if (flush(conn)) {
+					closeConnection(fd);
+					continue;
+				}
+				if (conn.out.empty()) {
+					epoll_event cev{};
+					cev.events = EPOLLIN | EPOLLRDHUP;
+					cev.data.fd = fd;
+					epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &cev);
+				}
+			}
+			if (!(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR)))
+				continue;
+
+			ssize_t len = recv(fd, data, sizeof(data), 0);
+			if (len == 0 || (len < 0 && errno != EAGAIN)) {
+				closeConnection(fd);
+				continue;
+			}
+			if (len < 0)
+				continue;
+			bool pending = !conn.out.empty();
+			conn.framer.feed(data, len, conn);
+			if (conn.framer.opaque())
+				conn.close = true;
+			// пока не ушел прошлый ответ, новый только дописывается
+			if (pending)
+				continue;
+			if (flush(conn)) {
+				closeConnection(fd);
+				continue;
+			}
+			if (!conn.out.empty()) {
+				epoll_event cev{};
+				cev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+				cev.data.fd = fd;
+				epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &cev);
+			}
+		}
+	}
+}
+
+static int parseValue(std::string_view arg, size_t eq) {
+	char *end = nullptr;
+	std::string value(arg.substr(eq + 1));
+	long result = strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0' || result < 0) {
+		throw std::invalid_argument("Invalid value: " + std::string(arg));
+	}
+	return static_cast<int>(result);
+}
+
+int main(int argc, char *argv[]) {
+	try {
+		if (argc < 2) {
+			throw std::invalid_argument(
+				"Usage: ./pg_proxy_stub_server <port> [--threads=N] "
+				"[--rows=N] [--row-bytes=N]");
+		}
+		StubOptions options;
+		options.port = atoi(argv[1]);
+		for (int i = 2; i < argc; ++i) {
+			std::string_view arg = argv[i];
+			size_t eq = arg.find('=');
+			std::string_view name = arg.substr(0, eq);
+			if (eq == std::string_view::npos)
+				throw std::invalid_argument("Unknown option " +
+											std::string(arg));
+			if (name == "--threads")
+				options.threads = parseValue(arg, eq);
+			else if (name == "--rows")
+				options.rows = parseValue(arg, eq);
+			else if (name == "--row-bytes")
+				options.row_bytes = parseValue(arg, eq);
+			else
+				throw std::invalid_argument("Unknown option " +
+											std::string(arg));
+		}
+		if (options.threads == 0)
+			throw std::invalid_argument("--threads must be positive");
+
+		CannedResponses canned = makeResponses(options);
+		std::vector<std::thread> threads;
+		for (int i = 1; i < options.threads; ++i)
+			threads.emplace_back(serve, std::cref(options), std::cref(canned),
+								 static_cast<uint32_t>(i) << 24);
+		serve(options, canned, 1);
+	} catch (const std::exception &e) {
+		fprintf(stderr, "Ошибка: %s\n", e.what());
+		return 1;
+	}
+	return 0;
+}